@@ -1,7 +1,12 @@
-g++ -O3 -msse2 -std=c++11 -Wall -Wextra -Wno-comment -s -static ^
+g++ -O3 -msse2 -std=c++11 -Wall -Wextra -Wno-comment -s -static -pthread ^
   -I src ^
   test/test.cpp ^
   -o bin/test_gcc.exe
+g++ -O3 -msse2 -std=c++11 -Wall -Wextra -Wno-comment -s -static -pthread ^
+  -I src ^
+  test/test_instrumented.cpp ^
+  -o bin/test_instrumented_gcc.exe
 
 "bin/test_gcc.exe"
+"bin/test_instrumented_gcc.exe"
 pause
\ No newline at end of file
@@ -0,0 +1,248 @@
+// htmlcxx2.
+// A simple non-validating parser written in C++.
+//
+// Cache of parse results keyed by document content.
+
+#ifndef __HTML_CACHE_H__
+#define __HTML_CACHE_H__
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+
+#include "htmlcxx2_html.hpp"
+
+namespace htmlcxx2 {
+namespace HTML {
+
+namespace impl {
+
+    // Gives away the tree it built
+    class CacheParser : public ParserDom
+    {
+    public:
+        Tree takeTree() { return std::move(tree_); }
+    };
+
+} // impl
+
+//
+// ParseCache
+//
+
+// Shares the trees of byte identical documents. Lookups hash the document,
+// and compare it with the cached one on a hash match, so a hit costs a pass
+// over the bytes instead of a parse. The cache is split in shards, each with
+// its own lock and CLOCK eviction (a hit only marks the entry as used), and
+// may be used from any number of threads.
+class ParseCache
+{
+public:
+    typedef std::shared_ptr<const Tree> TreePtr;
+
+    // Keeps at most maxEntries trees and, if maxBytes is not 0, at most
+    // maxBytes of documents. A document alone larger than its shard's share
+    // of maxBytes is parsed but not cached.
+    explicit ParseCache(size_t maxEntries = 1024, size_t maxBytes = 0);
+
+    // The tree of the document, parsed by ParserDom if not cached. The tree is
+    // shared and stays valid after being evicted.
+    TreePtr parse(const std::string &html);
+    // The cached tree or null
+    TreePtr find(const std::string &html);
+
+    void clear();
+    size_t size() const;
+    size_t hits() const   { return hits_.load(std::memory_order_relaxed); }
+    size_t misses() const { return misses_.load(std::memory_order_relaxed); }
+
+protected:
+    struct Entry
+    {
+        uint64_t hash;
+        std::string html;
+        TreePtr tree;
+        bool used;
+    };
+
+    struct Shard
+    {
+        Shard() : mutex(), entries(), byHash(), hand(0), bytes(0) { }
+
+        std::mutex mutex;
+        // CLOCK ring, a null tree marks a free slot
+        std::vector<Entry> entries;
+        std::unordered_multimap<uint64_t, size_t> byHash;
+        size_t hand;
+        size_t bytes;
+    };
+
+    Shard& shard(uint64_t hash) { return *shards_[(hash >> 56) % shards_.size()]; }
+    static TreePtr lookup(Shard &shard, uint64_t hash, const std::string &html);
+    void insert(Shard &shard, uint64_t hash, const std::string &html, const TreePtr &tree);
+    void evict(Shard &shard, size_t slot);
+
+    std::vector<std::unique_ptr<Shard> > shards_;
+    size_t entriesPerShard_;
+    size_t bytesPerShard_;
+    std::atomic<size_t> hits_;
+    std::atomic<size_t> misses_;
+};
+
+inline ParseCache::ParseCache(size_t maxEntries, size_t maxBytes) :
+    shards_(), entriesPerShard_(0), bytesPerShard_(0), hits_(0), misses_(0)
+{
+    const size_t shards = maxEntries < 16 ? (maxEntries ? maxEntries : 1) : 16;
+    for (size_t i = 0; i < shards; ++i)
+        shards_.push_back(std::unique_ptr<Shard>(new Shard()));
+    entriesPerShard_ = (maxEntries + shards - 1) / shards;
+    bytesPerShard_ = maxBytes ? (maxBytes + shards - 1) / shards : 0;
+}
+
+inline ParseCache::TreePtr ParseCache::lookup(Shard &shard, uint64_t hash, const std::string &html)
+{
+    typedef std::unordered_multimap<uint64_t, size_t>::const_iterator Found;
+    std::pair<Found, Found> range = shard.byHash.equal_range(hash);
+    for (Found found = range.first; found != range.second; ++found)
+    {
+        Entry &entry = shard.entries[found->second];
+        if (entry.html == html)
+        {
+            entry.used = true;
+            return entry.tree;
+        }
+    }
+    return TreePtr();
+}
+
+inline ParseCache::TreePtr ParseCache::find(const std::string &html)
+{
+    const uint64_t hash = impl::hashBytes(html.data(), html.length());
+    Shard &s = shard(hash);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    return lookup(s, hash, html);
+}
+
+inline ParseCache::TreePtr ParseCache::parse(const std::string &html)
+{
+    const uint64_t hash = impl::hashBytes(html.data(), html.length());
+    Shard &s = shard(hash);
+    {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        TreePtr tree = lookup(s, hash, html);
+        if (tree)
+        {
+            hits_.fetch_add(1, std::memory_order_relaxed);
+            return tree;
+        }
+    }
+    misses_.fetch_add(1, std::memory_order_relaxed);
+
+    // Parse without the lock, the first tree inserted wins if several threads
+    // parse the same document
+    impl::CacheParser parser;
+    parser.parseTree(html);
+    TreePtr tree = std::make_shared<const Tree>(parser.takeTree());
+    if (entriesPerShard_ == 0 || (bytesPerShard_ && html.length() > bytesPerShard_))
+        return tree;
+
+    std::lock_guard<std::mutex> lock(s.mutex);
+    TreePtr existing = lookup(s, hash, html);
+    if (existing)
+        return existing;
+    insert(s, hash, html, tree);
+    return tree;
+}
+
+inline void ParseCache::insert(Shard &shard, uint64_t hash, const std::string &html,
+        const TreePtr &tree)
+{
+    // Second chance: skip and clear the used entries until one was not used
+    // since the hand last passed it
+    size_t slot = shard.entries.size();
+    if (slot < entriesPerShard_ && (!bytesPerShard_ || shard.bytes + html.length() <= bytesPerShard_))
+        shard.entries.push_back(Entry());
+    else
+    {
+        for (;;)
+        {
+            Entry &entry = shard.entries[shard.hand];
+            const size_t current = shard.hand;
+            shard.hand = (shard.hand + 1) % shard.entries.size();
+            if (entry.tree && entry.used)
+            {
+                entry.used = false;
+                continue;
+            }
+            evict(shard, current);
+            if (!bytesPerShard_ || shard.bytes + html.length() <= bytesPerShard_)
+            {
+                slot = current;
+                break;
+            }
+        }
+    }
+
+    Entry &entry = shard.entries[slot];
+    entry.hash = hash;
+    entry.html = html;
+    entry.tree = tree;
+    entry.used = false;
+    shard.byHash.insert(std::make_pair(hash, slot));
+    shard.bytes += html.length();
+}
+
+inline void ParseCache::evict(Shard &shard, size_t slot)
+{
+    Entry &entry = shard.entries[slot];
+    if (!entry.tree)
+        return;
+    typedef std::unordered_multimap<uint64_t, size_t>::iterator Found;
+    std::pair<Found, Found> range = shard.byHash.equal_range(entry.hash);
+    for (Found found = range.first; found != range.second; ++found)
+    {
+        if (found->second == slot)
+        {
+            shard.byHash.erase(found);
+            break;
+        }
+    }
+    shard.bytes -= entry.html.length();
+    entry.html.clear();
+    entry.html.shrink_to_fit();
+    entry.tree.reset();
+}
+
+inline void ParseCache::clear()
+{
+    for (size_t i = 0; i < shards_.size(); ++i)
+    {
+        Shard &s = *shards_[i];
+        std::lock_guard<std::mutex> lock(s.mutex);
+        s.entries.clear();
+        s.byHash.clear();
+        s.hand = 0;
+        s.bytes = 0;
+    }
+}
+
+inline size_t ParseCache::size() const
+{
+    size_t size = 0;
+    for (size_t i = 0; i < shards_.size(); ++i)
+    {
+        Shard &s = *shards_[i];
+        std::lock_guard<std::mutex> lock(s.mutex);
+        size += s.byHash.size();
+    }
+    return size;
+}
+
+} }
+
+#endif
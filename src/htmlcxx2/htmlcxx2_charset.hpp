@@ -0,0 +1,724 @@
+// htmlcxx2.
+// A simple non-validating parser written in C++.
+//
+// Charset detection and decoding to UTF-8.
+
+#ifndef __HTML_CHARSET_H__
+#define __HTML_CHARSET_H__
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+#include "htmlcxx2_html.hpp"
+#include "htmlcxx2_charset_sjis.hpp"
+
+namespace htmlcxx2 {
+namespace HTML {
+
+enum Charset
+{
+    CHARSET_UNKNOWN,
+    CHARSET_UTF8,
+    CHARSET_UTF16LE,
+    CHARSET_UTF16BE,
+    // Also ISO-8859-1 and ASCII, as browsers read them
+    CHARSET_WINDOWS1252,
+    CHARSET_WINDOWS1251,
+    // As Windows-31J, the superset browsers read
+    CHARSET_SHIFT_JIS
+};
+
+namespace impl {
+
+    // Code points of the bytes 0x80 to 0xff, undefined ones map to themselves
+    const uint16_t WINDOWS_1251[128] =
+    {
+        0x0402, 0x0403, 0x201a, 0x0453, 0x201e, 0x2026, 0x2020, 0x2021,
+        0x20ac, 0x2030, 0x0409, 0x2039, 0x040a, 0x040c, 0x040b, 0x040f,
+        0x0452, 0x2018, 0x2019, 0x201c, 0x201d, 0x2022, 0x2013, 0x2014,
+        0x0098, 0x2122, 0x0459, 0x203a, 0x045a, 0x045c, 0x045b, 0x045f,
+        0x00a0, 0x040e, 0x045e, 0x0408, 0x00a4, 0x0490, 0x00a6, 0x00a7,
+        0x0401, 0x00a9, 0x0404, 0x00ab, 0x00ac, 0x00ad, 0x00ae, 0x0407,
+        0x00b0, 0x00b1, 0x0406, 0x0456, 0x0491, 0x00b5, 0x00b6, 0x00b7,
+        0x0451, 0x2116, 0x0454, 0x00bb, 0x0458, 0x0405, 0x0455, 0x0457,
+        0x0410, 0x0411, 0x0412, 0x0413, 0x0414, 0x0415, 0x0416, 0x0417,
+        0x0418, 0x0419, 0x041a, 0x041b, 0x041c, 0x041d, 0x041e, 0x041f,
+        0x0420, 0x0421, 0x0422, 0x0423, 0x0424, 0x0425, 0x0426, 0x0427,
+        0x0428, 0x0429, 0x042a, 0x042b, 0x042c, 0x042d, 0x042e, 0x042f,
+        0x0430, 0x0431, 0x0432, 0x0433, 0x0434, 0x0435, 0x0436, 0x0437,
+        0x0438, 0x0439, 0x043a, 0x043b, 0x043c, 0x043d, 0x043e, 0x043f,
+        0x0440, 0x0441, 0x0442, 0x0443, 0x0444, 0x0445, 0x0446, 0x0447,
+        0x0448, 0x0449, 0x044a, 0x044b, 0x044c, 0x044d, 0x044e, 0x044f
+    };
+
+    const uint16_t WINDOWS_1252[128] =
+    {
+        0x20ac, 0x0081, 0x201a, 0x0192, 0x201e, 0x2026, 0x2020, 0x2021,
+        0x02c6, 0x2030, 0x0160, 0x2039, 0x0152, 0x008d, 0x017d, 0x008f,
+        0x0090, 0x2018, 0x2019, 0x201c, 0x201d, 0x2022, 0x2013, 0x2014,
+        0x02dc, 0x2122, 0x0161, 0x203a, 0x0153, 0x009d, 0x017e, 0x0178,
+        0x00a0, 0x00a1, 0x00a2, 0x00a3, 0x00a4, 0x00a5, 0x00a6, 0x00a7,
+        0x00a8, 0x00a9, 0x00aa, 0x00ab, 0x00ac, 0x00ad, 0x00ae, 0x00af,
+        0x00b0, 0x00b1, 0x00b2, 0x00b3, 0x00b4, 0x00b5, 0x00b6, 0x00b7,
+        0x00b8, 0x00b9, 0x00ba, 0x00bb, 0x00bc, 0x00bd, 0x00be, 0x00bf,
+        0x00c0, 0x00c1, 0x00c2, 0x00c3, 0x00c4, 0x00c5, 0x00c6, 0x00c7,
+        0x00c8, 0x00c9, 0x00ca, 0x00cb, 0x00cc, 0x00cd, 0x00ce, 0x00cf,
+        0x00d0, 0x00d1, 0x00d2, 0x00d3, 0x00d4, 0x00d5, 0x00d6, 0x00d7,
+        0x00d8, 0x00d9, 0x00da, 0x00db, 0x00dc, 0x00dd, 0x00de, 0x00df,
+        0x00e0, 0x00e1, 0x00e2, 0x00e3, 0x00e4, 0x00e5, 0x00e6, 0x00e7,
+        0x00e8, 0x00e9, 0x00ea, 0x00eb, 0x00ec, 0x00ed, 0x00ee, 0x00ef,
+        0x00f0, 0x00f1, 0x00f2, 0x00f3, 0x00f4, 0x00f5, 0x00f6, 0x00f7,
+        0x00f8, 0x00f9, 0x00fa, 0x00fb, 0x00fc, 0x00fd, 0x00fe, 0x00ff
+    };
+
+    // Eight bytes as a word, in memory order whatever the endianness
+    inline uint64_t loadWord(const unsigned char *p)
+    {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        return word;
+    }
+
+    inline uint64_t wordOf(const unsigned char (&bytes)[8])
+    {
+        return loadWord(bytes);
+    }
+
+    inline bool isLabelSpace(char c)
+    {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\f' || c == '\r';
+    }
+
+    // The value of charset= in a Content-Type or a meta content attribute
+    inline std::string charsetParameter(const char *p, const char *end)
+    {
+        static const char name[] = "charset";
+        for (; end - p >= 7; ++p)
+        {
+            if (!iequals(p, p + 7, name))
+                continue;
+            const char *q = p + 7;
+            while (q != end && isLabelSpace(*q))
+                ++q;
+            if (q == end || *q != '=')
+                continue;
+            ++q;
+            while (q != end && isLabelSpace(*q))
+                ++q;
+            if (q != end && (*q == '"' || *q == '\''))
+            {
+                const char *close = static_cast<const char*>(memchr(q + 1, *q, end - q - 1));
+                if (!close)
+                    return std::string();
+                return std::string(q + 1, close);
+            }
+            const char *valueEnd = q;
+            while (valueEnd != end && *valueEnd != ';' && *valueEnd != '"' && *valueEnd != '\''
+                    && !isLabelSpace(*valueEnd))
+                ++valueEnd;
+            return std::string(q, valueEnd);
+        }
+        return std::string();
+    }
+
+} // impl
+
+inline const char* charsetName(Charset charset)
+{
+    switch (charset)
+    {
+        case CHARSET_UTF8:        return "UTF-8";
+        case CHARSET_UTF16LE:     return "UTF-16LE";
+        case CHARSET_UTF16BE:     return "UTF-16BE";
+        case CHARSET_WINDOWS1252: return "windows-1252";
+        case CHARSET_WINDOWS1251: return "windows-1251";
+        case CHARSET_SHIFT_JIS:   return "Shift_JIS";
+        default:                  return "";
+    }
+}
+
+// The charset of a label as found in Content-Type or <meta>, case and the
+// surrounding blankspace ignored
+inline Charset charsetFromLabel(const std::string &label)
+{
+    static const struct { const char *label; Charset charset; } labels[] =
+    {
+        { "utf-8", CHARSET_UTF8 }, { "utf8", CHARSET_UTF8 }, { "unicode-1-1-utf-8", CHARSET_UTF8 },
+        { "utf-16", CHARSET_UTF16LE }, { "utf-16le", CHARSET_UTF16LE }, { "unicode", CHARSET_UTF16LE },
+        { "utf-16be", CHARSET_UTF16BE },
+        { "windows-1252", CHARSET_WINDOWS1252 }, { "cp1252", CHARSET_WINDOWS1252 },
+        { "x-cp1252", CHARSET_WINDOWS1252 }, { "iso-8859-1", CHARSET_WINDOWS1252 },
+        { "iso8859-1", CHARSET_WINDOWS1252 }, { "iso_8859-1", CHARSET_WINDOWS1252 },
+        { "latin1", CHARSET_WINDOWS1252 }, { "l1", CHARSET_WINDOWS1252 },
+        { "us-ascii", CHARSET_WINDOWS1252 }, { "ascii", CHARSET_WINDOWS1252 },
+        { "windows-1251", CHARSET_WINDOWS1251 }, { "cp1251", CHARSET_WINDOWS1251 },
+        { "x-cp1251", CHARSET_WINDOWS1251 },
+        { "shift_jis", CHARSET_SHIFT_JIS }, { "shift-jis", CHARSET_SHIFT_JIS },
+        { "sjis", CHARSET_SHIFT_JIS }, { "x-sjis", CHARSET_SHIFT_JIS },
+        { "ms_kanji", CHARSET_SHIFT_JIS }, { "csshiftjis", CHARSET_SHIFT_JIS },
+        { "windows-31j", CHARSET_SHIFT_JIS }
+    };
+    const char *begin = label.c_str(), *end = begin + label.length();
+    while (begin != end && impl::isLabelSpace(*begin))
+        ++begin;
+    while (end != begin && impl::isLabelSpace(end[-1]))
+        --end;
+    for (size_t i = 0; i < sizeof(labels) / sizeof(labels[0]); ++i)
+        if (impl::iequals(begin, end, labels[i].label))
+            return labels[i].charset;
+    return CHARSET_UNKNOWN;
+}
+
+namespace impl {
+
+    inline Charset bomCharset(const char *data, size_t length)
+    {
+        const unsigned char *p = reinterpret_cast<const unsigned char*>(data);
+        if (length >= 3 && p[0] == 0xef && p[1] == 0xbb && p[2] == 0xbf)
+            return CHARSET_UTF8;
+        if (length >= 2 && p[0] == 0xff && p[1] == 0xfe)
+            return CHARSET_UTF16LE;
+        if (length >= 2 && p[0] == 0xfe && p[1] == 0xff)
+            return CHARSET_UTF16BE;
+        return CHARSET_UNKNOWN;
+    }
+
+    // The charset declared by the first <meta charset> or <meta http-equiv
+    // content> with a known label, comments skipped. A declared UTF-16 can
+    // only be wrong, the bytes read so far being ASCII.
+    inline Charset metaCharset(const char *p, const char *end)
+    {
+        while ((p = static_cast<const char*>(memchr(p, '<', end - p))) != 0)
+        {
+            if (end - p >= 4 && memcmp(p, "<!--", 4) == 0)
+            {
+                const char *close = std::search(p + 4, end, "-->", "-->" + 3);
+                if (close == end)
+                    break;
+                p = close + 3;
+                continue;
+            }
+            if (end - p < 6 || !iequals(p + 1, p + 5, "meta")
+                    || !(isLabelSpace(p[5]) || p[5] == '/'))
+            {
+                ++p;
+                continue;
+            }
+            const char *close = static_cast<const char*>(memchr(p, '>', end - p));
+            if (!close)
+                break;
+            const std::string tag(p, close + 1);
+            p = close + 1;
+
+            std::string charset, content;
+            bool httpEquiv = false;
+            scanAttributes(tag.c_str(), [&](const char *keyBegin, const char *keyEnd,
+                        const char *valueBegin, const char *valueEnd)
+            {
+                if (!valueBegin)
+                    return true;
+                if (iequals(keyBegin, keyEnd, "charset"))
+                    charset.assign(valueBegin, valueEnd);
+                else if (iequals(keyBegin, keyEnd, "content"))
+                    content.assign(valueBegin, valueEnd);
+                else if (iequals(keyBegin, keyEnd, "http-equiv"))
+                    httpEquiv = iequals(valueBegin, valueEnd, "content-type");
+                return true;
+            });
+            if (charset.empty() && httpEquiv)
+                charset = charsetParameter(content.c_str(), content.c_str() + content.length());
+            Charset found = charsetFromLabel(charset);
+            if (found == CHARSET_UTF16LE || found == CHARSET_UTF16BE)
+                found = CHARSET_UTF8;
+            if (found != CHARSET_UNKNOWN)
+                return found;
+        }
+        return CHARSET_UNKNOWN;
+    }
+
+} // impl
+
+// The charset of a document: the one of its byte order mark, else the charset
+// parameter of the HTTP Content-Type it came with, else the one declared by a
+// <meta> within its first prescanLength bytes, else UTF-8
+inline Charset sniffCharset(const char *data, size_t length,
+        const std::string &contentType = std::string(), size_t prescanLength = 1024)
+{
+    Charset charset = impl::bomCharset(data, length);
+    if (charset != CHARSET_UNKNOWN)
+        return charset;
+    charset = charsetFromLabel(impl::charsetParameter(contentType.c_str(),
+                contentType.c_str() + contentType.length()));
+    if (charset != CHARSET_UNKNOWN)
+        return charset;
+    charset = impl::metaCharset(data, data + std::min(length, prescanLength));
+    return charset != CHARSET_UNKNOWN ? charset : CHARSET_UTF8;
+}
+
+inline Charset sniffCharset(const std::string &html, const std::string &contentType = std::string(),
+        size_t prescanLength = 1024)
+{
+    return sniffCharset(html.data(), html.length(), contentType, prescanLength);
+}
+
+//
+// OffsetMap
+//
+
+// Maps offsets between a document and its decoded UTF-8. Stored as runs of
+// characters of the same encoded lengths, so a run of ASCII or of Cyrillic
+// letters costs one entry whatever its length. An offset inside a character
+// maps to the start of the character.
+class OffsetMap
+{
+public:
+    OffsetMap() : runs_() { }
+
+    // Offset in the document of an offset in the UTF-8
+    size_t toInput(size_t output) const;
+    // Offset in the UTF-8 of an offset in the document
+    size_t toOutput(size_t input) const;
+    // Rewrites the offsets and lengths of the nodes to document offsets
+    void toInput(Tree &tree) const;
+
+    bool empty() const { return runs_.empty(); }
+    void clear()       { runs_.clear(); }
+
+protected:
+    friend class Decoder;
+
+    struct Run
+    {
+        size_t input;
+        size_t output;
+        unsigned char inputStep;
+        unsigned char outputStep;
+    };
+
+    void add(size_t input, size_t output, unsigned inputStep, unsigned outputStep)
+    {
+        if (!runs_.empty() && runs_.back().inputStep == inputStep
+                && runs_.back().outputStep == outputStep)
+            return;
+        Run run = { input, output, static_cast<unsigned char>(inputStep),
+            static_cast<unsigned char>(outputStep) };
+        runs_.push_back(run);
+    }
+
+    std::vector<Run> runs_;
+};
+
+inline size_t OffsetMap::toInput(size_t output) const
+{
+    // The last run starting at or before the offset, skipped bytes (a BOM)
+    // start a run of no output
+    size_t i = std::upper_bound(runs_.begin(), runs_.end(), output,
+            [](size_t value, const Run &run) { return value < run.output; }) - runs_.begin();
+    if (i == 0)
+        return output;
+    const Run &run = runs_[i - 1];
+    if (!run.outputStep)
+        return run.input;
+    return run.input + (output - run.output) / run.outputStep * run.inputStep;
+}
+
+inline size_t OffsetMap::toOutput(size_t input) const
+{
+    size_t i = std::upper_bound(runs_.begin(), runs_.end(), input,
+            [](size_t value, const Run &run) { return value < run.input; }) - runs_.begin();
+    if (i == 0)
+        return input;
+    const Run &run = runs_[i - 1];
+    return run.output + (input - run.input) / run.inputStep * run.outputStep;
+}
+
+inline void OffsetMap::toInput(Tree &tree) const
+{
+    for (Tree::iterator it = tree.begin(); it != tree.end(); ++it)
+    {
+        const size_t begin = toInput(it->offset_);
+        const size_t end = toInput(it->offset_ + it->length_);
+        it->offset_ = begin;
+        it->length_ = end - begin;
+    }
+}
+
+//
+// Decoder
+//
+
+// Decodes a document to UTF-8, fed in chunks as they arrive: a character
+// split between two chunks is decoded with the second. A byte order mark at
+// the start is dropped, malformed UTF-16 and Shift_JIS become U+FFFD, UTF-8
+// is copied as is. Runs of ASCII are copied eight bytes at a time.
+//
+//     Decoder decoder(sniffCharset(firstChunk, contentType));
+//     std::string html;
+//     for each chunk
+//         decoder.decode(chunk, html);
+//     decoder.finish(html);
+//     parser.parseTree(html);
+//     decoder.offsets().toInput(tree);  // if offsets in the input are needed
+//
+// Throws std::invalid_argument for a charset it cannot decode.
+class Decoder
+{
+public:
+    explicit Decoder(Charset charset);
+
+    Charset charset() const { return charset_; }
+    // Appends the UTF-8 of the next bytes of the document to output
+    void decode(const char *data, size_t length, std::string &output);
+    void decode(const std::string &data, std::string &output) { decode(data.data(), data.length(), output); }
+    // Decodes what is left at the end of the document
+    void finish(std::string &output);
+    const OffsetMap& offsets() const { return offsets_; }
+
+protected:
+    size_t decodeSome(const unsigned char *p, size_t length, std::string &output);
+    size_t decodeUtf8(const unsigned char *p, size_t length, std::string &output);
+    size_t decodeUtf16(const unsigned char *p, size_t length, std::string &output);
+    size_t decodeSingleByte(const unsigned char *p, size_t length, std::string &output);
+    size_t decodeShiftJis(const unsigned char *p, size_t length, std::string &output);
+
+    Charset charset_;
+    // UTF-8 of each byte, its length first
+    char table_[256][4];
+    // Bytes of a character not complete yet
+    unsigned char pending_[4];
+    size_t pendingLength_;
+    // Bytes decoded, and bytes written
+    size_t input_;
+    size_t output_;
+    OffsetMap offsets_;
+};
+
+inline Decoder::Decoder(Charset charset) :
+    charset_(charset), pendingLength_(0), input_(0), output_(0), offsets_()
+{
+    const uint16_t *high = charset == CHARSET_WINDOWS1252 ? impl::WINDOWS_1252
+        : charset == CHARSET_WINDOWS1251 ? impl::WINDOWS_1251 : 0;
+    if (high)
+    {
+        for (unsigned b = 0; b < 256; ++b)
+            table_[b][0] = static_cast<char>(impl::encodeUtf8(b < 0x80 ? b : high[b - 0x80],
+                        table_[b] + 1));
+    }
+    else if (charset != CHARSET_UTF8 && charset != CHARSET_UTF16LE && charset != CHARSET_UTF16BE
+            && charset != CHARSET_SHIFT_JIS)
+        throw std::invalid_argument(std::string("htmlcxx2: cannot decode charset ") + charsetName(charset));
+}
+
+inline void Decoder::decode(const char *data, size_t length, std::string &output)
+{
+    const unsigned char *p = reinterpret_cast<const unsigned char*>(data);
+    // Complete the pending character with the first bytes
+    while (pendingLength_ && length)
+    {
+        const size_t take = std::min(sizeof(pending_) - pendingLength_, length);
+        memcpy(pending_ + pendingLength_, p, take);
+        const size_t available = pendingLength_ + take;
+        const size_t used = decodeSome(pending_, available, output);
+        if (used >= pendingLength_)
+        {
+            p += used - pendingLength_;
+            length -= used - pendingLength_;
+            pendingLength_ = 0;
+        }
+        else
+        {
+            memmove(pending_, pending_ + used, available - used);
+            pendingLength_ = available - used;
+            p += take;
+            length -= take;
+        }
+    }
+    if (pendingLength_)
+        return;
+    const size_t used = decodeSome(p, length, output);
+    pendingLength_ = length - used;
+    memcpy(pending_, p + used, pendingLength_);
+}
+
+inline void Decoder::finish(std::string &output)
+{
+    // A partial byte order mark is text, a partial UTF-16 character is
+    // replaced, one U+FFFD per code unit, and so is a Shift_JIS lead byte
+    if (charset_ == CHARSET_UTF8)
+    {
+        offsets_.add(input_, output_, 1, 1);
+        output.append(reinterpret_cast<const char*>(pending_), pendingLength_);
+        input_ += pendingLength_;
+        output_ += pendingLength_;
+    }
+    else
+    {
+        for (size_t i = 0; i < pendingLength_; i += 2)
+        {
+            const size_t step = std::min<size_t>(2, pendingLength_ - i);
+            offsets_.add(input_, output_, static_cast<unsigned>(step), 3);
+            output += "\xef\xbf\xbd";
+            input_ += step;
+            output_ += 3;
+        }
+    }
+    pendingLength_ = 0;
+}
+
+inline size_t Decoder::decodeSome(const unsigned char *p, size_t length, std::string &output)
+{
+    if (charset_ == CHARSET_UTF8)
+        return decodeUtf8(p, length, output);
+    if (charset_ == CHARSET_UTF16LE || charset_ == CHARSET_UTF16BE)
+        return decodeUtf16(p, length, output);
+    if (charset_ == CHARSET_SHIFT_JIS)
+        return decodeShiftJis(p, length, output);
+    return decodeSingleByte(p, length, output);
+}
+
+inline size_t Decoder::decodeUtf8(const unsigned char *p, size_t length, std::string &output)
+{
+    size_t used = 0;
+    if (input_ == 0)
+    {
+        static const unsigned char bom[] = { 0xef, 0xbb, 0xbf };
+        const size_t n = std::min<size_t>(length, 3);
+        if (memcmp(p, bom, n) == 0)
+        {
+            if (n < 3)
+                return 0;
+            offsets_.add(0, 0, 3, 0);
+            used = 3;
+            input_ = 3;
+        }
+    }
+    offsets_.add(input_, output_, 1, 1);
+    output.append(reinterpret_cast<const char*>(p) + used, length - used);
+    input_ += length - used;
+    output_ += length - used;
+    return length;
+}
+
+inline size_t Decoder::decodeSingleByte(const unsigned char *p, size_t length, std::string &output)
+{
+    static const unsigned char high[8] = { 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 };
+    const uint64_t mask = impl::wordOf(high);
+    const size_t start = output.size();
+    output.resize(start + length * 3);
+    char *out = &output[start];
+    char *const outBegin = out;
+    const unsigned char *const begin = p, *const end = p + length;
+    while (p != end)
+    {
+        if (end - p >= 8 && (impl::loadWord(p) & mask) == 0)
+        {
+            offsets_.add(input_ + (p - begin), output_ + (out - outBegin), 1, 1);
+            memcpy(out, p, 8);
+            p += 8;
+            out += 8;
+            continue;
+        }
+        const char *utf8 = table_[*p];
+        offsets_.add(input_ + (p - begin), output_ + (out - outBegin), 1, utf8[0]);
+        memcpy(out, utf8 + 1, 3);
+        out += utf8[0];
+        ++p;
+    }
+    output.resize(out - output.data());
+    input_ += length;
+    output_ += out - outBegin;
+    return length;
+}
+
+inline size_t Decoder::decodeShiftJis(const unsigned char *p, size_t length, std::string &output)
+{
+    // As the WHATWG Encoding Standard decodes it: a lead byte with a trail it
+    // cannot pair with becomes U+FFFD, and an ASCII trail is decoded again
+    static const unsigned char high[8] = { 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 };
+    const uint64_t mask = impl::wordOf(high);
+    const size_t start = output.size();
+    output.resize(start + length * 3);
+    char *out = &output[start];
+    char *const outBegin = out;
+    const unsigned char *const begin = p, *const end = p + length;
+    while (p != end)
+    {
+        const size_t in = input_ + (p - begin), at = output_ + (out - outBegin);
+        if (end - p >= 8 && (impl::loadWord(p) & mask) == 0)
+        {
+            offsets_.add(in, at, 1, 1);
+            memcpy(out, p, 8);
+            p += 8;
+            out += 8;
+            continue;
+        }
+        const unsigned char b = *p;
+        uint32_t c = 0xfffd;
+        size_t step = 1;
+        if (b <= 0x80)
+            c = b;
+        else if (b >= 0xa1 && b <= 0xdf)
+            c = 0xff61 + b - 0xa1;
+        else if ((b >= 0x81 && b <= 0x9f) || (b >= 0xe0 && b <= 0xfc))
+        {
+            if (end - p < 2)
+                break;
+            const unsigned char trail = p[1];
+            if ((trail >= 0x40 && trail <= 0x7e) || (trail >= 0x80 && trail <= 0xfc))
+            {
+                const unsigned pointer = (b - (b < 0xa0 ? 0x81 : 0xc1)) * 188
+                    + trail - (trail < 0x7f ? 0x40 : 0x41);
+                if (pointer >= 8836 && pointer < 10716)
+                    c = 0xe000 + pointer - 8836;
+                else
+                {
+                    const uint16_t mapped = impl::SHIFT_JIS[pointer < 8836 ? pointer : pointer - 1880];
+                    if (mapped)
+                        c = mapped;
+                }
+            }
+            if (c != 0xfffd || trail >= 0x80)
+                step = 2;
+        }
+        const size_t n = impl::encodeUtf8(c, out);
+        offsets_.add(in, at, static_cast<unsigned>(step), static_cast<unsigned>(n));
+        out += n;
+        p += step;
+    }
+    output.resize(out - output.data());
+    input_ += p - begin;
+    output_ += out - outBegin;
+    return p - begin;
+}
+
+inline size_t Decoder::decodeUtf16(const unsigned char *p, size_t length, std::string &output)
+{
+    // ASCII code units have a zero high byte and a low byte below 0x80
+    const bool bigEndian = charset_ == CHARSET_UTF16BE;
+    static const unsigned char asciiLe[8] = { 0x80, 0xff, 0x80, 0xff, 0x80, 0xff, 0x80, 0xff };
+    static const unsigned char asciiBe[8] = { 0xff, 0x80, 0xff, 0x80, 0xff, 0x80, 0xff, 0x80 };
+    const uint64_t mask = impl::wordOf(bigEndian ? asciiBe : asciiLe);
+    const int hi = bigEndian ? 0 : 1, lo = 1 - hi;
+
+    const size_t start = output.size();
+    output.resize(start + length / 2 * 3 + 4);
+    char *out = &output[start];
+    char *const outBegin = out;
+    const unsigned char *const begin = p, *const end = p + length;
+    while (end - p >= 2)
+    {
+        const size_t in = input_ + (p - begin), at = output_ + (out - outBegin);
+        if (end - p >= 8 && (impl::loadWord(p) & mask) == 0)
+        {
+            offsets_.add(in, at, 2, 1);
+            out[0] = static_cast<char>(p[lo]);
+            out[1] = static_cast<char>(p[lo + 2]);
+            out[2] = static_cast<char>(p[lo + 4]);
+            out[3] = static_cast<char>(p[lo + 6]);
+            p += 8;
+            out += 4;
+            continue;
+        }
+        uint32_t c = (p[hi] << 8) | p[lo];
+        size_t step = 2;
+        if (c >= 0xd800 && c < 0xdc00)
+        {
+            if (end - p < 4)
+                break;
+            const uint32_t c2 = (p[2 + hi] << 8) | p[2 + lo];
+            if (c2 >= 0xdc00 && c2 < 0xe000)
+            {
+                c = 0x10000 + ((c - 0xd800) << 10) + (c2 - 0xdc00);
+                step = 4;
+            }
+            else
+                c = 0xfffd;
+        }
+        else if (c >= 0xdc00 && c < 0xe000)
+            c = 0xfffd;
+        else if (c == 0xfeff && in == 0)
+        {
+            // Byte order mark
+            offsets_.add(in, at, 2, 0);
+            p += 2;
+            continue;
+        }
+        const size_t n = impl::encodeUtf8(c, out);
+        offsets_.add(in, at, static_cast<unsigned>(step), static_cast<unsigned>(n));
+        out += n;
+        p += step;
+    }
+    output.resize(out - output.data());
+    input_ += p - begin;
+    output_ += out - outBegin;
+    return p - begin;
+}
+
+// Replaces the ill formed sequences of text from offset on with U+FFFD, one
+// per maximal subpart as browsers do, and returns how many were replaced.
+// offset can be Node::invalidUtf8() to skip the part known to be valid.
+inline size_t repairUtf8(std::string &text, size_t offset = 0)
+{
+    if (offset >= text.length())
+        return 0;
+    const size_t invalid = impl::findInvalidUtf8(text.data() + offset, text.length() - offset);
+    if (invalid == std::string::npos)
+        return 0;
+    size_t pos = offset + invalid;
+    std::string repaired(text, 0, pos);
+    size_t replaced = 0;
+    while (pos < text.length())
+    {
+        // The lead and the continuation bytes which could still have followed it
+        const unsigned char *p = reinterpret_cast<const unsigned char*>(text.data()) + pos;
+        ptrdiff_t n;
+        unsigned char lo, hi;
+        size_t length = 1;
+        if (impl::utf8Lead(p[0], n, lo, hi))
+            for (; static_cast<ptrdiff_t>(length) <= n && pos + length < text.length(); ++length)
+            {
+                if (p[length] < lo || p[length] > hi)
+                    break;
+                lo = 0x80;
+                hi = 0xbf;
+            }
+        repaired += "\xef\xbf\xbd";
+        ++replaced;
+        pos += length;
+        const size_t valid = std::min(text.length() - pos,
+                impl::findInvalidUtf8(text.data() + pos, text.length() - pos));
+        repaired.append(text, pos, valid);
+        pos += valid;
+    }
+    text.swap(repaired);
+    return replaced;
+}
+
+// The document as UTF-8: html itself when it is UTF-8 without a byte order
+// mark, else decoded into buffer. offsets, if given, maps the offsets of the
+// result to offsets in html.
+inline const std::string& toUtf8(const std::string &html, Charset charset, std::string &buffer,
+        OffsetMap *offsets = nullptr)
+{
+    if (charset == CHARSET_UTF8 && impl::bomCharset(html.data(), html.length()) != CHARSET_UTF8)
+    {
+        if (offsets)
+            offsets->clear();
+        return html;
+    }
+    Decoder decoder(charset);
+    buffer.clear();
+    decoder.decode(html, buffer);
+    decoder.finish(buffer);
+    if (offsets)
+        *offsets = decoder.offsets();
+    return buffer;
+}
+
+} }
+
+#endif
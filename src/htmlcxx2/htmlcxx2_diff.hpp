@@ -0,0 +1,358 @@
+// htmlcxx2.
+// A simple non-validating parser written in C++.
+//
+// Differences between two parsed trees.
+
+#ifndef __HTML_DIFF_H__
+#define __HTML_DIFF_H__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+
+#include "htmlcxx2_html.hpp"
+
+namespace htmlcxx2 {
+namespace HTML {
+
+//
+// TreeDiff
+//
+
+// Edit script from one tree to another, for instance two versions of a page.
+// Nodes are matched top-down from the roots: among the children of matched
+// nodes, identical subtrees are anchored first (common ends, then subtrees
+// found once on each side, in order), the rest is matched by kind and tag name
+// with a longest common subsequence where small enough and from the ends
+// otherwise. The subtrees left over are removed or inserted, matched nodes
+// whose own text changed are modified. On the usual changes from one version
+// of a page to the next this is linear in the size of the trees, plus a log
+// factor for the anchors. Moves are a removal and an insertion.
+//
+// Subtrees are compared with a hash of their exact text, attributes included
+// (Node::hash() is as loose as Node::operator==), computed by the diff.
+class TreeDiff
+{
+public:
+    enum Operation
+    {
+        DIFF_REMOVE,
+        DIFF_INSERT,
+        DIFF_MODIFY
+    };
+
+    struct Edit
+    {
+        Operation operation;
+        // The subtree removed or the node modified in the old tree, and the
+        // subtree inserted or the node modified in the new one. A removal has
+        // as after the new node matched with the parent of what it removes,
+        // an insertion as before the old node matched with its parent.
+        Tree::iterator before;
+        Tree::iterator after;
+    };
+
+    // Gaps between anchors are matched by LCS up to that many pairs of nodes
+    explicit TreeDiff(size_t maxAlignment = 1 << 16) :
+        maxAlignment_(maxAlignment), edits_(), matched_(0), before_(), after_() { }
+
+    const std::vector<Edit>& compute(const Tree &before, const Tree &after);
+    const std::vector<Edit>& edits() const { return edits_; }
+    // Pairs of nodes matched by the last compute(), roots included
+    size_t matched() const { return matched_; }
+
+protected:
+    // A tree in pre-order: the children of i start at i + 1, each one
+    // followed by its subtree
+    struct Indexed
+    {
+        std::vector<Tree::iterator> nodes;
+        std::vector<size_t> sizes;
+        std::vector<uint64_t> hashes;
+    };
+
+    // Node pairs to compare and edits to output, in document order
+    struct Task
+    {
+        size_t before;
+        size_t after;
+        bool compare;
+        Operation operation;
+    };
+
+    static void index(const Tree &tree, Indexed &indexed);
+    static void children(const Indexed &indexed, size_t node, std::vector<size_t> &out);
+    static bool sameKind(const Node &lhs, const Node &rhs);
+    static bool sameText(const Node &lhs, const Node &rhs);
+    // Matched children as pairs of indexes in a and b
+    void align(const std::vector<size_t> &a, const std::vector<size_t> &b,
+            std::vector<std::pair<size_t, size_t> > &pairs) const;
+    void alignGap(const std::vector<size_t> &a, size_t aBegin, size_t aEnd,
+            const std::vector<size_t> &b, size_t bBegin, size_t bEnd,
+            std::vector<std::pair<size_t, size_t> > &pairs) const;
+    void compare(size_t before, size_t after, std::vector<Task> &stack);
+
+    size_t maxAlignment_;
+    std::vector<Edit> edits_;
+    size_t matched_;
+    Indexed before_;
+    Indexed after_;
+};
+
+inline void TreeDiff::index(const Tree &tree, Indexed &indexed)
+{
+    indexed.nodes.clear();
+    for (Tree::iterator it = tree.begin(); it != tree.end(); ++it)
+        indexed.nodes.push_back(it);
+    const size_t n = indexed.nodes.size();
+    indexed.sizes.assign(n, 1);
+    indexed.hashes.assign(n, 0);
+
+    // Children are after their parent: sizes and hashes are done from the end
+    for (size_t i = n; i-- > 0; )
+    {
+        const Node &node = *indexed.nodes[i];
+        uint64_t hash = impl::hashBytes(node.text().data(), node.text().length(), node.kind());
+        hash = impl::hashBytes(node.closingText().data(), node.closingText().length(), hash);
+        for (size_t child = i + 1; child < n && Tree::parent(indexed.nodes[child]) == indexed.nodes[i];
+                child += indexed.sizes[child])
+        {
+            indexed.sizes[i] += indexed.sizes[child];
+            hash = impl::hashMix(hash * 0x9e3779b97f4a7c15ull + indexed.hashes[child]);
+        }
+        indexed.hashes[i] = hash;
+    }
+}
+
+inline void TreeDiff::children(const Indexed &indexed, size_t node, std::vector<size_t> &out)
+{
+    out.clear();
+    const size_t end = node + indexed.sizes[node];
+    for (size_t child = node + 1; child < end; child += indexed.sizes[child])
+        out.push_back(child);
+}
+
+inline bool TreeDiff::sameKind(const Node &lhs, const Node &rhs)
+{
+    return lhs.kind() == rhs.kind() && lhs.tagName() == rhs.tagName();
+}
+
+inline bool TreeDiff::sameText(const Node &lhs, const Node &rhs)
+{
+    return lhs.text() == rhs.text() && lhs.closingText() == rhs.closingText();
+}
+
+inline void TreeDiff::alignGap(const std::vector<size_t> &a, size_t aBegin, size_t aEnd,
+        const std::vector<size_t> &b, size_t bBegin, size_t bEnd,
+        std::vector<std::pair<size_t, size_t> > &pairs) const
+{
+    // Same kinds at both ends first
+    size_t suffix = 0;
+    while (aBegin < aEnd && bBegin < bEnd
+            && sameKind(*before_.nodes[a[aBegin]], *after_.nodes[b[bBegin]]))
+        pairs.push_back(std::make_pair(a[aBegin++], b[bBegin++]));
+    while (aBegin < aEnd - suffix && bBegin < bEnd - suffix
+            && sameKind(*before_.nodes[a[aEnd - suffix - 1]], *after_.nodes[b[bEnd - suffix - 1]]))
+        ++suffix;
+    const size_t m = aEnd - suffix - aBegin, n = bEnd - suffix - bBegin;
+
+    if (m && n && m * n <= maxAlignment_)
+    {
+        // Longest common subsequence of the kinds
+        std::vector<uint32_t> lengths((m + 1) * (n + 1), 0);
+        for (size_t i = m; i-- > 0; )
+            for (size_t j = n; j-- > 0; )
+                lengths[i * (n + 1) + j] = sameKind(*before_.nodes[a[aBegin + i]], *after_.nodes[b[bBegin + j]])
+                    ? lengths[(i + 1) * (n + 1) + j + 1] + 1
+                    : std::max(lengths[(i + 1) * (n + 1) + j], lengths[i * (n + 1) + j + 1]);
+        for (size_t i = 0, j = 0; i < m && j < n; )
+        {
+            if (sameKind(*before_.nodes[a[aBegin + i]], *after_.nodes[b[bBegin + j]]))
+                pairs.push_back(std::make_pair(a[aBegin + i++], b[bBegin + j++]));
+            else if (lengths[(i + 1) * (n + 1) + j] >= lengths[i * (n + 1) + j + 1])
+                ++i;
+            else
+                ++j;
+        }
+    }
+
+    for (size_t k = suffix; k > 0; --k)
+        pairs.push_back(std::make_pair(a[aEnd - k], b[bEnd - k]));
+}
+
+inline void TreeDiff::align(const std::vector<size_t> &a, const std::vector<size_t> &b,
+        std::vector<std::pair<size_t, size_t> > &pairs) const
+{
+    pairs.clear();
+    size_t prefix = 0, suffix = 0;
+    while (prefix < a.size() && prefix < b.size()
+            && before_.hashes[a[prefix]] == after_.hashes[b[prefix]])
+    {
+        pairs.push_back(std::make_pair(a[prefix], b[prefix]));
+        ++prefix;
+    }
+    while (suffix < a.size() - prefix && suffix < b.size() - prefix
+            && before_.hashes[a[a.size() - suffix - 1]] == after_.hashes[b[b.size() - suffix - 1]])
+        ++suffix;
+    const size_t aEnd = a.size() - suffix, bEnd = b.size() - suffix;
+
+    // Subtrees found once on each side, in the same order: the longest
+    // increasing subsequence of their old positions, taken in new order
+    typedef std::unordered_map<uint64_t, std::pair<size_t, size_t> > Counts;
+    Counts aCounts, bCounts;
+    for (size_t i = prefix; i < aEnd; ++i)
+    {
+        std::pair<size_t, size_t> &count = aCounts[before_.hashes[a[i]]];
+        ++count.first;
+        count.second = i;
+    }
+    for (size_t j = prefix; j < bEnd; ++j)
+    {
+        std::pair<size_t, size_t> &count = bCounts[after_.hashes[b[j]]];
+        ++count.first;
+        count.second = j;
+    }
+    std::vector<std::pair<size_t, size_t> > unique;
+    for (size_t j = prefix; j < bEnd; ++j)
+    {
+        Counts::const_iterator found = aCounts.find(after_.hashes[b[j]]);
+        if (found != aCounts.end() && found->second.first == 1
+                && bCounts[after_.hashes[b[j]]].first == 1)
+            unique.push_back(std::make_pair(found->second.second, j));
+    }
+    std::vector<size_t> tails, previous(unique.size());
+    for (size_t k = 0; k < unique.size(); ++k)
+    {
+        size_t low = 0, high = tails.size();
+        while (low < high)
+        {
+            const size_t mid = (low + high) / 2;
+            if (unique[tails[mid]].first < unique[k].first)
+                low = mid + 1;
+            else
+                high = mid;
+        }
+        previous[k] = low ? tails[low - 1] : static_cast<size_t>(-1);
+        if (low == tails.size())
+            tails.push_back(k);
+        else
+            tails[low] = k;
+    }
+    std::vector<std::pair<size_t, size_t> > anchors;
+    for (size_t k = tails.empty() ? static_cast<size_t>(-1) : tails.back();
+            k != static_cast<size_t>(-1); k = previous[k])
+        anchors.push_back(unique[k]);
+    std::reverse(anchors.begin(), anchors.end());
+
+    size_t i = prefix, j = prefix;
+    for (size_t k = 0; k < anchors.size(); ++k)
+    {
+        alignGap(a, i, anchors[k].first, b, j, anchors[k].second, pairs);
+        pairs.push_back(std::make_pair(a[anchors[k].first], b[anchors[k].second]));
+        i = anchors[k].first + 1;
+        j = anchors[k].second + 1;
+    }
+    alignGap(a, i, aEnd, b, j, bEnd, pairs);
+    for (size_t k = suffix; k > 0; --k)
+        pairs.push_back(std::make_pair(a[a.size() - k], b[b.size() - k]));
+}
+
+inline void TreeDiff::compare(size_t before, size_t after, std::vector<Task> &stack)
+{
+    std::vector<size_t> a, b;
+    children(before_, before, a);
+    children(after_, after, b);
+    std::vector<std::pair<size_t, size_t> > pairs;
+    align(a, b, pairs);
+    matched_ += pairs.size();
+
+    // Tasks in document order, pushed from the last one
+    std::vector<Task> tasks;
+    size_t i = 0, j = 0;
+    for (size_t k = 0; k <= pairs.size(); ++k)
+    {
+        const size_t aNext = k < pairs.size() ? pairs[k].first : static_cast<size_t>(-1);
+        const size_t bNext = k < pairs.size() ? pairs[k].second : static_cast<size_t>(-1);
+        for (; i < a.size() && a[i] != aNext; ++i)
+        {
+            Task task = { a[i], after, false, DIFF_REMOVE };
+            tasks.push_back(task);
+        }
+        for (; j < b.size() && b[j] != bNext; ++j)
+        {
+            Task task = { before, b[j], false, DIFF_INSERT };
+            tasks.push_back(task);
+        }
+        if (k < pairs.size())
+        {
+            if (before_.hashes[aNext] != after_.hashes[bNext])
+            {
+                Task task = { aNext, bNext, true, DIFF_MODIFY };
+                tasks.push_back(task);
+            }
+            else
+                matched_ += before_.sizes[aNext] - 1;
+            ++i;
+            ++j;
+        }
+    }
+    stack.insert(stack.end(), tasks.rbegin(), tasks.rend());
+}
+
+inline const std::vector<TreeDiff::Edit>& TreeDiff::compute(const Tree &before, const Tree &after)
+{
+    edits_.clear();
+    matched_ = 0;
+    index(before, before_);
+    index(after, after_);
+    if (before_.nodes.empty() || after_.nodes.empty())
+    {
+        for (size_t i = 0; i < before_.nodes.size(); i += before_.sizes[i])
+        {
+            Edit edit = { DIFF_REMOVE, before_.nodes[i], Tree::iterator() };
+            edits_.push_back(edit);
+        }
+        for (size_t j = 0; j < after_.nodes.size(); j += after_.sizes[j])
+        {
+            Edit edit = { DIFF_INSERT, Tree::iterator(), after_.nodes[j] };
+            edits_.push_back(edit);
+        }
+        return edits_;
+    }
+
+    // The roots are matched, children are compared depth first so that the
+    // edits come in document order
+    matched_ = 1;
+    std::vector<Task> stack;
+    if (before_.hashes[0] != after_.hashes[0])
+    {
+        Task root = { 0, 0, true, DIFF_MODIFY };
+        stack.push_back(root);
+    }
+    else
+        matched_ = before_.nodes.size();
+    while (!stack.empty())
+    {
+        const Task task = stack.back();
+        stack.pop_back();
+        if (!task.compare)
+        {
+            Edit edit = { task.operation, before_.nodes[task.before], after_.nodes[task.after] };
+            edits_.push_back(edit);
+            continue;
+        }
+        if (!sameText(*before_.nodes[task.before], *after_.nodes[task.after]))
+        {
+            Edit edit = { DIFF_MODIFY, before_.nodes[task.before], after_.nodes[task.after] };
+            edits_.push_back(edit);
+        }
+        compare(task.before, task.after, stack);
+    }
+    return edits_;
+}
+
+} }
+
+#endif
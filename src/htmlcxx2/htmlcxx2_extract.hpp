@@ -0,0 +1,275 @@
+// htmlcxx2.
+// A simple non-validating parser written in C++.
+//
+// Single pass extraction of attributes and texts.
+
+#ifndef __HTML_EXTRACT_H__
+#define __HTML_EXTRACT_H__
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include <unordered_map>
+#include <stdexcept>
+
+#include "htmlcxx2_html.hpp"
+#include "htmlcxx2_selector.hpp"
+
+namespace htmlcxx2 {
+namespace HTML {
+
+namespace impl {
+    class ExtractionRun;
+}
+
+//
+// ExtractionPlan
+//
+
+// A set of rules compiled once and run together in one pass over the tokens
+// of a document, without building a tree. A rule selects opening tags with a
+// compound selector (a tag name or '*' with optional #id, .class and [attr]
+// conditions, e.g. meta[property^="og:"]) and extracts one attribute of them,
+// or their text up to the closing tag when the attribute is empty. Only the
+// attributes in the rules are looked at and copied, the others are skipped.
+// Elements are closed as in ParserDom: a closing tag ends the texts of its
+// element and of every element left open inside of it. Void elements (br,
+// img...) have no text.
+//
+// The plan is not modified by run() and can be shared between threads.
+class ExtractionPlan
+{
+public:
+    // Receives the opening tag and the raw (not entity decoded) value
+    typedef std::function<void(const Node &tag, const std::string &value)> Callback;
+
+    ExtractionPlan() : rules_(), byTag_(), anyTag_() { }
+
+    // Throws std::invalid_argument if the selector is not a single compound
+    // selector
+    ExtractionPlan& add(const std::string &selector, const std::string &attribute,
+            Callback callback);
+
+    void run(const std::string &html) const;
+
+    size_t size() const { return rules_.size(); }
+    bool empty() const { return rules_.empty(); }
+
+protected:
+    friend class impl::ExtractionRun;
+
+    struct Rule
+    {
+        impl::SelectorCompound compound;
+        // Lower case, empty for the text
+        std::string attribute;
+        Callback callback;
+    };
+
+    std::vector<Rule> rules_;
+    // Rules by tag name, and the rules for any tag
+    std::unordered_map<std::string, std::vector<size_t> > byTag_;
+    std::vector<size_t> anyTag_;
+};
+
+namespace impl {
+
+    class ExtractionRun : public ParserSax
+    {
+    public:
+        ExtractionRun(const std::vector<ExtractionPlan::Rule> &rules,
+                const std::unordered_map<std::string, std::vector<size_t> > &byTag,
+                const std::vector<size_t> &anyTag) :
+            rules_(rules), byTag_(byTag), anyTag_(anyTag), candidates_(), values_(),
+            open_(), captures_() { }
+
+    protected:
+        struct Capture
+        {
+            size_t rule;
+            Node tag;
+            std::string text;
+            // Index of the element in open_
+            size_t depth;
+        };
+
+        virtual void onBeginParsing()
+        {
+            open_.clear();
+            captures_.clear();
+            // Text is only read while a capture is open, attribute rules
+            // alone run on the tags
+            tagsOnly_ = true;
+        }
+
+        virtual void onFoundTag(Node &node, bool isClosingTag)
+        {
+            if (isClosingTag)
+            {
+                // The innermost element of that name closes with everything
+                // opened inside of it, the tag is ignored if there is none
+                for (size_t i = open_.size(); i-- > 0; )
+                {
+                    if (open_[i] == node.tagName())
+                    {
+                        open_.resize(i);
+                        closeCaptures(i);
+                        break;
+                    }
+                }
+                return;
+            }
+            const bool isVoid = isVoidElement(node.tagName());
+            if (!isVoid)
+                open_.push_back(node.tagName());
+
+            candidates_.clear();
+            std::unordered_map<std::string, std::vector<size_t> >::const_iterator found =
+                byTag_.find(node.tagName());
+            if (found != byTag_.end())
+                candidates_.insert(candidates_.end(), found->second.begin(), found->second.end());
+            if (!anyTag_.empty())
+            {
+                // Callbacks are called in the order of the rules
+                candidates_.insert(candidates_.end(), anyTag_.begin(), anyTag_.end());
+                std::sort(candidates_.begin(), candidates_.end());
+            }
+            if (candidates_.empty())
+                return;
+
+            // Drop the rules whose conditions fail, then find all the wanted
+            // values in one scan of the attributes
+            size_t kept = 0, wanted = 0;
+            for (size_t i = 0; i < candidates_.size(); ++i)
+            {
+                const ExtractionPlan::Rule &rule = rules_[candidates_[i]];
+                const SelectorCompound &compound = rule.compound;
+                if ((!compound.id.empty() || !compound.classes.empty()
+                            || !compound.attributes.empty())
+                        && !matchSelectorAttributes(compound, node))
+                    continue;
+                candidates_[kept++] = candidates_[i];
+                if (!rule.attribute.empty())
+                    ++wanted;
+            }
+            candidates_.resize(kept);
+
+            values_.assign(candidates_.size(), Span());
+            if (wanted)
+            {
+                scanAttributes(node.text().c_str(), [&](const char *keyBegin, const char *keyEnd,
+                        const char *valueBegin, const char *valueEnd)
+                {
+                    for (size_t i = 0; i < candidates_.size(); ++i)
+                    {
+                        const std::string &attribute = rules_[candidates_[i]].attribute;
+                        if (values_[i].key || attribute.empty()
+                                || !iequals(keyBegin, keyEnd, attribute.c_str()))
+                            continue;
+                        // The first occurrence counts, as in Node::attribute()
+                        values_[i].key = keyBegin;
+                        values_[i].begin = valueBegin;
+                        values_[i].end = valueEnd;
+                        --wanted;
+                    }
+                    return wanted != 0;
+                });
+            }
+
+            for (size_t i = 0; i < candidates_.size(); ++i)
+            {
+                const ExtractionPlan::Rule &rule = rules_[candidates_[i]];
+                if (rule.attribute.empty() && isVoid)
+                    rule.callback(node, std::string());
+                else if (rule.attribute.empty())
+                {
+                    Capture capture = { candidates_[i], node, std::string(), open_.size() - 1 };
+                    captures_.push_back(capture);
+                    tagsOnly_ = false;
+                }
+                else if (values_[i].key)
+                {
+                    rule.callback(node, values_[i].begin ?
+                            std::string(values_[i].begin, values_[i].end) : std::string());
+                }
+            }
+        }
+
+        virtual void onFoundText(Node &node)
+        {
+            for (size_t i = 0; i < captures_.size(); ++i)
+                captures_[i].text += node.text();
+        }
+
+        virtual void onEndParsing()
+        {
+            closeCaptures(0);
+        }
+
+        // Reports the texts of the elements from depth on, which were closed
+        void closeCaptures(size_t depth)
+        {
+            size_t kept = 0;
+            for (size_t i = 0; i < captures_.size(); ++i)
+            {
+                Capture &capture = captures_[i];
+                if (capture.depth >= depth)
+                {
+                    rules_[capture.rule].callback(capture.tag, capture.text);
+                    continue;
+                }
+                if (kept != i)
+                    captures_[kept] = std::move(capture);
+                ++kept;
+            }
+            captures_.erase(captures_.begin() + kept, captures_.end());
+            tagsOnly_ = captures_.empty();
+        }
+
+        struct Span
+        {
+            Span() : key(nullptr), begin(nullptr), end(nullptr) { }
+            const char *key;
+            const char *begin;
+            const char *end;
+        };
+
+        const std::vector<ExtractionPlan::Rule> &rules_;
+        const std::unordered_map<std::string, std::vector<size_t> > &byTag_;
+        const std::vector<size_t> &anyTag_;
+        std::vector<size_t> candidates_;
+        std::vector<Span> values_;
+        // Names of the open elements, the captures by opening order
+        std::vector<std::string> open_;
+        std::vector<Capture> captures_;
+    };
+
+} // impl
+
+inline ExtractionPlan& ExtractionPlan::add(const std::string &selector,
+        const std::string &attribute, Callback callback)
+{
+    std::vector<impl::SelectorComplex> complexes;
+    impl::SelectorParser(selector).parse(complexes);
+    if (complexes.size() != 1 || complexes[0].compounds.size() != 1
+            || complexes[0].compounds[0].pseudo)
+        throw std::invalid_argument("htmlcxx2: extraction rules take a compound selector");
+
+    Rule rule = { complexes[0].compounds[0], impl::toLower(attribute), callback };
+    if (rule.compound.tag.empty())
+        anyTag_.push_back(rules_.size());
+    else
+        byTag_[rule.compound.tag].push_back(rules_.size());
+    rules_.push_back(rule);
+    return *this;
+}
+
+inline void ExtractionPlan::run(const std::string &html) const
+{
+    impl::ExtractionRun(rules_, byTag_, anyTag_).parse(html);
+}
+
+} }
+
+#endif
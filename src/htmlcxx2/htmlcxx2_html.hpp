@@ -10,14 +10,29 @@
 
 #include <cctype>
 #include <cstring>
+#include <cstdint>
+#include <cwchar>
+#include <chrono>
+#include <atomic>
+#include <thread>
 #if !(defined(WIN32) || defined(_WIN64)) || defined(__MINGW32__)
 #include <strings.h>
 #endif
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define HTMLCXX2_RDTSC
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HTMLCXX2_RDTSC
+#endif
 
 #include <vector>
 #include <map>
+#include <unordered_map>
 #include <string>
 #include <utility>
+#include <iterator>
+#include <type_traits>
 #include <iostream>
 #include <algorithm>
 
@@ -28,6 +43,30 @@ namespace HTML {
 
 namespace impl {
 
+    // Define HTMLCXX2_STATS to have the parsers fill their ParserStats, the
+    // counting is compiled out otherwise
+#ifdef HTMLCXX2_STATS
+    const bool STATS_ENABLED = true;
+#else
+    const bool STATS_ENABLED = false;
+#endif
+
+    inline uint64_t steadyNanoseconds()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Cheapest clock at hand, in unspecified units
+    inline uint64_t ticks()
+    {
+#ifdef HTMLCXX2_RDTSC
+        return __rdtsc();
+#else
+        return steadyNanoseconds();
+#endif
+    }
+
     const char LITERAL_MODE_ELEM[][11] =
     {
         "\x06" "script",
@@ -52,6 +91,161 @@ namespace impl {
         return found ? found : end;
     }
 
+    template <>
+    inline const wchar_t* findNextQuote(const wchar_t *pos, const wchar_t *end, char quote)
+    {
+        const wchar_t *found = ::wmemchr(pos, static_cast<wchar_t>(quote), end - pos);
+        return found ? found : end;
+    }
+
+    // Four code units at a time: a unit equal to the quote becomes zero, and
+    // a zero unit is the only one to borrow into its top bit
+    template <>
+    inline const char16_t* findNextQuote(const char16_t *pos, const char16_t *end, char quote)
+    {
+        const uint64_t ones = 0x0001000100010001ull, highs = 0x8000800080008000ull;
+        const uint64_t pattern = ones * static_cast<unsigned char>(quote);
+        for (; end - pos >= 4; pos += 4)
+        {
+            uint64_t word;
+            memcpy(&word, pos, 8);
+            word ^= pattern;
+            if ((word - ones) & ~word & highs)
+                break;
+        }
+        while (pos != end && *pos != quote)
+            ++pos;
+        return pos;
+    }
+
+    // Argument for the <cctype> functions: bytes as unsigned char, wider code
+    // units past ASCII as a byte no class has in the C locale, as the bytes
+    // of their UTF-8 would be
+    inline int ctypeArg(char c)
+    {
+        return static_cast<unsigned char>(c);
+    }
+
+    template <typename T>
+    inline int ctypeArg(T c)
+    {
+        return static_cast<uint32_t>(c) < 0x80 ? static_cast<int>(c) : 0x80;
+    }
+
+    // Encodes a code point into out, returns the number of bytes
+    inline size_t encodeUtf8(uint32_t c, char *out)
+    {
+        if (c < 0x80)
+        {
+            out[0] = static_cast<char>(c);
+            return 1;
+        }
+        if (c < 0x800)
+        {
+            out[0] = static_cast<char>(0xc0 | (c >> 6));
+            out[1] = static_cast<char>(0x80 | (c & 0x3f));
+            return 2;
+        }
+        if (c < 0x10000)
+        {
+            out[0] = static_cast<char>(0xe0 | (c >> 12));
+            out[1] = static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+            out[2] = static_cast<char>(0x80 | (c & 0x3f));
+            return 3;
+        }
+        out[0] = static_cast<char>(0xf0 | (c >> 18));
+        out[1] = static_cast<char>(0x80 | ((c >> 12) & 0x3f));
+        out[2] = static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+        out[3] = static_cast<char>(0x80 | (c & 0x3f));
+        return 4;
+    }
+
+    // The text of a token: bytes as they are, wider code units as UTF-16
+    // or UTF-32 converted to UTF-8, unpaired surrogates as U+FFFD
+    template <typename It>
+    inline std::string tokenString(It begin, It end, std::integral_constant<size_t, 1>)
+    {
+        return std::string(begin, end);
+    }
+
+    template <typename It, size_t N>
+    inline std::string tokenString(It begin, It end, std::integral_constant<size_t, N>)
+    {
+        std::string out;
+        out.reserve(std::distance(begin, end));
+        char utf8[4];
+        while (begin != end)
+        {
+            uint32_t c = static_cast<uint32_t>(*begin);
+            ++begin;
+            if (N == 2)
+                c &= 0xffff;
+            if (c >= 0xd800 && c < 0xdc00 && N == 2 && begin != end)
+            {
+                const uint32_t c2 = static_cast<uint32_t>(*begin) & 0xffff;
+                if (c2 >= 0xdc00 && c2 < 0xe000)
+                {
+                    c = 0x10000 + ((c - 0xd800) << 10) + (c2 - 0xdc00);
+                    ++begin;
+                }
+            }
+            if ((c >= 0xd800 && c < 0xe000) || c > 0x10ffff)
+                c = 0xfffd;
+            if (c < 0x80)
+                out += static_cast<char>(c);
+            else
+                out.append(utf8, encodeUtf8(c, utf8));
+        }
+        return out;
+    }
+
+    template <typename It>
+    inline std::string tokenString(It begin, It end)
+    {
+        return tokenString(begin, end, std::integral_constant<size_t,
+                sizeof(typename std::iterator_traits<It>::value_type)>());
+    }
+
+    // Length of tokenString() without building it
+    template <typename It>
+    inline size_t tokenLength(It begin, It end)
+    {
+        if (sizeof(typename std::iterator_traits<It>::value_type) == 1)
+            return std::distance(begin, end);
+        size_t length = 0;
+        while (begin != end)
+        {
+            const uint32_t c = static_cast<uint32_t>(*begin);
+            ++begin;
+            if (c >= 0xd800 && c < 0xdc00 && begin != end
+                    && (static_cast<uint32_t>(*begin) & 0xfc00) == 0xdc00)
+            {
+                ++begin;
+                length += 4;
+            }
+            else
+                length += c < 0x80 ? 1 : c < 0x800 ? 2 : c < 0x10000 || c > 0x10ffff ? 3 : 4;
+        }
+        return length;
+    }
+
+    template <typename It>
+    inline bool isBlank(It begin, It end)
+    {
+        for (; begin != end; ++begin)
+            if (!::isspace(ctypeArg(*begin)))
+                return false;
+        return true;
+    }
+
+    // <?xml ...> or <%...%>, the other comment tokens start with <! or </
+    template <typename It>
+    inline bool isProcessingInstruction(It begin, It end)
+    {
+        return begin != end && ++begin != end && (*begin == '?' || *begin == '%');
+    }
+
+
     template <class T>
     inline int icompare(const T *s1, const T *s2)
     {
@@ -83,6 +277,208 @@ namespace impl {
         return ret;
     }
 
+    // Number of continuation bytes after a UTF-8 lead byte, and the range of
+    // the first one. False if c cannot start a sequence.
+    inline bool utf8Lead(unsigned char c, ptrdiff_t &n, unsigned char &lo, unsigned char &hi)
+    {
+        lo = 0x80;
+        hi = 0xbf;
+        if (c >= 0xc2 && c <= 0xdf)
+            n = 1;
+        else if (c >= 0xe0 && c <= 0xef)
+        {
+            n = 2;
+            if (c == 0xe0)
+                lo = 0xa0;
+            else if (c == 0xed)
+                hi = 0x9f;
+        }
+        else if (c >= 0xf0 && c <= 0xf4)
+        {
+            n = 3;
+            if (c == 0xf0)
+                lo = 0x90;
+            else if (c == 0xf4)
+                hi = 0x8f;
+        }
+        else
+            return false;
+        return true;
+    }
+
+    // Offset of the first byte not part of a well formed UTF-8 sequence
+    // (overlong forms, surrogates and code points past U+10FFFF are not),
+    // std::string::npos if there is none. ASCII is skipped 8 bytes at a time.
+    inline size_t findInvalidUtf8(const char *data, size_t length)
+    {
+        const unsigned char *const begin = reinterpret_cast<const unsigned char*>(data);
+        const unsigned char *p = begin, *const end = begin + length;
+        while (p != end)
+        {
+            if (end - p >= 8)
+            {
+                uint64_t word;
+                memcpy(&word, p, 8);
+                if (!(word & 0x8080808080808080ull))
+                {
+                    p += 8;
+                    continue;
+                }
+            }
+            const unsigned char c = *p;
+            if (c < 0x80)
+            {
+                ++p;
+                continue;
+            }
+            ptrdiff_t n;
+            unsigned char lo, hi;
+            if (!utf8Lead(c, n, lo, hi) || end - p <= n || p[1] < lo || p[1] > hi)
+                return p - begin;
+            for (ptrdiff_t i = 2; i <= n; ++i)
+                if ((p[i] & 0xc0) != 0x80)
+                    return p - begin;
+            p += n + 1;
+        }
+        return std::string::npos;
+    }
+
+    inline uint64_t hashMix(uint64_t h)
+    {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ull;
+        h ^= h >> 33;
+        return h;
+    }
+
+    // Fast non-cryptographic 64 bit hash, reading 8 bytes at a time. The bits
+    // of fold are set in every byte first, 0x20 hashes ASCII letters the same
+    // in both cases.
+    inline uint64_t hashBytes(const char *data, size_t length, uint64_t seed = 0, uint64_t fold = 0)
+    {
+        const uint64_t m = 0x9e3779b97f4a7c15ull;
+        uint64_t h = seed ^ (length * m);
+        const char *end = data + (length & ~static_cast<size_t>(7));
+        for (; data != end; data += 8)
+        {
+            uint64_t k;
+            memcpy(&k, data, 8);
+            k = (k | fold) * m;
+            k ^= k >> 29;
+            h = (h ^ k) * 0xbf58476d1ce4e5b9ull;
+            h = (h << 27) | (h >> 37);
+        }
+        uint64_t k = 0;
+        memcpy(&k, data, length & 7);
+        h ^= (k | fold) * m;
+        return hashMix(h);
+    }
+
+    inline bool iequals(const char *begin, const char *end, const char *lower)
+    {
+        for (; begin != end; ++begin, ++lower)
+            if (!*lower || ::tolower((unsigned char)*begin) != *lower)
+                return false;
+        return !*lower;
+    }
+
+    // Tokenizes the attributes of the tag text at ptr without copying them.
+    // Calls f(keyBegin, keyEnd, valueBegin, valueEnd) for each attribute, the
+    // value pointers are null for attributes without a value. Scanning stops
+    // when f returns false.
+    template <typename F>
+    inline void scanAttributes(const char *ptr, F f)
+    {
+        const char *end;
+        if ((ptr = strchr(ptr, '<')) == 0)
+            return;
+        ++ptr;
+
+        // Skip initial blankspace
+        while (::isspace((unsigned char)*ptr))
+            ++ptr;
+
+        // Skip tagname
+        if (!::isalpha((unsigned char)*ptr))
+            return;
+        while (*ptr && !::isspace((unsigned char)*ptr) && *ptr != '>')
+            ++ptr;
+
+        // Skip blankspace after tagname
+        while (::isspace((unsigned char)*ptr))
+            ++ptr;
+
+        while (*ptr && *ptr != '>')
+        {
+            // skip unrecognized
+            while (*ptr && !::isalnum((unsigned char)*ptr) && !::isspace((unsigned char)*ptr))
+                ++ptr;
+
+            // skip blankspace
+            while (::isspace((unsigned char)*ptr))
+                ++ptr;
+
+            end = ptr;
+            while (::isalnum((unsigned char)*end) || *end == '-')
+                ++end;
+            const char *keyBegin = ptr, *keyEnd = end;
+            ptr = end;
+            // skip blankspace
+            while (::isspace((unsigned char)*ptr))
+                ++ptr;
+
+            if (*ptr == '=')
+            {
+                const char *valueBegin, *valueEnd;
+                ++ptr;
+                while (::isspace((unsigned char)*ptr))
+                    ++ptr;
+                if (*ptr == '"' || *ptr == '\'')
+                {
+                    char quote = *ptr;
+                    end = strchr(ptr + 1, quote);
+                    if (end == 0)
+                    {
+                        const char *end1, *end2;
+                        end1 = strchr(ptr + 1, ' ');
+                        end2 = strchr(ptr + 1, '>');
+                        end = end1 && (end1 < end2) ? end1 : end2;
+                        if (end == 0)
+                            return;
+                    }
+                    const char *begin = ptr + 1;
+                    while (::isspace((unsigned char)*begin) && begin < end)
+                        ++begin;
+                    const char *trimmed_end = end - 1;
+                    while (::isspace((unsigned char)*trimmed_end) && trimmed_end >= begin)
+                        --trimmed_end;
+                    valueBegin = begin;
+                    valueEnd = trimmed_end + 1;
+                    ptr = end + 1;
+                }
+                else
+                {
+                    end = ptr;
+                    while (*end && !::isspace((unsigned char)*end) && *end != '>')
+                        end++;
+                    valueBegin = ptr;
+                    valueEnd = end;
+                    ptr = end;
+                }
+                if (!f(keyBegin, keyEnd, valueBegin, valueEnd))
+                    return;
+            }
+            else if (keyBegin != keyEnd)
+            {
+                if (!f(keyBegin, keyEnd, static_cast<const char*>(nullptr),
+                        static_cast<const char*>(nullptr)))
+                    return;
+            }
+        }
+    }
+
 } // detail
 
 //
@@ -91,6 +487,8 @@ namespace impl {
 
 class ParserSax;
 class ParserDom;
+class ParserDomIncremental;
+class OffsetMap;
 
 class Node
 {
@@ -111,9 +509,11 @@ public:
         offset_(0),
         length_(0),
         kind_(NODE_END),
+        attributesState_(ATTRIBUTES_UNPARSED),
         attributeKeys_(),
         attributeValues_(),
-        attributesParsed_(false) { }
+        invalidUtf8_(std::string::npos),
+        hash_(0) { }
 
     Node(const std::string &tagName,
             const std::string &text,
@@ -127,9 +527,38 @@ public:
         offset_(offset),
         length_(length),
         kind_(kind),
+        attributesState_(ATTRIBUTES_UNPARSED),
+        attributeKeys_(),
+        attributeValues_(),
+        invalidUtf8_(std::string::npos),
+        hash_(0) { }
+    // The attributes are copied if they were parsed
+    Node(const Node &node) :
+        tagName_(node.tagName_),
+        text_(node.text_),
+        closingText_(node.closingText_),
+        offset_(node.offset_),
+        length_(node.length_),
+        kind_(node.kind_),
+        attributesState_(ATTRIBUTES_UNPARSED),
         attributeKeys_(),
         attributeValues_(),
-        attributesParsed_(false) { }
+        invalidUtf8_(node.invalidUtf8_),
+        hash_(node.hash_) { copyAttributes(node); }
+    Node(Node &&node) :
+        tagName_(std::move(node.tagName_)),
+        text_(std::move(node.text_)),
+        closingText_(std::move(node.closingText_)),
+        offset_(node.offset_),
+        length_(node.length_),
+        kind_(node.kind_),
+        attributesState_(node.attributesState_.load(std::memory_order_relaxed)),
+        attributeKeys_(std::move(node.attributeKeys_)),
+        attributeValues_(std::move(node.attributeValues_)),
+        invalidUtf8_(node.invalidUtf8_),
+        hash_(node.hash_) { }
+    Node& operator=(const Node &node);
+    Node& operator=(Node &&node);
     ~Node() { }
 
     const std::string& tagName() const     { return tagName_; }
@@ -158,18 +587,46 @@ public:
     size_t contentLength() const;
     std::string content(const std::string &htmlSource) const;
 
-    const std::vector<std::string>& attributeKeys() const   { return attributeKeys_; }
-    const std::vector<std::string>& attributeValues() const { return attributeValues_; }
+    // The attributes are empty until parseAttributes() is called. It can be
+    // called from any number of threads on a shared tree: the first call
+    // parses them, the others wait for it, and the accessors only see them
+    // once complete.
+    const std::vector<std::string>& attributeKeys() const;
+    const std::vector<std::string>& attributeValues() const;
     bool hasAttribute(const std::string &key) const;
     bool attribute(const std::string &key, std::string &value) const;
     bool operator==(const Node &rhs) const;
-    size_t parseAttributes();
+    size_t parseAttributes() const;
+
+    // Offset in text() of the first byte which is not valid UTF-8, found while
+    // tokenizing when ParserSax::setValidateUtf8() is on. std::string::npos if
+    // there is none or the text was not validated.
+    size_t invalidUtf8() const { return invalidUtf8_; }
+
+    // Hash of the subtree, when ParserDom::setSubtreeHashes() is on: of its
+    // shape and of what Node::operator== compares (kinds, tag names and
+    // texts up to a NUL, ignoring the case of ASCII letters). Subtrees with
+    // different hashes are never kp::tree::equal_subtree().
+    uint64_t hash() const { return hash_; }
 
 protected:
     friend ParserSax;
     friend ParserDom;
+    friend ParserDomIncremental;
+    friend OffsetMap;
+
+    enum AttributesState
+    {
+        ATTRIBUTES_UNPARSED,
+        ATTRIBUTES_PARSING,
+        ATTRIBUTES_PARSED
+    };
 
-    void addAttribute(const std::string &key, const std::string &value = "");
+    bool attributesParsed() const
+    {
+        return attributesState_.load(std::memory_order_acquire) == ATTRIBUTES_PARSED;
+    }
+    void copyAttributes(const Node &node);
 
     std::string tagName_;
     std::string text_;
@@ -177,9 +634,14 @@ protected:
     size_t offset_;
     size_t length_;
     Kind kind_;
-    std::vector<std::string> attributeKeys_;
-    std::vector<std::string> attributeValues_;
-    bool attributesParsed_;
+    // Next to kind_, in what would be padding
+    mutable std::atomic<unsigned char> attributesState_;
+    // Written once, by the thread moving the state from unparsed to parsing,
+    // and read after the state is parsed
+    mutable std::vector<std::string> attributeKeys_;
+    mutable std::vector<std::string> attributeValues_;
+    size_t invalidUtf8_;
+    uint64_t hash_;
 };
 
 inline size_t Node::contentOffset() const
@@ -197,14 +659,73 @@ inline std::string Node::content(const std::string &htmlSource) const
     return !(isTag() || isRoot()) ? std::string() : htmlSource.substr(contentOffset(), contentLength());
 }
 
-inline void Node::addAttribute(const std::string &key, const std::string &value)
+inline void Node::copyAttributes(const Node &node)
+{
+    if (node.attributesParsed())
+    {
+        attributeKeys_ = node.attributeKeys_;
+        attributeValues_ = node.attributeValues_;
+        attributesState_.store(ATTRIBUTES_PARSED, std::memory_order_relaxed);
+    }
+    else
+    {
+        attributeKeys_.clear();
+        attributeValues_.clear();
+        attributesState_.store(ATTRIBUTES_UNPARSED, std::memory_order_relaxed);
+    }
+}
+
+inline Node& Node::operator=(const Node &node)
+{
+    if (this == &node)
+        return *this;
+    tagName_ = node.tagName_;
+    text_ = node.text_;
+    closingText_ = node.closingText_;
+    offset_ = node.offset_;
+    length_ = node.length_;
+    kind_ = node.kind_;
+    copyAttributes(node);
+    invalidUtf8_ = node.invalidUtf8_;
+    hash_ = node.hash_;
+    return *this;
+}
+
+inline Node& Node::operator=(Node &&node)
+{
+    if (this == &node)
+        return *this;
+    tagName_ = std::move(node.tagName_);
+    text_ = std::move(node.text_);
+    closingText_ = std::move(node.closingText_);
+    offset_ = node.offset_;
+    length_ = node.length_;
+    kind_ = node.kind_;
+    attributeKeys_ = std::move(node.attributeKeys_);
+    attributeValues_ = std::move(node.attributeValues_);
+    attributesState_.store(node.attributesState_.load(std::memory_order_relaxed),
+            std::memory_order_relaxed);
+    invalidUtf8_ = node.invalidUtf8_;
+    hash_ = node.hash_;
+    return *this;
+}
+
+inline const std::vector<std::string>& Node::attributeKeys() const
+{
+    static const std::vector<std::string> none;
+    return attributesParsed() ? attributeKeys_ : none;
+}
+
+inline const std::vector<std::string>& Node::attributeValues() const
 {
-    attributeKeys_.push_back(impl::toLower(key));
-    attributeValues_.push_back(value);
+    static const std::vector<std::string> none;
+    return attributesParsed() ? attributeValues_ : none;
 }
 
 inline bool Node::hasAttribute(const std::string &key) const
 {
+    if (!attributesParsed())
+        return false;
     for (size_t i = 0, l = attributeKeys_.size(); i < l; ++i)
     {
         if (impl::icompare(attributeKeys_[i].c_str(), key.c_str()) == 0)
@@ -215,6 +736,8 @@ inline bool Node::hasAttribute(const std::string &key) const
 
 inline bool Node::attribute(const std::string &key, std::string &value) const
 {
+    if (!attributesParsed())
+        return false;
     for (size_t i = 0, l = attributeKeys_.size(); i < l; ++i)
     {
         if (impl::icompare(attributeKeys_[i].c_str(), key.c_str()) == 0)
@@ -238,99 +761,207 @@ inline bool Node::operator==(const Node &node) const
         return impl::icompare(text().c_str(), node.text().c_str()) == 0;
 }
 
-inline size_t Node::parseAttributes()
+inline size_t Node::parseAttributes() const
 {
     if (!isTag())
         return 0;
 
-    if (attributesParsed_)
+    // Only one thread parses, the others wait until it publishes the result.
+    // Parsing takes as long as scanning the tag, so they just yield. If it
+    // throws, the node is left unparsed for the next caller to try again.
+    for (;;)
+    {
+        unsigned char state = attributesState_.load(std::memory_order_acquire);
+        if (state == ATTRIBUTES_PARSED)
+            return attributeKeys_.size();
+        if (state == ATTRIBUTES_PARSING
+                || !attributesState_.compare_exchange_strong(state, ATTRIBUTES_PARSING,
+                    std::memory_order_acquire))
+        {
+            std::this_thread::yield();
+            continue;
+        }
+        try
+        {
+            impl::scanAttributes(text_.c_str(), [this](const char *keyBegin, const char *keyEnd,
+                    const char *valueBegin, const char *valueEnd)
+            {
+                attributeKeys_.push_back(impl::toLower(std::string(keyBegin, keyEnd)));
+                attributeValues_.push_back(valueBegin ? std::string(valueBegin, valueEnd) : std::string());
+                return true;
+            });
+        }
+        catch (...)
+        {
+            attributeKeys_.clear();
+            attributeValues_.clear();
+            attributesState_.store(ATTRIBUTES_UNPARSED, std::memory_order_release);
+            throw;
+        }
+        attributesState_.store(ATTRIBUTES_PARSED, std::memory_order_release);
         return attributeKeys_.size();
-    else
-        attributesParsed_ = true;
+    }
+}
 
-    const char *end;
-    const char *ptr = text_.c_str();
-    if ((ptr = strchr(ptr, '<')) == 0)
-        return 0;
-    ++ptr;
+//
+// ParseOptions
+//
 
-    // Skip initial blankspace
-    while (::isspace((unsigned char)*ptr))
-        ++ptr;
+// Which tokens make nodes. Dropping them saves building the nodes (the
+// tokenizer still goes through them), and ParserDom has that many less to
+// insert: whitespace between tags alone is often a third of the nodes.
+struct ParseOptions
+{
+    ParseOptions() :
+        whitespaceText(true),
+        comments(true),
+        processingInstructions(true),
+        literalText(true) { }
+
+    // Text made only of blankspace, outside of literal elements
+    bool whitespaceText;
+    // <!-- -->, <!DOCTYPE> and malformed closing tags like </3>
+    bool comments;
+    // <?xml ?> and <% %>
+    bool processingInstructions;
+    // The text of script, style and the other literal elements. Without it
+    // the text nodes are kept with their offset and length but an empty text().
+    bool literalText;
+};
 
-    // Skip tagname
-    if (!::isalpha((unsigned char)*ptr))
-        return 0;
-    while (!::isspace((unsigned char)*ptr) && *ptr != '>')
-        ++ptr;
+//
+// ParseBudget
+//
 
-    // Skip blankspace after tagname
-    while (::isspace((unsigned char)*ptr))
-        ++ptr;
+// How a parse ended
+enum ParseStatus
+{
+    PARSE_COMPLETE,
+    PARSE_DEADLINE_EXCEEDED,
+    PARSE_TOKEN_LIMIT,
+    PARSE_DEPTH_LIMIT,
+    PARSE_BYTE_LIMIT
+};
 
-    while (*ptr && *ptr != '>')
-    {
-        std::string key, val;
+// Limits on a parse, 0 being none. Past one the parser stops at the next
+// token boundary, as if the document ended there: ParserDom leaves the tree of
+// the bytes parsed, spanned by the root. The clock is read every few thousand
+// tokens, so a deadline is overrun by about that many tokens plus the longest
+// of them.
+struct ParseBudget
+{
+    ParseBudget() :
+        deadline(0),
+        timeout(0),
+        maxTokens(0),
+        maxDepth(0),
+        maxBytes(0) { }
+
+    bool limited() const { return deadline || timeout || maxTokens || maxDepth || maxBytes; }
+
+    // Steady clock, nanoseconds (see impl::steadyNanoseconds()), and
+    // nanoseconds from the start of each parse
+    uint64_t deadline;
+    uint64_t timeout;
+    // Tokens read, the text before a tag may be read with it past the limit
+    size_t maxTokens;
+    // ParserDom only: nesting of the elements, the tag opening one deeper
+    // stops the parse before it
+    size_t maxDepth;
+    // Bytes tokenized, up to the end of the token crossing the limit
+    size_t maxBytes;
+};
 
-        // skip unrecognized
-        while (*ptr && !::isalnum((unsigned char)*ptr) && !::isspace((unsigned char)*ptr))
-            ++ptr;
+//
+// ParserStats
+//
 
-        // skip blankspace
-        while (::isspace((unsigned char)*ptr))
-            ++ptr;
+// What the last parse went through, to spot the documents hitting the slow
+// paths. Only counted when HTMLCXX2_STATS is defined, all zero otherwise.
+struct ParserStats
+{
+    ParserStats() :
+        bytes(0),
+        tags(0),
+        closingTags(0),
+        texts(0),
+        comments(0),
+        literalBytes(0),
+        attributes(0),
+        closingSteps(0),
+        flattens(0),
+        unmatchedClosingTags(0),
+        maxDepth(0),
+        invalidUtf8(0) { }
+
+    // Bytes tokenized
+    size_t bytes;
+    // Tokens by kind
+    size_t tags;
+    size_t closingTags;
+    size_t texts;
+    size_t comments;
+    // Bytes of text read in literal mode (script, style...)
+    size_t literalBytes;
+    // Attribute values skipped over while looking for the end of tags
+    size_t attributes;
+
+    // ParserDom only: open elements compared with closing tags, elements
+    // flattened because a closing tag closed one of their ancestors, closing
+    // tags closing nothing (kept as comments) and depth of the deepest
+    // element. ParserDomParallel tokenizes elsewhere and only counts these.
+    size_t closingSteps;
+    size_t flattens;
+    size_t unmatchedClosingTags;
+    size_t maxDepth;
+
+    // Tokens with invalid UTF-8, when validating (ParserDomParallel too)
+    size_t invalidUtf8;
+};
 
-        end = ptr;
-        while (::isalnum((unsigned char)*end) || *end == '-')
-            ++end;
-        key.assign(ptr, end);
-        ptr = end;
-        // skip blankspace
-        while (::isspace((unsigned char)*ptr))
-            ++ptr;
+//
+// ParserTimes
+//
 
-        if (*ptr == '=')
-        {
-            ++ptr;
-            while (::isspace((unsigned char)*ptr))
-                ++ptr;
-            if (*ptr == '"' || *ptr == '\'')
-            {
-                char quote = *ptr;
-                end = strchr(ptr + 1, quote);
-                if (end == 0)
-                {
-                    const char *end1, *end2;
-                    end1 = strchr(ptr + 1, ' ');
-                    end2 = strchr(ptr + 1, '>');
-                    end = end1 && (end1 < end2) ? end1 : end2;
-                    if (end == 0)
-                        return attributeKeys_.size();
-                }
-                const char *begin = ptr + 1;
-                while (::isspace((unsigned char)*begin) && begin < end)
-                    ++begin;
-                const char *trimmed_end = end - 1;
-                while (::isspace((unsigned char)*trimmed_end) && trimmed_end >= begin)
-                    --trimmed_end;
-                val.assign(begin, trimmed_end + 1);
-                ptr = end + 1;
-            }
-            else
-            {
-                end = ptr;
-                while (*end && !::isspace((unsigned char)*end) && *end != '>')
-                    end++;
-                val.assign(ptr, end);
-                ptr = end;
-            }
-            addAttribute(key, val);
-        }
-        else if (!key.empty())
-            addAttribute(key);
+// Where the last parse spent its time, when timing was turned on for it with
+// setTiming(). Phases are switched on the tokens, on the time stamp counter
+// where there is one, and converted to nanoseconds against the steady clock
+// over the whole parse.
+struct ParserTimes
+{
+    enum Phase
+    {
+        // Looking for the tokens
+        PHASE_SCAN,
+        // Copying them into nodes (tag names are lowered)
+        PHASE_NODES,
+        // onFoundTag(), onFoundText() and onFoundComment(), except what
+        // ParserDom counts as
+        PHASE_HANDLERS,
+        // adding the nodes to the tree,
+        PHASE_INSERT,
+        // and looking for the elements closed by closing tags
+        PHASE_CLOSING,
+        PHASES
+    };
+
+    ParserTimes() : start(0), total(0)
+    {
+        for (int i = 0; i < PHASES; ++i)
+            phases[i] = 0;
+    }
+
+    static const char* phaseName(Phase phase)
+    {
+        static const char *names[] = { "scan", "nodes", "handlers", "insert", "closing" };
+        return names[phase];
     }
-    return attributeKeys_.size();
-}
+
+    // Steady clock at the start of the parse, nanoseconds
+    uint64_t start;
+    uint64_t total;
+    uint64_t phases[PHASES];
+};
 
 //
 // ParserSax
@@ -342,11 +973,54 @@ class ParserSax
         ParserSax() :
             currentOffset_(0),
             literal_(nullptr),
-            cdata_(false) { }
+            cdata_(false),
+            stats_(),
+            options_(),
+            tagsOnly_(false),
+            skeleton_(false),
+            budget_(),
+            status_(PARSE_COMPLETE),
+            tokens_(0),
+            checkOffset_(static_cast<size_t>(-1)),
+            checkTokens_(static_cast<size_t>(-1)),
+            depthLimit_(static_cast<size_t>(-1)),
+            deadline_(0),
+            validateUtf8_(false),
+            timing_(false),
+            times_(),
+            phase_(ParserTimes::PHASE_SCAN),
+            phaseStart_(0),
+            ticksStart_(0),
+            unmatchedQuotes_() { clearUnmatchedQuotes(); }
         virtual ~ParserSax() { }
         void parse(const std::string &html);
+        // UTF-16 (UTF-32 where wchar_t has 4 bytes) is tokenized as it is and
+        // each token converted to UTF-8: the nodes, their offsets and lengths
+        // are those of the document converted to UTF-8
+        void parse(const std::u16string &html);
+        void parse(const std::wstring &html);
         template <typename It> void parse(It begin, It end);
 
+        const ParserStats& stats() const { return stats_; }
+
+        void setOptions(const ParseOptions &options) { options_ = options; }
+        const ParseOptions& options() const { return options_; }
+
+        // Limits on the next parses, and how the last one ended
+        void setBudget(const ParseBudget &budget) { budget_ = budget; }
+        const ParseBudget& budget() const { return budget_; }
+        ParseStatus status() const { return status_; }
+
+        // Check that the tokens are UTF-8 as they are copied into the nodes,
+        // see Node::invalidUtf8()
+        void setValidateUtf8(bool value) { validateUtf8_ = value; }
+        bool validateUtf8() const { return validateUtf8_; }
+
+        // Time the phases of the next parses, for the documents worth it: it
+        // costs a few clock reads per token
+        void setTiming(bool value) { timing_ = value; }
+        const ParserTimes& times() const { return times_; }
+
     protected:
         // Redefine this if you want to do some initialization before the parsing
         virtual void onBeginParsing() { }
@@ -356,20 +1030,165 @@ class ParserSax
         virtual void onEndParsing() { }
 
         template <typename It> void parse(It begin, It end, std::forward_iterator_tag);
+        // Tokenize starting at a token boundary in the current state (currentOffset_,
+        // literal_). Stops at the first token boundary at or after stopOffset and
+        // returns its position, or end.
+        template <typename It> It parseTokens(It begin, It end, size_t stopOffset);
         template <typename It> void parseTag(It begin, It end);
         template <typename It> void parseContent(It begin, It end);
         template <typename It> void parseComment(It begin, It end);
+        void checkUtf8(Node &node);
+        template <typename It> void skipToken(It begin, It end, size_t &counter);
+        // Applies the options to a token made elsewhere: false if it is
+        // dropped, literal is whether it is the text of a literal element
+        bool keepToken(Node &node, bool literal) const;
         template <typename It> It skipTag(It begin, It end);
         template <typename It> It skipComment(It begin, It end);
+        void clearUnmatchedQuotes()
+        {
+            unmatchedQuotes_[0] = unmatchedQuotes_[1] = std::string::npos;
+        }
+
+        void beginBudget();
+        void endBudget();
+        // Sets when the budget is looked at next
+        void scheduleCheck();
+        // Slow path of the check made at each token boundary
+        bool outOfBudget();
+        // Stops at the next token boundary
+        void stopParsing(ParseStatus status)
+        {
+            status_ = status;
+            checkTokens_ = 0;
+        }
+
+        void beginTiming();
+        void endTiming();
+        void enterPhase(ParserTimes::Phase phase)
+        {
+            if (timing_)
+            {
+                const uint64_t now = impl::ticks();
+                times_.phases[phase_] += now - phaseStart_;
+                phaseStart_ = now;
+                phase_ = phase;
+            }
+        }
+
+        size_t currentOffset_;
+        const char *literal_;
+        bool cdata_;
+        ParserStats stats_;
+        ParseOptions options_;
+        // Only report tags, for the parsers which never look at the text
+        bool tagsOnly_;
+        // Only report tags, opening ones without their text: for the parsers
+        // which only need the structure of some part of the document
+        bool skeleton_;
+        ParseBudget budget_;
+        ParseStatus status_;
+        // Tokens read, and the offset and token count at which the budget is
+        // checked next: never outside of parse()
+        size_t tokens_;
+        size_t checkOffset_;
+        size_t checkTokens_;
+        size_t depthLimit_;
+        uint64_t deadline_;
+        bool validateUtf8_;
+        bool timing_;
+        ParserTimes times_;
+        ParserTimes::Phase phase_;
+        uint64_t phaseStart_;
+        uint64_t ticksStart_;
+        // Offset at or before the first tag with a ' (0) or " (1) without a
+        // match up to the end of the document, npos if none: such a tag ends
+        // at the next '>' instead, until a quote is added anywhere after it
+        size_t unmatchedQuotes_[2];
+};
+
+inline void ParserSax::parse(const std::string &html)
+{
+    parse(html.c_str(), html.c_str() + html.length());
+}
+
+inline void ParserSax::parse(const std::u16string &html)
+{
+    parse(html.c_str(), html.c_str() + html.length());
+}
+
+inline void ParserSax::parse(const std::wstring &html)
+{
+    parse(html.c_str(), html.c_str() + html.length());
+}
+
+inline void ParserSax::beginBudget()
+{
+    status_ = PARSE_COMPLETE;
+    tokens_ = 0;
+    deadline_ = budget_.deadline;
+    if (budget_.timeout)
+    {
+        const uint64_t deadline = impl::steadyNanoseconds() + budget_.timeout;
+        deadline_ = deadline_ ? std::min(deadline_, deadline) : deadline;
+    }
+    depthLimit_ = budget_.maxDepth ? budget_.maxDepth : static_cast<size_t>(-1);
+    scheduleCheck();
+}
+
+inline void ParserSax::endBudget()
+{
+    checkOffset_ = checkTokens_ = depthLimit_ = static_cast<size_t>(-1);
+}
+
+inline void ParserSax::scheduleCheck()
+{
+    // The clock is read every 4096 tokens or 64 KB, a few nanoseconds each time
+    checkOffset_ = budget_.maxBytes ? budget_.maxBytes : static_cast<size_t>(-1);
+    checkTokens_ = budget_.maxTokens ? budget_.maxTokens : static_cast<size_t>(-1);
+    if (deadline_)
+    {
+        checkOffset_ = std::min(checkOffset_, currentOffset_ + (64 << 10));
+        checkTokens_ = std::min(checkTokens_, tokens_ + 4096);
+    }
+}
+
+inline bool ParserSax::outOfBudget()
+{
+    if (status_ == PARSE_COMPLETE)
+    {
+        if (budget_.maxBytes && currentOffset_ >= budget_.maxBytes)
+            status_ = PARSE_BYTE_LIMIT;
+        else if (budget_.maxTokens && tokens_ >= budget_.maxTokens)
+            status_ = PARSE_TOKEN_LIMIT;
+        else if (deadline_ && impl::steadyNanoseconds() >= deadline_)
+            status_ = PARSE_DEADLINE_EXCEEDED;
+    }
+    if (status_ != PARSE_COMPLETE)
+        return true;
+    scheduleCheck();
+    return false;
+}
 
-        size_t currentOffset_;
-        const char *literal_;
-        bool cdata_;
-};
+inline void ParserSax::beginTiming()
+{
+    times_ = ParserTimes();
+    if (!timing_)
+        return;
+    times_.start = impl::steadyNanoseconds();
+    phase_ = ParserTimes::PHASE_SCAN;
+    phaseStart_ = ticksStart_ = impl::ticks();
+}
 
-inline void ParserSax::parse(const std::string &html)
+inline void ParserSax::endTiming()
 {
-    parse(html.c_str(), html.c_str() + html.length());
+    if (!timing_)
+        return;
+    enterPhase(ParserTimes::PHASE_SCAN);
+    times_.total = impl::steadyNanoseconds() - times_.start;
+    const uint64_t ticks = phaseStart_ - ticksStart_;
+    for (int i = 0; i < ParserTimes::PHASES; ++i)
+        times_.phases[i] = ticks ? static_cast<uint64_t>(
+                static_cast<double>(times_.phases[i]) * times_.total / ticks) : 0;
 }
 
 template <typename It>
@@ -384,10 +1203,26 @@ void ParserSax::parse(It begin, It end, std::forward_iterator_tag)
     cdata_ = false;
     literal_ = 0;
     currentOffset_ = 0;
+    stats_ = ParserStats();
+    clearUnmatchedQuotes();
+    beginTiming();
+    beginBudget();
     onBeginParsing();
+    parseTokens(begin, end, static_cast<size_t>(-1));
+    onEndParsing();
+    endBudget();
+    endTiming();
+}
 
+template <typename It>
+It ParserSax::parseTokens(It begin, It end, size_t stopOffset)
+{
     while (begin != end)
     {
+        if (currentOffset_ >= stopOffset)
+            return begin;
+        if ((currentOffset_ >= checkOffset_ || tokens_ >= checkTokens_) && outOfBudget())
+            return begin;
         (void)*begin; // This is for the multi_pass to release the buffer
         It c(begin);
         while (c != end)
@@ -402,7 +1237,7 @@ void ParserSax::parse(It begin, It end, std::forward_iterator_tag)
                 {
                     if (c != begin)
                         parseContent(begin, c);
-                    goto DONE;
+                    return c;
                 }
                 It end_text(c);
                 ++c;
@@ -410,7 +1245,7 @@ void ParserSax::parse(It begin, It end, std::forward_iterator_tag)
                 {
                     ++c;
                     const char *l = literal_;
-                    while (*l && ::tolower(*c) == *l)
+                    while (*l && ::tolower(impl::ctypeArg(*c)) == *l)
                     {
                         ++c;
                         ++l;
@@ -421,7 +1256,7 @@ void ParserSax::parse(It begin, It end, std::forward_iterator_tag)
                     if (!*l && strcmp(literal_, "plaintext") != 0)
                     {
                         // matched all and is not tag plaintext
-                        while (::isspace((unsigned char)*c))
+                        while (::isspace(impl::ctypeArg(*c)))
                             ++c;
                         if (*c == '>')
                         {
@@ -454,7 +1289,7 @@ void ParserSax::parse(It begin, It end, std::forward_iterator_tag)
                 ++d;
                 if (d != end)
                 {
-                    if (::isalpha((unsigned char)*d))
+                    if (::isalpha(impl::ctypeArg(*d)))
                     {
                         // beginning of tag
                         if (begin != c)
@@ -475,7 +1310,7 @@ void ParserSax::parse(It begin, It end, std::forward_iterator_tag)
                             parseContent(begin, c);
                         It e(d);
                         ++e;
-                        if (e != end && ::isalpha((unsigned char)*e))
+                        if (e != end && ::isalpha(impl::ctypeArg(*e)))
                         {
                             // end of tag
                             d = skipTag(d, end);
@@ -542,42 +1377,119 @@ void ParserSax::parse(It begin, It end, std::forward_iterator_tag)
             begin = c;
         }
     }
+    return begin;
+}
+
+inline void ParserSax::checkUtf8(Node &node)
+{
+    // Right after the copy, while the bytes are still in cache
+    if (!validateUtf8_)
+        return;
+    node.invalidUtf8_ = impl::findInvalidUtf8(node.text_.data(), node.text_.length());
+    if (impl::STATS_ENABLED && node.invalidUtf8_ != std::string::npos)
+        ++stats_.invalidUtf8;
+}
+
+inline bool ParserSax::keepToken(Node &node, bool literal) const
+{
+    if (node.isText())
+    {
+        if (literal && !options_.literalText)
+            std::string().swap(node.text_);
+        return literal || options_.whitespaceText || !impl::isBlank(node.text_.begin(), node.text_.end());
+    }
+    if (node.isComment())
+        return impl::isProcessingInstruction(node.text_.begin(), node.text_.end())
+            ? options_.processingInstructions : options_.comments;
+    return true;
+}
 
-DONE:
-    onEndParsing();
-    return;
+template <typename It>
+void ParserSax::skipToken(It begin, It pos, size_t &counter)
+{
+    const size_t length = impl::tokenLength(begin, pos);
+    currentOffset_ += length;
+    if (impl::STATS_ENABLED)
+    {
+        ++counter;
+        stats_.bytes += length;
+    }
+    enterPhase(ParserTimes::PHASE_SCAN);
 }
 
 template <typename It>
 void ParserSax::parseComment(It begin, It pos)
 {
-    std::string comment(begin, pos);
+    enterPhase(ParserTimes::PHASE_NODES);
+    ++tokens_;
+    if (tagsOnly_ || skeleton_ || !(impl::isProcessingInstruction(begin, pos)
+                ? options_.processingInstructions : options_.comments))
+    {
+        skipToken(begin, pos, stats_.comments);
+        return;
+    }
+    std::string comment(impl::tokenString(begin, pos));
     Node node("", comment, "", currentOffset_, comment.length(), Node::NODE_COMMENT);
     currentOffset_ += node.length();
+    checkUtf8(node);
+    if (impl::STATS_ENABLED)
+    {
+        ++stats_.comments;
+        stats_.bytes += node.length();
+    }
+    enterPhase(ParserTimes::PHASE_HANDLERS);
     onFoundComment(node);
+    enterPhase(ParserTimes::PHASE_SCAN);
 }
 
 template <typename It>
 void ParserSax::parseContent(It begin, It pos)
 {
-    std::string text(begin, pos);
-    Node node("", text, "", currentOffset_, text.length(), Node::NODE_TEXT);
+    enterPhase(ParserTimes::PHASE_NODES);
+    ++tokens_;
+    if (tagsOnly_ || skeleton_ || (!literal_ && !options_.whitespaceText && impl::isBlank(begin, pos)))
+    {
+        skipToken(begin, pos, stats_.texts);
+        return;
+    }
+    std::string text;
+    size_t length;
+    if (literal_ && !options_.literalText)
+        length = impl::tokenLength(begin, pos);
+    else
+    {
+        text = impl::tokenString(begin, pos);
+        length = text.length();
+    }
+    Node node("", text, "", currentOffset_, length, Node::NODE_TEXT);
     currentOffset_ += node.length();
+    checkUtf8(node);
+    if (impl::STATS_ENABLED)
+    {
+        ++stats_.texts;
+        stats_.bytes += node.length();
+        if (literal_)
+            stats_.literalBytes += node.length();
+    }
+    enterPhase(ParserTimes::PHASE_HANDLERS);
     onFoundText(node);
+    enterPhase(ParserTimes::PHASE_SCAN);
 }
 
 template <typename It>
 void ParserSax::parseTag(It begin, It pos)
 {
+    enterPhase(ParserTimes::PHASE_NODES);
+    ++tokens_;
     It name_begin(begin);
     ++name_begin;
     bool isClosingTag = (*name_begin == '/');
     if (isClosingTag)
         ++name_begin;
     It name_end(name_begin);
-    while ((name_end != pos) && ::isalnum((unsigned char)*name_end))
+    while ((name_end != pos) && ::isalnum(impl::ctypeArg(*name_end)))
         ++name_end;
-    std::string name(name_begin, name_end);
+    std::string name(impl::tokenString(name_begin, name_end));
 
     if (!isClosingTag)
     {
@@ -594,10 +1506,26 @@ void ParserSax::parseTag(It begin, It pos)
     }
 
     //by now, length is just the size of the tag
-    std::string text(begin, pos);
-    Node node(name, text, "", currentOffset_, text.length(), Node::NODE_TAG);
+    std::string text;
+    size_t length;
+    if (skeleton_ && !isClosingTag)
+        length = impl::tokenLength(begin, pos);
+    else
+    {
+        text = impl::tokenString(begin, pos);
+        length = text.length();
+    }
+    Node node(name, text, "", currentOffset_, length, Node::NODE_TAG);
     currentOffset_ += node.length();
+    checkUtf8(node);
+    if (impl::STATS_ENABLED)
+    {
+        ++(isClosingTag ? stats_.closingTags : stats_.tags);
+        stats_.bytes += node.length();
+    }
+    enterPhase(ParserTimes::PHASE_HANDLERS);
     onFoundTag(node, isClosingTag);
+    enterPhase(ParserTimes::PHASE_SCAN);
 }
 
 template <typename It>
@@ -608,7 +1536,7 @@ It ParserSax::skipComment(It pos, It end)
         if (*pos++ == '-' && pos != end && *pos == '-')
         {
             It d(pos);
-            while (++pos != end && ::isspace((unsigned char)*pos))
+            while (++pos != end && ::isspace(impl::ctypeArg(*pos)))
                 ;
             if (pos == end || *pos++ == '>')
                 break;
@@ -628,8 +1556,10 @@ It ParserSax::skipTag(It pos, It end)
         else
         {
             // found an attribute
+            if (impl::STATS_ENABLED)
+                ++stats_.attributes;
             ++pos;
-            while (pos != end && ::isspace((unsigned char)*pos))
+            while (pos != end && ::isspace(impl::ctypeArg(*pos)))
                 ++pos;
             if (pos == end)
                 break;
@@ -642,6 +1572,10 @@ It ParserSax::skipTag(It pos, It end)
                     ++pos;
                 else
                 {
+                    // The tag starts after the text not reported yet
+                    size_t &unmatched = unmatchedQuotes_[quote == '"'];
+                    if (unmatched == std::string::npos)
+                        unmatched = currentOffset_;
                     pos = save;
                     ++pos;
                 }
@@ -659,15 +1593,497 @@ It ParserSax::skipTag(It pos, It end)
 
 typedef kp::tree<Node> Tree;
 
+//
+// MemoryUsage
+//
+
+// Heap blocks and bytes held by a parse result, by what holds them. Counted
+// from the structures, as the standard allocator would have allocated them:
+// one block per tree node, and one per string longer than the inline buffer
+// of std::string or non empty vector.
+struct MemoryUsage
+{
+    MemoryUsage() :
+        nodeAllocations(0), nodeBytes(0),
+        stringAllocations(0), stringBytes(0),
+        attributeAllocations(0), attributeBytes(0),
+        indexAllocations(0), indexBytes(0) { }
+
+    size_t allocations() const
+    {
+        return nodeAllocations + stringAllocations + attributeAllocations + indexAllocations;
+    }
+    size_t bytes() const { return nodeBytes + stringBytes + attributeBytes + indexBytes; }
+
+    // Tree nodes, including the two sentinels of kp::tree
+    size_t nodeAllocations;
+    size_t nodeBytes;
+    // Tag names and texts of the nodes
+    size_t stringAllocations;
+    size_t stringBytes;
+    // Attribute vectors and their strings, once parsed
+    size_t attributeAllocations;
+    size_t attributeBytes;
+    // TagIndex, the map nodes being estimated
+    size_t indexAllocations;
+    size_t indexBytes;
+};
+
+namespace impl {
+
+    inline void addHeap(const std::string &value, size_t &allocations, size_t &bytes)
+    {
+        static const size_t inlineCapacity = std::string().capacity();
+        if (value.capacity() > inlineCapacity)
+        {
+            ++allocations;
+            bytes += value.capacity() + 1;
+        }
+    }
+
+    template <typename T>
+    inline void addHeap(const std::vector<T> &value, size_t &allocations, size_t &bytes)
+    {
+        if (value.capacity())
+        {
+            ++allocations;
+            bytes += value.capacity() * sizeof(T);
+        }
+    }
+
+    inline MemoryUsage memoryUsage(const Tree &tree)
+    {
+        MemoryUsage usage;
+        usage.nodeAllocations = 2;
+        for (Tree::iterator it = tree.begin(); it != tree.end(); ++it)
+        {
+            ++usage.nodeAllocations;
+            addHeap(it->tagName(), usage.stringAllocations, usage.stringBytes);
+            addHeap(it->text(), usage.stringAllocations, usage.stringBytes);
+            addHeap(it->closingText(), usage.stringAllocations, usage.stringBytes);
+            addHeap(it->attributeKeys(), usage.attributeAllocations, usage.attributeBytes);
+            addHeap(it->attributeValues(), usage.attributeAllocations, usage.attributeBytes);
+            for (size_t i = 0; i < it->attributeKeys().size(); ++i)
+            {
+                addHeap(it->attributeKeys()[i], usage.attributeAllocations, usage.attributeBytes);
+                addHeap(it->attributeValues()[i], usage.attributeAllocations, usage.attributeBytes);
+            }
+        }
+        usage.nodeBytes = usage.nodeAllocations * sizeof(kp::tree_node_<Node>);
+        return usage;
+    }
+
+} // impl
+
+//
+// TagIndex
+//
+
+// Tag nodes of a parsed tree grouped by tag name, each list in document order.
+// Iterators point into the tree the index was built for and are valid until
+// that tree is modified.
+class TagIndex
+{
+public:
+    typedef std::vector<Tree::iterator> Nodes;
+
+    TagIndex() : nodes_(), none_() { }
+
+    const Nodes& find(const std::string &tagName) const;
+    bool empty() const { return nodes_.empty(); }
+    void clear()       { nodes_.clear(); }
+    void add(const Tree::iterator &it);
+    // Removes the nodes at offsets in [begin, end), and adds nodes in
+    // document order where the index has none of their range: for edits of
+    // the tree
+    void remove(size_t begin, size_t end);
+    void insert(const Nodes &nodes);
+    void addMemoryUsage(MemoryUsage &usage) const;
+
+protected:
+    std::map<std::string, Nodes> nodes_;
+    Nodes none_;
+};
+
+inline const TagIndex::Nodes& TagIndex::find(const std::string &tagName) const
+{
+    std::map<std::string, Nodes>::const_iterator found = nodes_.find(impl::toLower(tagName));
+    return found != nodes_.end() ? found->second : none_;
+}
+
+inline void TagIndex::add(const Tree::iterator &it)
+{
+    nodes_[it->tagName()].push_back(it);
+}
+
+namespace impl {
+
+    inline bool offsetBefore(const Tree::iterator &it, size_t offset)
+    {
+        return it->offset() < offset;
+    }
+
+} // impl
+
+inline void TagIndex::remove(size_t begin, size_t end)
+{
+    // Document order is offset order
+    for (std::map<std::string, Nodes>::iterator it = nodes_.begin(); it != nodes_.end(); )
+    {
+        Nodes &nodes = it->second;
+        const Nodes::iterator first = std::lower_bound(nodes.begin(), nodes.end(), begin,
+                impl::offsetBefore);
+        nodes.erase(first, std::lower_bound(first, nodes.end(), end, impl::offsetBefore));
+        if (nodes.empty())
+            it = nodes_.erase(it);
+        else
+            ++it;
+    }
+}
+
+inline void TagIndex::insert(const Nodes &nodes)
+{
+    std::map<std::string, Nodes> added;
+    for (size_t i = 0; i < nodes.size(); ++i)
+        added[nodes[i]->tagName()].push_back(nodes[i]);
+    for (std::map<std::string, Nodes>::iterator it = added.begin(); it != added.end(); ++it)
+    {
+        Nodes &existing = nodes_[it->first];
+        existing.insert(std::lower_bound(existing.begin(), existing.end(),
+                    it->second.front()->offset(), impl::offsetBefore),
+                it->second.begin(), it->second.end());
+    }
+}
+
+inline void TagIndex::addMemoryUsage(MemoryUsage &usage) const
+{
+    // A red-black tree node holds its color and three links before the value
+    const size_t mapNodeSize = 4 * sizeof(void*) + sizeof(std::pair<const std::string, Nodes>);
+    for (std::map<std::string, Nodes>::const_iterator it = nodes_.begin(); it != nodes_.end(); ++it)
+    {
+        ++usage.indexAllocations;
+        usage.indexBytes += mapNodeSize;
+        impl::addHeap(it->first, usage.indexAllocations, usage.indexBytes);
+        impl::addHeap(it->second, usage.indexAllocations, usage.indexBytes);
+    }
+}
+
+//
+// ElementIndex
+//
+
+// Elements of a parsed tree by id and by class name. Built in one pass which
+// only looks at the id and class attributes and does not parse the attributes
+// of the nodes. Iterators are valid until the tree is modified.
+class ElementIndex
+{
+public:
+    typedef std::vector<Tree::iterator> Nodes;
+
+    ElementIndex() : ids_(), classes_(), none_() { }
+    explicit ElementIndex(const Tree &tree) : ids_(), classes_(), none_() { build(tree); }
+
+    void build(const Tree &tree);
+    void clear() { ids_.clear(); classes_.clear(); }
+
+    // First element with the id in document order, a null iterator if none
+    Tree::iterator getElementById(const std::string &id) const;
+    // All elements with the id (ids are not always unique), in document order
+    const Nodes& getElementsById(const std::string &id) const;
+    // Elements having the class among their classes, in document order
+    const Nodes& getElementsByClassName(const std::string &className) const;
+
+protected:
+    std::unordered_map<std::string, Nodes> ids_;
+    std::unordered_map<std::string, Nodes> classes_;
+    Nodes none_;
+};
+
+inline void ElementIndex::build(const Tree &tree)
+{
+    clear();
+    for (Tree::iterator it = tree.begin(); it != tree.end(); ++it)
+    {
+        if (!it->isTag())
+            continue;
+        bool seenId = false, seenClass = false;
+        impl::scanAttributes(it->text().c_str(), [&](const char *keyBegin, const char *keyEnd,
+                const char *valueBegin, const char *valueEnd)
+        {
+            if (!valueBegin)
+                return true;
+            if (!seenId && impl::iequals(keyBegin, keyEnd, "id"))
+            {
+                // Node::attribute() returns the first one as well
+                seenId = true;
+                if (valueBegin != valueEnd)
+                    ids_[std::string(valueBegin, valueEnd)].push_back(it);
+            }
+            else if (!seenClass && impl::iequals(keyBegin, keyEnd, "class"))
+            {
+                seenClass = true;
+                const char *pos = valueBegin;
+                while (pos != valueEnd)
+                {
+                    while (pos != valueEnd && ::isspace((unsigned char)*pos))
+                        ++pos;
+                    const char *name = pos;
+                    while (pos != valueEnd && !::isspace((unsigned char)*pos))
+                        ++pos;
+                    if (name == pos)
+                        continue;
+                    Nodes &nodes = classes_[std::string(name, pos)];
+                    // class="a a" lists the element once
+                    if (nodes.empty() || nodes.back() != it)
+                        nodes.push_back(it);
+                }
+            }
+            return !(seenId && seenClass);
+        });
+    }
+}
+
+inline Tree::iterator ElementIndex::getElementById(const std::string &id) const
+{
+    const Nodes &nodes = getElementsById(id);
+    return !nodes.empty() ? nodes.front() : Tree::iterator();
+}
+
+inline const ElementIndex::Nodes& ElementIndex::getElementsById(const std::string &id) const
+{
+    std::unordered_map<std::string, Nodes>::const_iterator found = ids_.find(id);
+    return found != ids_.end() ? found->second : none_;
+}
+
+inline const ElementIndex::Nodes& ElementIndex::getElementsByClassName(const std::string &className) const
+{
+    std::unordered_map<std::string, Nodes>::const_iterator found = classes_.find(className);
+    return found != classes_.end() ? found->second : none_;
+}
+
+//
+// OffsetIndex
+//
+
+// Nodes of a parsed tree by source offset. The nodes are kept in pre-order,
+// which is the order of their offsets, with a max-tree over their ends: the
+// ranges of the nodes nest, so the deepest node containing a range is the
+// last one starting at or before it among those ending after it, found in
+// O(log n). Built in one pass, iterators are valid until the tree is modified.
+class OffsetIndex
+{
+public:
+    typedef std::vector<Tree::iterator> Nodes;
+
+    OffsetIndex() : nodes_(), offsets_(), ends_(), leaves_(0) { }
+    explicit OffsetIndex(const Tree &tree) : nodes_(), offsets_(), ends_(), leaves_(0) { build(tree); }
+
+    void build(const Tree &tree);
+    void clear();
+    size_t size() const { return nodes_.size(); }
+
+    // Deepest node whose offset() and length() contain offset, a null
+    // iterator if none (past the end of the document)
+    Tree::iterator find(size_t offset) const { return find(offset, offset + 1); }
+    // Deepest node containing all of [begin, end), an empty range being the
+    // byte at begin
+    Tree::iterator find(size_t begin, size_t end) const;
+    // Nodes starting in [begin, end), in document order
+    std::pair<Nodes::const_iterator, Nodes::const_iterator> startingIn(size_t begin, size_t end) const;
+
+protected:
+    std::vector<Tree::iterator> nodes_;
+    std::vector<size_t> offsets_;
+    // Implicit binary tree with the ends of the nodes at leaves_ + i and the
+    // largest end below each inner node
+    std::vector<size_t> ends_;
+    size_t leaves_;
+};
+
+inline void OffsetIndex::clear()
+{
+    nodes_.clear();
+    offsets_.clear();
+    ends_.clear();
+    leaves_ = 0;
+}
+
+inline void OffsetIndex::build(const Tree &tree)
+{
+    clear();
+    for (Tree::iterator it = tree.begin(); it != tree.end(); ++it)
+    {
+        nodes_.push_back(it);
+        offsets_.push_back(it->offset());
+    }
+    leaves_ = 1;
+    while (leaves_ < nodes_.size())
+        leaves_ *= 2;
+    ends_.assign(2 * leaves_, 0);
+    for (size_t i = 0; i < nodes_.size(); ++i)
+        ends_[leaves_ + i] = offsets_[i] + nodes_[i]->length();
+    for (size_t i = leaves_ - 1; i > 0; --i)
+        ends_[i] = std::max(ends_[2 * i], ends_[2 * i + 1]);
+}
+
+inline Tree::iterator OffsetIndex::find(size_t begin, size_t end) const
+{
+    // Last node starting at or before begin (the root and the first node both
+    // start at 0, the later one is the deeper)
+    if (end <= begin)
+        end = begin + 1;
+    const size_t last = std::upper_bound(offsets_.begin(), offsets_.end(), begin) - offsets_.begin();
+    if (last == 0)
+        return Tree::iterator();
+
+    // Walk up from its leaf, looking at the subtrees on the left, then down
+    // the rightmost path to a node ending at or after end
+    size_t i = leaves_ + last - 1;
+    if (ends_[i] < end)
+    {
+        for (;;)
+        {
+            if (i == 1)
+                return Tree::iterator();
+            if ((i & 1) && ends_[i - 1] >= end)
+            {
+                --i;
+                break;
+            }
+            i /= 2;
+        }
+        while (i < leaves_)
+            i = ends_[2 * i + 1] >= end ? 2 * i + 1 : 2 * i;
+    }
+    return nodes_[i - leaves_];
+}
+
+inline std::pair<OffsetIndex::Nodes::const_iterator, OffsetIndex::Nodes::const_iterator>
+OffsetIndex::startingIn(size_t begin, size_t end) const
+{
+    const size_t first = std::lower_bound(offsets_.begin(), offsets_.end(), begin) - offsets_.begin();
+    const size_t last = std::lower_bound(offsets_.begin() + first, offsets_.end(), end) - offsets_.begin();
+    return std::make_pair(nodes_.begin() + first, nodes_.begin() + std::max(first, last));
+}
+
+//
+// LineIndex
+//
+
+// Lines and columns of source offsets, for diagnostics. The line starts are
+// found with memchr(), which the C libraries vectorize, and looked up by
+// binary search. Lines only end at '\n': the '\r' of "\r\n" is the last
+// column of its line. Lines and columns start at 1.
+class LineIndex
+{
+public:
+    struct Position
+    {
+        size_t line;
+        size_t column;
+    };
+
+    LineIndex() : starts_(1, 0), length_(0) { }
+    explicit LineIndex(const std::string &html) : starts_(), length_(0) { build(html); }
+
+    void build(const char *data, size_t length);
+    void build(const std::string &html) { build(html.data(), html.length()); }
+    size_t lines() const { return starts_.size(); }
+    // Offset of the first byte of a line, clamped to [1, lines() + 1] where
+    // the line after the last starts at the end of the document
+    size_t lineOffset(size_t line) const;
+
+    // Column in bytes. Offsets past the end of the document are taken as the
+    // end.
+    Position position(size_t offset) const;
+    // Column in code points of html, the document the index was built for:
+    // the bytes which are not UTF-8 continuation bytes are counted
+    Position utf8Position(size_t offset, const std::string &html) const;
+
+protected:
+    std::vector<size_t> starts_;
+    size_t length_;
+};
+
+inline void LineIndex::build(const char *data, size_t length)
+{
+    starts_.clear();
+    starts_.push_back(0);
+    length_ = length;
+    const char *p = data, *const end = data + length;
+    while ((p = static_cast<const char*>(memchr(p, '\n', end - p))) != 0)
+        starts_.push_back(++p - data);
+}
+
+inline size_t LineIndex::lineOffset(size_t line) const
+{
+    if (line == 0)
+        return 0;
+    return line <= starts_.size() ? starts_[line - 1] : length_;
+}
+
+inline LineIndex::Position LineIndex::position(size_t offset) const
+{
+    offset = std::min(offset, length_);
+    const size_t line = std::upper_bound(starts_.begin(), starts_.end(), offset) - starts_.begin();
+    Position position = { line, offset - starts_[line - 1] + 1 };
+    return position;
+}
+
+inline LineIndex::Position LineIndex::utf8Position(size_t offset, const std::string &html) const
+{
+    Position position = this->position(offset);
+    const unsigned char *p = reinterpret_cast<const unsigned char*>(html.data())
+        + std::min(starts_[position.line - 1], html.length());
+    const unsigned char *const end = reinterpret_cast<const unsigned char*>(html.data())
+        + std::min(starts_[position.line - 1] + position.column - 1, html.length());
+    // ASCII is counted 8 bytes at a time. An offset inside of a character is
+    // in its column.
+    size_t column = p != end && end != reinterpret_cast<const unsigned char*>(html.data()) + html.length()
+        && (*end & 0xc0) == 0x80 ? 0 : 1;
+    while (p != end)
+    {
+        if (end - p >= 8)
+        {
+            uint64_t word;
+            memcpy(&word, p, 8);
+            if (!(word & 0x8080808080808080ull))
+            {
+                p += 8;
+                column += 8;
+                continue;
+            }
+        }
+        if ((*p++ & 0xc0) != 0x80)
+            ++column;
+    }
+    position.column = column;
+    return position;
+}
+
 class ParserDom : public ParserSax
 {
 public:
-    ParserDom() : tree_(), currIt_() {}
+    ParserDom() : tree_(), currIt_(), tagIndex_(), indexTags_(false), hashSubtrees_(false), depth_(0) {}
     ~ParserDom() {}
 
     const Tree& parseTree(const std::string &html);
+    // Wide documents give the tree of the document converted to UTF-8
+    const Tree& parseTree(const std::u16string &html);
+    const Tree& parseTree(const std::wstring &html);
     const Tree& root() { return tree_; }
 
+    // Keep child counts and subtree sizes cached in the tree, see kp::tree::cache_counts
+    void setCachedCounts(bool value) { tree_.cache_counts(value); }
+    // Build a TagIndex of root() while parsing
+    void setTagIndex(bool value) { indexTags_ = value; }
+    const TagIndex& tagIndex() const { return tagIndex_; }
+    // Set Node::hash() on each element as it is closed
+    void setSubtreeHashes(bool value) { hashSubtrees_ = value; }
+
+    // Heap held by the tree and the tag index
+    MemoryUsage memoryUsage() const;
+
 protected:
     virtual void onBeginParsing();
     virtual void onFoundTag(Node &node, bool isClosingTag);
@@ -675,8 +2091,19 @@ protected:
     virtual void onFoundComment(Node &node);
     virtual void onEndParsing();
 
+    // Hash of it from its own and those of its children, of its subtree, of
+    // its ancestors
+    static void hashNode(const Tree::iterator &it);
+    static void hashSubtree(const Tree::iterator &it);
+    static void hashAncestors(const Tree::iterator &it);
+
     Tree tree_;
     Tree::iterator currIt_;
+    TagIndex tagIndex_;
+    bool indexTags_;
+    bool hashSubtrees_;
+    // Depth of currIt_, for the stats and the budget
+    size_t depth_;
 };
 
 inline const Tree& ParserDom::parseTree(const std::string &html)
@@ -685,9 +2112,65 @@ inline const Tree& ParserDom::parseTree(const std::string &html)
     return root();
 }
 
+inline const Tree& ParserDom::parseTree(const std::u16string &html)
+{
+    parse(html);
+    return root();
+}
+
+inline const Tree& ParserDom::parseTree(const std::wstring &html)
+{
+    parse(html);
+    return root();
+}
+
+inline MemoryUsage ParserDom::memoryUsage() const
+{
+    MemoryUsage usage = impl::memoryUsage(tree_);
+    tagIndex_.addMemoryUsage(usage);
+    return usage;
+}
+
+inline void ParserDom::hashNode(const Tree::iterator &it)
+{
+    const std::string &value = it->isTag() ? it->tagName() : it->text();
+    size_t length = 0;
+    if (it->isTag() || it->isText() || it->isComment())
+    {
+        const void *nul = memchr(value.data(), 0, value.length());
+        length = nul ? static_cast<const char*>(nul) - value.data() : value.length();
+    }
+    uint64_t hash = impl::hashBytes(value.data(), length, it->kind(), 0x2020202020202020ull);
+    for (Tree::sibling_iterator child = it.begin(); child != it.end(); ++child)
+        hash = impl::hashMix(hash * 0x9e3779b97f4a7c15ull + child->hash_);
+    it->hash_ = hash;
+}
+
+inline void ParserDom::hashSubtree(const Tree::iterator &it)
+{
+    // Children first, without recursion: documents may nest deep
+    Tree::iterator first = it;
+    while (first.begin() != first.end())
+        first = first.begin();
+    for (Tree::post_order_iterator pos(first); ; ++pos)
+    {
+        hashNode(Tree::iterator(pos));
+        if (pos.node == it.node)
+            break;
+    }
+}
+
+inline void ParserDom::hashAncestors(const Tree::iterator &it)
+{
+    for (Tree::iterator parent = Tree::parent(it); parent; parent = Tree::parent(parent))
+        hashNode(parent);
+}
+
 inline void ParserDom::onBeginParsing()
 {
     tree_.clear();
+    tagIndex_.clear();
+    depth_ = 0;
     Node node("", "", "" , 0, 0, Node::NODE_ROOT);
     currIt_ = tree_.insert(tree_.begin(), node);
 }
@@ -696,6 +2179,10 @@ inline void ParserDom::onEndParsing()
 {
     Tree::iterator top = tree_.begin();
     top->length_ = currentOffset_;
+    // The elements still open
+    if (hashSubtrees_)
+        for (Tree::iterator it = currIt_; it; it = Tree::parent(it))
+            hashNode(it);
 }
 
 inline void ParserDom::onFoundComment(Node &node)
@@ -707,21 +2194,38 @@ inline void ParserDom::onFoundComment(Node &node)
 inline void ParserDom::onFoundText(Node &node)
 {
     //Add child content node, but do not update current state
-    tree_.append_child(currIt_, node);
+    enterPhase(ParserTimes::PHASE_INSERT);
+    Tree::iterator it = tree_.append_child(currIt_, node);
+    if (hashSubtrees_)
+        hashNode(it);
 }
 
 inline void ParserDom::onFoundTag(Node &node, bool isClosingTag)
 {
     if (!isClosingTag)
     {
+        if (depth_ >= depthLimit_)
+        {
+            // The document ends before this tag
+            currentOffset_ = node.offset();
+            stopParsing(PARSE_DEPTH_LIMIT);
+            return;
+        }
         //append to current tree node
+        enterPhase(ParserTimes::PHASE_INSERT);
         currIt_ = tree_.append_child(currIt_, node);
+        if (indexTags_)
+            tagIndex_.add(currIt_);
+        ++depth_;
+        if (impl::STATS_ENABLED && depth_ > stats_.maxDepth)
+            stats_.maxDepth = depth_;
     }
     else
     {
         //Look if there is a pending open tag with that same name upwards
         //If currIt_ tag isn't matching tag, maybe a some of its parents
         // matches
+        enterPhase(ParserTimes::PHASE_CLOSING);
         std::vector<Tree::iterator> path;
         Tree::iterator i = currIt_;
         bool foundOpenTag = false;
@@ -734,6 +2238,8 @@ inline void ParserDom::onFoundTag(Node &node, bool isClosingTag)
             const char *open = i->tagName().c_str();
             const char *close = node.tagName().c_str();
             equal = impl::icompare(open, close) == 0;
+            if (impl::STATS_ENABLED)
+                ++stats_.closingSteps;
 
             if (equal)
             {
@@ -759,12 +2265,26 @@ inline void ParserDom::onFoundTag(Node &node, bool isClosingTag)
             //nodes that were waiting for a close
             for (size_t j = 0; j < path.size(); ++j)
                 tree_.flatten(path[j]);
+            if (hashSubtrees_)
+            {
+                for (size_t j = 0; j < path.size(); ++j)
+                    hashNode(path[j]);
+                hashNode(i);
+            }
+            depth_ -= path.size() + 1;
+            if (impl::STATS_ENABLED)
+                stats_.flattens += path.size();
         }
         else
         {
             // Treat as comment
+            enterPhase(ParserTimes::PHASE_INSERT);
             node.kind_ = Node::NODE_COMMENT;
-            tree_.append_child(currIt_, node);
+            Tree::iterator it = tree_.append_child(currIt_, node);
+            if (hashSubtrees_)
+                hashNode(it);
+            if (impl::STATS_ENABLED)
+                ++stats_.unmatchedClosingTags;
         }
     }
 }
@@ -796,6 +2316,45 @@ inline It rfindTag(It it, It rend, const std::string &tag)
     return rend;
 }
 
+// Same as above using the index of the tree: document order is offset order,
+// so these are binary searches in the list of the tag.
+inline Tree::iterator findTag(const Tree::iterator &it, const Tree::iterator &end,
+        const std::string &tag, const TagIndex &index)
+{
+    if (it->isEnd())
+        return end;
+    const TagIndex::Nodes &nodes = index.find(tag);
+    TagIndex::Nodes::const_iterator found = std::lower_bound(nodes.begin(), nodes.end(),
+            it->offset(), [](const Tree::iterator &node, size_t offset)
+    {
+        return node->offset() < offset;
+    });
+    if (found == nodes.end() || (!end->isEnd() && (*found)->offset() >= end->offset()))
+        return end;
+    return *found;
+}
+
+inline Tree::iterator rfindTag(const Tree::iterator &it, const Tree::iterator &rend,
+        const std::string &tag, const TagIndex &index)
+{
+    if (it->isRoot())
+        return rend;
+    const TagIndex::Nodes &nodes = index.find(tag);
+    TagIndex::Nodes::const_iterator found = nodes.end();
+    if (!it->isEnd())
+        found = std::upper_bound(nodes.begin(), nodes.end(), it->offset(),
+                [](size_t offset, const Tree::iterator &node)
+        {
+            return offset < node->offset();
+        });
+    if (found == nodes.begin())
+        return rend;
+    --found;
+    if (!rend->isRoot() && (*found)->offset() <= rend->offset())
+        return rend;
+    return *found;
+}
+
 } }
 
 #endif
@@ -0,0 +1,416 @@
+// htmlcxx2.
+// A simple non-validating parser written in C++.
+//
+// Incremental reparsing after edits.
+
+#ifndef __HTML_PARSER_INCREMENTAL_H__
+#define __HTML_PARSER_INCREMENTAL_H__
+
+#include <cstring>
+#include <string>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <stdexcept>
+
+#include "htmlcxx2_html.hpp"
+#include "htmlcxx2_parallel.hpp"
+
+namespace htmlcxx2 {
+namespace HTML {
+
+//
+// ParserDomIncremental
+//
+
+// Keeps the tree of the last document up to date through edits. Only the
+// children of the innermost element closed by its own closing tag around the
+// edit are looked at: tokenizing restarts at the last child before the edit
+// and stops at the first child boundary after it where the tokenizer is in
+// the same state with the same elements open, or at the closing tag of the
+// element, and the children in between are replaced. An edit leaving an
+// element unclosed thus costs the rest of the enclosing element. When the new
+// tokens could close elements outside of it, the whole document is parsed
+// again, as it is when the edit adds a quote after a tag whose quote had no
+// match. The offsets of the nodes after the edit are shifted, which is linear
+// in their number, and the tag index only gets the replaced nodes changed.
+// With a budget, or after a parse it stopped, every update parses the whole
+// document again. The tree is always the one ParserDom::parseTree() returns
+// for the new document.
+class ParserDomIncremental : public ParserDom
+{
+public:
+    ParserDomIncremental() : reparsed_(0) { }
+    ~ParserDomIncremental() { }
+
+    const Tree& parseTree(const std::string &html);
+    // The updates are then edits of the document converted to UTF-8
+    const Tree& parseTree(const std::u16string &html);
+    const Tree& parseTree(const std::wstring &html);
+
+    // html is the document after replacing removedLength bytes at offset of
+    // the previous document with insertedLength bytes. Throws
+    // std::invalid_argument if the lengths do not match, which can only be
+    // checked when the previous parse went to the end.
+    const Tree& update(const std::string &html, size_t offset, size_t removedLength,
+            size_t insertedLength);
+
+    // Bytes tokenized by the last parse or update
+    size_t reparsedLength() const { return reparsed_; }
+
+protected:
+    Tree::iterator enclosing(size_t begin, size_t end) const;
+    bool splice(const Tree::iterator &element, const char *literal, const std::string &html,
+            size_t offset, size_t removedLength, size_t insertedLength);
+    void openAround(const Tree::iterator &element, std::vector<const std::string*> &names) const;
+
+    size_t reparsed_;
+};
+
+inline const Tree& ParserDomIncremental::parseTree(const std::string &html)
+{
+    reparsed_ = html.length();
+    return ParserDom::parseTree(html);
+}
+
+inline const Tree& ParserDomIncremental::parseTree(const std::u16string &html)
+{
+    ParserDom::parseTree(html);
+    reparsed_ = tree_.begin()->length();
+    return tree_;
+}
+
+inline const Tree& ParserDomIncremental::parseTree(const std::wstring &html)
+{
+    ParserDom::parseTree(html);
+    reparsed_ = tree_.begin()->length();
+    return tree_;
+}
+
+inline Tree::iterator ParserDomIncremental::enclosing(size_t begin, size_t end) const
+{
+    // Children are in offset order: the edit can only be below the last one
+    // starting before it. Unclosed elements are looked through.
+    Tree::iterator best;
+    Tree::iterator parent = tree_.begin();
+    for (;;)
+    {
+        Tree::sibling_iterator last;
+        for (Tree::sibling_iterator child = parent.begin(); child != parent.end(); ++child)
+        {
+            if (child->offset() > begin)
+                break;
+            last = child;
+        }
+        if (!last || !last->isTag())
+            return best;
+        if (!last->closingText().empty())
+        {
+            const size_t contentBegin = last->offset() + last->text().length();
+            const size_t contentEnd = last->offset() + last->length() - last->closingText().length();
+            if (begin < contentBegin || end > contentEnd)
+                return best;
+            best = last;
+        }
+        parent = last;
+    }
+}
+
+inline void ParserDomIncremental::openAround(const Tree::iterator &element,
+        std::vector<const std::string*> &names) const
+{
+    // The element, its ancestors, and the unclosed elements before them,
+    // which the closing tags of the ancestors flattened later
+    for (Tree::iterator it = element; it != tree_.begin(); it = Tree::parent(it))
+    {
+        names.push_back(&it->tagName());
+        for (Tree::sibling_iterator sibling = Tree::parent(it).begin(); sibling != it; ++sibling)
+            if (sibling->isTag() && sibling->closingText().empty())
+                names.push_back(&sibling->tagName());
+    }
+}
+
+inline bool ParserDomIncremental::splice(const Tree::iterator &element, const char *literal,
+        const std::string &html, size_t offset, size_t removedLength, size_t insertedLength)
+{
+    const bool isRoot = element == tree_.begin();
+    const size_t contentBegin = isRoot ? 0 : element->offset() + element->text().length();
+    const size_t contentEnd = element->offset() + element->length() - element->closingText().length();
+
+    // Restart at the last child starting at or before the edit, or at the
+    // text before it: where a text ends depends on what follows its end. When
+    // blank text is dropped there may be some not in the tree before it. The
+    // unclosed children before it are still open there, they are only
+    // flattened by the closing tag of the element.
+    Tree::sibling_iterator restart = element.end(), previous = element.end();
+    for (Tree::sibling_iterator child = element.begin();
+            child != element.end() && child->offset() <= offset; ++child)
+    {
+        previous = restart;
+        restart = child;
+    }
+    if (previous != element.end() && (previous->isText() || !options_.whitespaceText))
+        restart = previous;
+    if (restart == element.end())
+        restart = element.begin();
+
+    impl::ChunkTokenizer tokenizer;
+    tokenizer.setValidateUtf8(validateUtf8_);
+    std::deque<impl::ChunkToken> &tokens = tokenizer.tokens;
+    std::vector<const std::string*> outside, oldOpen;
+    // Indexes of the new tokens still open, the tokens may move as they grow
+    std::vector<size_t> newOpen;
+    Tree::sibling_iterator next;
+    for (bool synced = false; !synced; )
+    {
+        outside.clear();
+        for (Tree::sibling_iterator child = element.begin(); child != restart; ++child)
+            if (child->isTag() && child->closingText().empty())
+                outside.push_back(&child->tagName());
+        const size_t stillOpen = outside.size();
+        if (isRoot && stillOpen)
+            return false;
+        openAround(element, outside);
+
+        // Tokenize until a token boundary past the edit falls on the start of
+        // an old child in the same tokenizer state and with the same elements
+        // open, or on the closing tag of the element
+        tokens.clear();
+        oldOpen.clear();
+        newOpen.clear();
+        next = restart;
+        const size_t from = restart != element.begin() ? restart->offset() : contentBegin;
+        size_t pos = from;
+        const char *state = restart != element.begin() ? nullptr : literal;
+        size_t checked = 0, step = 64;
+        while (!synced)
+        {
+            // Boundaries are checked token by token, the tokenizer is run on
+            // growing steps past them
+            tokenizer.tokenize(html, pos, state, pos + step);
+            step *= 2;
+            // Past half of the document, parsing it all again is cheaper
+            if (tokenizer.endOffset == pos || tokenizer.endOffset - from > html.length() / 2)
+                return false;
+            pos = tokenizer.endOffset;
+            state = tokenizer.endLiteral;
+
+            for (; !synced && checked < tokens.size(); ++checked)
+            {
+                const Node &node = tokens[checked].node;
+                if (node.isTag() && !tokens[checked].isClosingTag)
+                    newOpen.push_back(checked);
+                else if (node.isTag())
+                {
+                    size_t j = newOpen.size();
+                    while (j > 0 && impl::icompare(tokens[newOpen[j - 1]].node.tagName().c_str(),
+                                node.tagName().c_str()) != 0)
+                        --j;
+                    if (j > 0)
+                        newOpen.resize(j - 1);
+                    else
+                    {
+                        // Closing an element opened before the restart changes
+                        // old nodes: start from the first child, or give up if
+                        // the element or an outer one gets closed
+                        size_t k = 0;
+                        while (k < outside.size()
+                                && impl::icompare(outside[k]->c_str(), node.tagName().c_str()) != 0)
+                            ++k;
+                        if (k < stillOpen)
+                            break;
+                        if (k < outside.size())
+                            return false;
+                    }
+                }
+
+                const size_t end = node.offset() + node.length();
+                if (end < offset + insertedLength)
+                    continue;
+                const size_t old = end - insertedLength + removedLength;
+                while (next != element.end() && next->offset() < old)
+                {
+                    if (next->isTag() && next->closingText().empty())
+                        oldOpen.push_back(&next->tagName());
+                    ++next;
+                }
+                if (old > contentEnd || (old == contentEnd && tokens[checked].literalAfter))
+                    return false;
+                if (old == contentEnd)
+                {
+                    // The closing tag of the element flattens what is still open
+                    // (the end of the document leaves it as is)
+                    size_t k = 0;
+                    while (k < newOpen.size() && (isRoot || impl::icompare(
+                                    tokens[newOpen[k]].node.tagName().c_str(),
+                                    element->tagName().c_str()) != 0))
+                        ++k;
+                    if (k < newOpen.size())
+                        return false;
+                    synced = true;
+                }
+                else if (!tokens[checked].literalAfter && next != element.end()
+                        && next->offset() == old && newOpen.size() == oldOpen.size()
+                        && (!isRoot || newOpen.empty()))
+                {
+                    size_t k = 0;
+                    while (k < newOpen.size() && tokens[newOpen[k]].node.tagName() == *oldOpen[k])
+                        ++k;
+                    synced = k == newOpen.size();
+                }
+            }
+            if (!synced && checked < tokens.size())
+            {
+                restart = element.begin();
+                break;
+            }
+        }
+        if (synced)
+        {
+            tokens.erase(tokens.begin() + checked, tokens.end());
+            reparsed_ = tokens.back().node.offset() + tokens.back().node.length() - from;
+        }
+    }
+
+    // Replace the old children with the new tokens, as ParserDom::onFoundTag()
+    // would without looking past the element
+    const size_t oldEnd = element->offset() + element->length();
+    const char *literalBefore = restart != element.begin() ? nullptr : literal;
+    // Offset order is tree order: the children replaced hold the nodes
+    // between them and the next one
+    if (indexTags_ && restart != next)
+        tagIndex_.remove(restart->offset(), next != element.end() ? next->offset() : contentEnd);
+    for (Tree::sibling_iterator child = restart; child != next; )
+    {
+        Tree::sibling_iterator erased = child;
+        ++child;
+        tree_.erase(erased);
+    }
+    Tree::iterator current = element;
+    auto add = [&](const Node &node)
+    {
+        if (current != element)
+            return tree_.append_child(current, node);
+        return next != element.end() ? Tree::iterator(tree_.insert(next, node))
+            : tree_.append_child(element, node);
+    };
+    std::vector<Tree::iterator> path;
+    TagIndex::Nodes indexed;
+    for (size_t i = 0; i < tokens.size(); ++i)
+    {
+        Node &node = tokens[i].node;
+        const bool literalText = literalBefore != nullptr;
+        literalBefore = tokens[i].literalAfter;
+        if (!keepToken(node, literalText))
+            continue;
+        if (!node.isTag() || !tokens[i].isClosingTag)
+        {
+            Tree::iterator added = add(node);
+            if (node.isTag())
+            {
+                current = added;
+                if (indexTags_)
+                    indexed.push_back(added);
+            }
+            continue;
+        }
+        path.clear();
+        Tree::iterator it = current;
+        while (it != element && impl::icompare(it->tagName().c_str(), node.tagName().c_str()) != 0)
+        {
+            path.push_back(it);
+            it = Tree::parent(it);
+        }
+        if (it != element)
+        {
+            it->length_ = node.offset() + node.length() - it->offset();
+            it->closingText_ = impl::toLower(node.text());
+            current = Tree::parent(it);
+            for (size_t j = 0; j < path.size(); ++j)
+                tree_.flatten(path[j]);
+        }
+        else
+        {
+            node.kind_ = Node::NODE_COMMENT;
+            add(node);
+        }
+    }
+    if (!isRoot)
+        for (Tree::iterator it = current; it != element; it = Tree::parent(it))
+            tree_.flatten(it);
+
+    // Ancestors spanning the edit grow or shrink, later nodes move
+    for (Tree::iterator it = element; it; it = Tree::parent(it))
+        if (it->offset() + it->length() >= oldEnd)
+            it->length_ = it->length_ + insertedLength - removedLength;
+    Tree::iterator after = next;
+    if (next == element.end())
+    {
+        after = element;
+        after.skip_children();
+        ++after;
+    }
+    for (; after != tree_.end(); ++after)
+        after->offset_ = after->offset_ + insertedLength - removedLength;
+    if (!indexed.empty())
+        tagIndex_.insert(indexed);
+
+    const char quotes[] = { '\'', '"' };
+    for (size_t k = 0; k < 2; ++k)
+    {
+        size_t &unmatched = unmatchedQuotes_[k];
+        if (unmatched != std::string::npos && unmatched >= offset)
+            unmatched = unmatched >= offset + removedLength
+                ? unmatched + insertedLength - removedLength : offset;
+        unmatched = std::min(unmatched, tokenizer.unmatchedQuote(quotes[k]));
+    }
+    return true;
+}
+
+inline const Tree& ParserDomIncremental::update(const std::string &html, size_t offset,
+        size_t removedLength, size_t insertedLength)
+{
+    // The tree of a stopped parse does not tell how long the document was,
+    // and the splice would not stop where the budget does
+    if (budget_.limited() || status_ != PARSE_COMPLETE)
+        return parseTree(html);
+
+    const size_t oldLength = tree_.empty() ? 0 : tree_.begin()->length();
+    if (tree_.empty() || offset > oldLength || removedLength > oldLength - offset
+            || html.length() != oldLength - removedLength + insertedLength)
+        throw std::invalid_argument("htmlcxx2: edit does not match the document");
+
+    // A quote added after a tag with an unmatched one changes where the tag
+    // ends, which may be anywhere before the edit
+    const char quotes[] = { '\'', '"' };
+    for (size_t k = 0; k < 2; ++k)
+        if (unmatchedQuotes_[k] <= offset
+                && memchr(html.data() + offset, quotes[k], insertedLength))
+            return parseTree(html);
+
+    Tree::iterator element = enclosing(offset, offset + removedLength);
+    if (!element)
+        element = tree_.begin();
+
+    // The content of literal elements (script, style...) starts in literal mode
+    const char *literal = nullptr;
+    if (element->isTag())
+    {
+        impl::ChunkTokenizer opening;
+        opening.tokenize(html, element->offset(), nullptr, element->offset() + 1);
+        literal = opening.endLiteral;
+    }
+
+    if (!splice(element, literal, html, offset, removedLength, insertedLength))
+        return parseTree(html);
+    if (hashSubtrees_)
+    {
+        hashSubtree(element);
+        hashAncestors(element);
+    }
+    return tree_;
+}
+
+} }
+
+#endif
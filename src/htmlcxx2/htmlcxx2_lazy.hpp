@@ -0,0 +1,356 @@
+// htmlcxx2.
+// A simple non-validating parser written in C++.
+//
+// Parsing with the deep parts of the tree built on demand.
+
+#ifndef __HTML_PARSER_LAZY_H__
+#define __HTML_PARSER_LAZY_H__
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <iterator>
+#include <unordered_map>
+
+#include "htmlcxx2_html.hpp"
+
+namespace htmlcxx2 {
+namespace HTML {
+
+//
+// ParserDomLazy
+//
+
+// Builds the tree down to a given depth. Below it the tags are still
+// tokenized, to know where each element ends, but nothing else is copied or
+// inserted: the elements at that depth only remember the range of their
+// content, and get their children from it when an iterator descends into
+// them. The nodes walked are those of ParserDom, in the same order.
+//
+//     ParserDomLazy parser(3);
+//     parser.parseTree(html);
+//     for (ParserDomLazy::iterator it = parser.begin(); it != parser.end(); ++it)
+//         if (it->tagName() == "nav")
+//             it.skipChildren();
+//
+// The tree being built is not handed out: root() and tagIndex() build it all
+// first. html is read again on expansion and must be kept unchanged until
+// then. With a budget the tree is built in full as ParserDom builds it, so
+// that the limits apply to the whole document.
+class ParserDomLazy : public ParserDom
+{
+public:
+    // Pre-order iterator building the children of each element it descends
+    // into
+    class iterator
+    {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef Node value_type;
+        typedef ptrdiff_t difference_type;
+        typedef Node* pointer;
+        typedef Node& reference;
+
+        iterator() : parser_(nullptr), it_(), skip_(false) { }
+        iterator(ParserDomLazy *parser, const Tree::iterator &it) :
+            parser_(parser), it_(it), skip_(false) { }
+
+        Node& operator*() const  { return *it_; }
+        Node* operator->() const { return &*it_; }
+        bool operator==(const iterator &rhs) const { return it_ == rhs.it_; }
+        bool operator!=(const iterator &rhs) const { return it_ != rhs.it_; }
+        iterator& operator++();
+        iterator operator++(int)
+        {
+            iterator copy(*this);
+            ++*this;
+            return copy;
+        }
+
+        // The next increment goes past the children without building them
+        void skipChildren() { skip_ = true; }
+        // The node in the tree, its children not built yet if it is not
+        // ParserDomLazy::isExpanded()
+        const Tree::iterator& base() const { return it_; }
+
+    protected:
+        ParserDomLazy *parser_;
+        Tree::iterator it_;
+        bool skip_;
+    };
+
+    // Elements at depth (the root being at 0) have their children built on demand
+    explicit ParserDomLazy(size_t depth = 2) :
+        html_(nullptr), converted_(), levels_(depth ? depth : 1), rangeDepth_(0), boundaryDepth_(0),
+        boundary_(), contentBegin_(0), boundaryLiteral_(nullptr), open_(), pending_(),
+        flattenLater_(), flattening_(false), indexStale_(false) { }
+    ~ParserDomLazy() { }
+
+    ParserDomLazy& parseTree(const std::string &html);
+    // Wide documents are converted to UTF-8 and the copy kept for expansion
+    ParserDomLazy& parseTree(const std::u16string &html);
+    ParserDomLazy& parseTree(const std::wstring &html);
+
+    iterator begin() { return iterator(this, tree_.begin()); }
+    iterator end()   { return iterator(this, tree_.end()); }
+    // The whole tree, as ParserDom::root(), everything built
+    const Tree& root() { return expandAll(); }
+    // Everything built and indexed in document order
+    const TagIndex& tagIndex();
+
+    bool isExpanded(const Tree::iterator &it) const { return pending_.find(it.node) == pending_.end(); }
+    // Builds the children of it, down to levels more levels if they have some
+    // of their own
+    void expand(const Tree::iterator &it, size_t levels = 1);
+    Tree::sibling_iterator children(const Tree::iterator &it)
+    {
+        expand(it);
+        return it.begin();
+    }
+    // Builds everything left
+    const Tree& expandAll();
+
+protected:
+    // Content of an element not built yet, and whether what is still open at
+    // its end is flattened: it is unless the document ends there
+    struct Range
+    {
+        Tree::iterator element;
+        size_t begin;
+        size_t end;
+        const char *literal;
+        bool flatten;
+    };
+
+    virtual void onBeginParsing();
+    virtual void onFoundTag(Node &node, bool isClosingTag);
+    virtual void onEndParsing();
+
+    void parseRange(const Tree::iterator &parent, const Range &range, size_t levels);
+    void endRange(size_t end, bool flatten);
+    bool closesAbove(const Node &node) const;
+    void flattenLater();
+
+    const std::string *html_;
+    std::string converted_;
+    size_t levels_;
+    // Depth of the element the current range is the content of, and depth
+    // from which the elements are left unbuilt
+    size_t rangeDepth_;
+    size_t boundaryDepth_;
+    // The element whose content is skipped, null when building, and the
+    // elements open inside of it
+    Tree::iterator boundary_;
+    size_t contentBegin_;
+    const char *boundaryLiteral_;
+    std::vector<std::string> open_;
+    std::unordered_map<const void*, Range> pending_;
+    // Elements which were flattened before being built, and whether they
+    // are being flattened: expanding one adds to the list being gone through
+    std::vector<Tree::iterator> flattenLater_;
+    bool flattening_;
+    // Elements were built after the tag index, out of document order
+    bool indexStale_;
+};
+
+inline ParserDomLazy::iterator& ParserDomLazy::iterator::operator++()
+{
+    if (skip_)
+        it_.skip_children();
+    else if (it_->isTag())
+        parser_->expand(it_, parser_->levels_);
+    skip_ = false;
+    ++it_;
+    return *this;
+}
+
+inline ParserDomLazy& ParserDomLazy::parseTree(const std::string &html)
+{
+    html_ = &html;
+    pending_.clear();
+    flattenLater_.clear();
+    flattening_ = false;
+    indexStale_ = false;
+    parse(html);
+    flattenLater();
+    return *this;
+}
+
+inline ParserDomLazy& ParserDomLazy::parseTree(const std::u16string &html)
+{
+    converted_ = impl::tokenString(html.begin(), html.end());
+    return parseTree(converted_);
+}
+
+inline ParserDomLazy& ParserDomLazy::parseTree(const std::wstring &html)
+{
+    converted_ = impl::tokenString(html.begin(), html.end());
+    return parseTree(converted_);
+}
+
+inline void ParserDomLazy::onBeginParsing()
+{
+    ParserDom::onBeginParsing();
+    rangeDepth_ = 0;
+    // A budget is for the worst documents, they are better parsed eagerly
+    // than with expansions going past where the parse stops
+    boundaryDepth_ = budget_.limited() ? static_cast<size_t>(-1) : levels_;
+    boundary_ = Tree::iterator();
+    skeleton_ = false;
+}
+
+inline void ParserDomLazy::onEndParsing()
+{
+    endRange(currentOffset_, false);
+    ParserDom::onEndParsing();
+}
+
+inline bool ParserDomLazy::closesAbove(const Node &node) const
+{
+    for (Tree::iterator it = boundary_; it != tree_.begin(); it = Tree::parent(it))
+        if (impl::icompare(it->tagName().c_str(), node.tagName().c_str()) == 0)
+            return true;
+    return false;
+}
+
+inline void ParserDomLazy::onFoundTag(Node &node, bool isClosingTag)
+{
+    if (!boundary_)
+    {
+        ParserDom::onFoundTag(node, isClosingTag);
+        if (!isClosingTag
+                && Tree::depth(currIt_) - rangeDepth_ >= boundaryDepth_)
+        {
+            boundary_ = currIt_;
+            contentBegin_ = node.offset() + node.length();
+            boundaryLiteral_ = literal_;
+            open_.clear();
+            skeleton_ = true;
+        }
+        return;
+    }
+
+    // Inside the content of the boundary, which ends when a closing tag goes
+    // past what was opened in it
+    if (!isClosingTag)
+    {
+        open_.push_back(node.tagName());
+        return;
+    }
+    size_t i = open_.size();
+    while (i > 0 && impl::icompare(open_[i - 1].c_str(), node.tagName().c_str()) != 0)
+        --i;
+    if (i > 0)
+        open_.resize(i - 1);
+    else if (closesAbove(node))
+    {
+        // The boundary gets closed, or flattened with the elements below the
+        // one closed
+        const Tree::iterator boundary = boundary_;
+        endRange(node.offset(), true);
+        if (impl::icompare(boundary->tagName().c_str(), node.tagName().c_str()) != 0)
+            flattenLater_.push_back(boundary);
+        ParserDom::onFoundTag(node, true);
+    }
+}
+
+inline void ParserDomLazy::endRange(size_t end, bool flatten)
+{
+    if (!boundary_)
+        return;
+    Range range = { boundary_, contentBegin_, end, boundaryLiteral_, flatten };
+    pending_[boundary_.node] = range;
+    boundary_ = Tree::iterator();
+    skeleton_ = false;
+}
+
+inline void ParserDomLazy::parseRange(const Tree::iterator &parent, const Range &range, size_t levels)
+{
+    currIt_ = parent;
+    rangeDepth_ = Tree::depth(parent);
+    depth_ = rangeDepth_;
+    boundaryDepth_ = levels;
+    boundary_ = Tree::iterator();
+    skeleton_ = false;
+    currentOffset_ = range.begin;
+    literal_ = range.literal;
+    cdata_ = false;
+    const char *data = html_->c_str();
+    parseTokens(data + range.begin, data + range.end, static_cast<size_t>(-1));
+
+    // The closing tag after the range flattens what is still open
+    if (range.flatten && boundary_ && boundary_ != parent)
+        flattenLater_.push_back(boundary_);
+    endRange(range.end, range.flatten);
+    if (range.flatten)
+        for (Tree::iterator it = currIt_; it != parent; it = Tree::parent(it))
+            tree_.flatten(it);
+}
+
+inline void ParserDomLazy::flattenLater()
+{
+    // Flattening moves the children after the element, it can wait until
+    // they are built. The elements flattened inside of the ones built are
+    // flattened after them, which gives the same tree.
+    if (flattening_)
+        return;
+    flattening_ = true;
+    while (!flattenLater_.empty())
+    {
+        const Tree::iterator it = flattenLater_.back();
+        flattenLater_.pop_back();
+        expand(it);
+        tree_.flatten(it);
+        if (hashSubtrees_)
+        {
+            hashNode(it);
+            hashAncestors(it);
+        }
+    }
+    flattening_ = false;
+}
+
+inline void ParserDomLazy::expand(const Tree::iterator &it, size_t levels)
+{
+    std::unordered_map<const void*, Range>::iterator found = pending_.find(it.node);
+    if (found == pending_.end())
+        return;
+    const Range range = found->second;
+    pending_.erase(found);
+    indexStale_ = indexTags_;
+    parseRange(it, range, levels ? levels : 1);
+    flattenLater();
+    if (hashSubtrees_)
+    {
+        hashSubtree(it);
+        hashAncestors(it);
+    }
+}
+
+inline const Tree& ParserDomLazy::expandAll()
+{
+    while (!pending_.empty())
+    {
+        const Tree::iterator it = pending_.begin()->second.element;
+        expand(it, static_cast<size_t>(-1));
+    }
+    return tree_;
+}
+
+inline const TagIndex& ParserDomLazy::tagIndex()
+{
+    expandAll();
+    if (indexStale_)
+    {
+        tagIndex_.clear();
+        for (Tree::iterator it = tree_.begin(); it != tree_.end(); ++it)
+            if (it->isTag())
+                tagIndex_.add(it);
+        indexStale_ = false;
+    }
+    return tagIndex_;
+}
+
+} }
+
+#endif
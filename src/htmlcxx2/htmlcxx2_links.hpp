@@ -0,0 +1,455 @@
+// htmlcxx2.
+// A simple non-validating parser written in C++.
+//
+// Link extraction without a tree.
+
+#ifndef __HTML_LINKS_H__
+#define __HTML_LINKS_H__
+
+#include <cstring>
+#include <string>
+#include <functional>
+
+#include "htmlcxx2_html.hpp"
+
+namespace htmlcxx2 {
+namespace HTML {
+
+namespace impl {
+
+    inline void appendUtf8(std::string &out, unsigned long cp)
+    {
+        if (cp == 0 || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff))
+            cp = 0xfffd;
+        if (cp < 0x80)
+            out += static_cast<char>(cp);
+        else if (cp < 0x800)
+        {
+            out += static_cast<char>(0xc0 | (cp >> 6));
+            out += static_cast<char>(0x80 | (cp & 0x3f));
+        }
+        else if (cp < 0x10000)
+        {
+            out += static_cast<char>(0xe0 | (cp >> 12));
+            out += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+            out += static_cast<char>(0x80 | (cp & 0x3f));
+        }
+        else
+        {
+            out += static_cast<char>(0xf0 | (cp >> 18));
+            out += static_cast<char>(0x80 | ((cp >> 12) & 0x3f));
+            out += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+            out += static_cast<char>(0x80 | (cp & 0x3f));
+        }
+    }
+
+    // Appends the text with numeric character references and the common named
+    // ones decoded. Anything else is copied as is.
+    inline void decodeEntities(const char *begin, const char *end, std::string &out)
+    {
+        static const struct { const char *name; unsigned long cp; } named[] =
+        {
+            { "amp", '&' }, { "lt", '<' }, { "gt", '>' }, { "quot", '"' },
+            { "apos", '\'' }, { "nbsp", 0xa0 }
+        };
+        while (begin != end)
+        {
+            const char *amp = static_cast<const char*>(memchr(begin, '&', end - begin));
+            if (!amp)
+                amp = end;
+            out.append(begin, amp);
+            if (amp == end)
+                break;
+
+            const char *semi = amp + 1;
+            while (semi != end && semi - amp <= 10 && ::isalnum((unsigned char)*semi))
+                ++semi;
+            if (semi == amp + 1 && semi != end && *semi == '#')
+            {
+                ++semi;
+                const bool hex = semi != end && (*semi == 'x' || *semi == 'X');
+                if (hex)
+                    ++semi;
+                const char *digits = semi;
+                unsigned long cp = 0;
+                for (; semi != end && (hex ? ::isxdigit((unsigned char)*semi) : ::isdigit((unsigned char)*semi)); ++semi)
+                {
+                    const int digit = ::isdigit((unsigned char)*semi) ? *semi - '0'
+                        : (::tolower((unsigned char)*semi) - 'a' + 10);
+                    if (cp <= 0x10ffff)
+                        cp = cp * (hex ? 16 : 10) + digit;
+                }
+                if (semi != digits && semi != end && *semi == ';')
+                {
+                    appendUtf8(out, cp);
+                    begin = semi + 1;
+                    continue;
+                }
+            }
+            else if (semi != end && *semi == ';')
+            {
+                size_t i = 0;
+                for (; i < sizeof(named) / sizeof(named[0]); ++i)
+                    if (strlen(named[i].name) == static_cast<size_t>(semi - amp - 1)
+                            && memcmp(named[i].name, amp + 1, semi - amp - 1) == 0)
+                        break;
+                if (i < sizeof(named) / sizeof(named[0]))
+                {
+                    appendUtf8(out, named[i].cp);
+                    begin = semi + 1;
+                    continue;
+                }
+            }
+            out += '&';
+            begin = amp + 1;
+        }
+    }
+
+    // Appends the path without its "." and ".." segments (RFC 3986 5.2.4).
+    // Nothing before root in out is removed.
+    inline void appendPathWithoutDots(const char *p, const char *e, std::string &out, size_t root)
+    {
+        while (p != e)
+        {
+            const size_t left = static_cast<size_t>(e - p);
+            if (left >= 3 && memcmp(p, "../", 3) == 0)
+                p += 3;
+            else if (left >= 2 && memcmp(p, "./", 2) == 0)
+                p += 2;
+            else if (left >= 3 && memcmp(p, "/./", 3) == 0)
+                p += 2;
+            else if (left == 2 && memcmp(p, "/.", 2) == 0)
+            {
+                out += '/';
+                p = e;
+            }
+            else if ((left >= 4 && memcmp(p, "/../", 4) == 0) || (left == 3 && memcmp(p, "/..", 3) == 0))
+            {
+                const size_t slash = out.rfind('/');
+                out.erase(slash == std::string::npos || slash < root ? root : slash);
+                if (left == 3)
+                {
+                    out += '/';
+                    p = e;
+                }
+                else
+                    p += 3;
+            }
+            else if ((left == 1 && *p == '.') || (left == 2 && memcmp(p, "..", 2) == 0))
+                p = e;
+            else
+            {
+                const char *next = p + 1;
+                while (next != e && *next != '/')
+                    ++next;
+                out.append(p, next);
+                p = next;
+            }
+        }
+    }
+
+    // Resolves the reference against an absolute base URL into out
+    // (RFC 3986 5.2). The reference is copied if the base is empty. scratch
+    // is only there to be reused between calls.
+    inline void resolveUrl(const std::string &base, const char *begin, const char *end,
+            std::string &out, std::string &scratch)
+    {
+        out.clear();
+        const char *p = begin;
+        if (p != end && ::isalpha((unsigned char)*p))
+        {
+            while (p != end && (::isalnum((unsigned char)*p) || *p == '+' || *p == '-' || *p == '.'))
+                ++p;
+        }
+        if (base.empty() || (p != begin && p != end && *p == ':'))
+        {
+            // Absolute, or nothing to resolve against
+            out.append(begin, end);
+            return;
+        }
+
+        // Split the base into scheme:, //authority, path and ?query
+        const char *b = base.c_str(), *be = b + base.length();
+        const char *fragment = static_cast<const char*>(memchr(b, '#', be - b));
+        if (fragment)
+            be = fragment;
+        const char *scheme = static_cast<const char*>(memchr(b, ':', be - b));
+        const char *authority = scheme ? scheme + 1 : b;
+        const char *path = authority;
+        if (be - authority >= 2 && authority[0] == '/' && authority[1] == '/')
+            for (path = authority + 2; path != be && *path != '/' && *path != '?'; ++path)
+                ;
+        const char *query = path;
+        while (query != be && *query != '?')
+            ++query;
+
+        const char *refEnd = begin;
+        while (refEnd != end && *refEnd != '?' && *refEnd != '#')
+            ++refEnd;
+
+        if (end - begin >= 2 && begin[0] == '/' && begin[1] == '/')
+        {
+            out.append(b, authority);
+            out.append(begin, end);
+        }
+        else if (begin != end && *begin == '/')
+        {
+            out.append(b, path);
+            appendPathWithoutDots(begin, refEnd, out, out.length());
+            out.append(refEnd, end);
+        }
+        else if (begin == refEnd)
+        {
+            // Empty path: keep the base path, and its query unless given
+            out.append(b, begin != end && *begin == '?' ? query : be);
+            out.append(begin, end);
+        }
+        else
+        {
+            // Merge with the directory of the base path
+            out.append(b, path);
+            const size_t root = out.length();
+            const char *dir = query;
+            while (dir != path && dir[-1] != '/')
+                --dir;
+            scratch.clear();
+            if (dir == path && path != authority)
+                scratch += '/';
+            scratch.append(path, dir);
+            scratch.append(begin, refEnd);
+            appendPathWithoutDots(scratch.c_str(), scratch.c_str() + scratch.length(), out, root);
+            out.append(refEnd, end);
+        }
+    }
+
+} // impl
+
+//
+// LinkExtractor
+//
+
+// Reports the href, src and srcset URLs of the a, area, link, img, script and
+// iframe tags straight from the token stream, without building a tree or
+// parsing the other attributes. Values are entity decoded only when they
+// contain a '&', and resolved against the document URL and the first
+// <base href> into a buffer reused for every link.
+class LinkExtractor : public ParserSax
+{
+public:
+    struct Link
+    {
+        // Lower case tag and attribute names
+        const char *tagName;
+        const char *attribute;
+        // Raw attribute value in the document (the whole srcset for each of
+        // its candidates) and its offset
+        const char *begin;
+        const char *end;
+        size_t offset;
+        // Decoded and resolved URL, valid until the next link
+        const std::string *url;
+    };
+    typedef std::function<void(const Link &link)> Handler;
+
+    explicit LinkExtractor(Handler handler = Handler()) :
+        handler_(handler), html_(nullptr), documentUrl_(), base_(), decoded_(), url_(),
+        scratch_(), hasBase_(false)
+    {
+        tagsOnly_ = true;
+    }
+    ~LinkExtractor() { }
+
+    // Relative URLs are left as is when the document URL is empty and the
+    // document has no <base href>. A <base> only affects the links after it.
+    void extract(const std::string &html, const std::string &documentUrl = std::string());
+
+    // Document URL or the resolved <base href>
+    const std::string& baseUrl() const { return base_; }
+
+protected:
+    virtual void onBeginParsing();
+    virtual void onFoundTag(Node &node, bool isClosingTag);
+    // Called for each URL, calls the handler by default
+    virtual void onLink(const Link &link);
+
+    void found(const char *tagName, const char *attribute, const Node &node,
+            const char *valueBegin, const char *valueEnd);
+    void emit(Link &link, const char *begin, const char *end);
+
+    Handler handler_;
+    const char *html_;
+    std::string documentUrl_;
+    std::string base_;
+    std::string decoded_;
+    std::string url_;
+    std::string scratch_;
+    bool hasBase_;
+};
+
+inline void LinkExtractor::extract(const std::string &html, const std::string &documentUrl)
+{
+    html_ = html.c_str();
+    documentUrl_ = documentUrl;
+    parse(html);
+    html_ = nullptr;
+}
+
+inline void LinkExtractor::onBeginParsing()
+{
+    base_ = documentUrl_;
+    hasBase_ = false;
+}
+
+inline void LinkExtractor::onFoundTag(Node &node, bool isClosingTag)
+{
+    if (isClosingTag)
+        return;
+    const std::string &tagName = node.tagName();
+    const char *name = nullptr;
+    bool href = false, src = false, srcset = false;
+    switch (tagName.length())
+    {
+    case 1:
+        href = tagName == "a";
+        name = "a";
+        break;
+    case 3:
+        src = srcset = tagName == "img";
+        name = "img";
+        break;
+    case 4:
+        if (tagName == "area")
+        {
+            href = true;
+            name = "area";
+        }
+        else if (tagName == "link")
+        {
+            href = true;
+            name = "link";
+        }
+        else if (tagName == "base" && !hasBase_)
+        {
+            href = true;
+            name = "base";
+        }
+        break;
+    case 6:
+        if (tagName == "script")
+        {
+            src = true;
+            name = "script";
+        }
+        else if (tagName == "iframe")
+        {
+            src = true;
+            name = "iframe";
+        }
+        break;
+    }
+    if (!href && !src)
+        return;
+
+    impl::scanAttributes(node.text().c_str(), [&](const char *keyBegin, const char *keyEnd,
+            const char *valueBegin, const char *valueEnd)
+    {
+        if (!valueBegin)
+            valueBegin = valueEnd = keyEnd;
+        // The first occurrence counts, as in Node::attribute()
+        if (href && impl::iequals(keyBegin, keyEnd, "href"))
+        {
+            href = false;
+            found(name, "href", node, valueBegin, valueEnd);
+        }
+        else if (src && impl::iequals(keyBegin, keyEnd, "src"))
+        {
+            src = false;
+            found(name, "src", node, valueBegin, valueEnd);
+        }
+        else if (srcset && impl::iequals(keyBegin, keyEnd, "srcset"))
+        {
+            srcset = false;
+            found(name, "srcset", node, valueBegin, valueEnd);
+        }
+        return href || src || srcset;
+    });
+}
+
+inline void LinkExtractor::found(const char *tagName, const char *attribute, const Node &node,
+        const char *valueBegin, const char *valueEnd)
+{
+    Link link;
+    link.tagName = tagName;
+    link.attribute = attribute;
+    link.offset = node.offset() + (valueBegin - node.text().c_str());
+    link.begin = html_ ? html_ + link.offset : valueBegin;
+    link.end = link.begin + (valueEnd - valueBegin);
+    link.url = &url_;
+
+    const char *begin = link.begin, *end = link.end;
+    if (memchr(begin, '&', end - begin))
+    {
+        decoded_.clear();
+        impl::decodeEntities(begin, end, decoded_);
+        begin = decoded_.c_str();
+        end = begin + decoded_.length();
+    }
+
+    if (strcmp(tagName, "base") == 0)
+    {
+        // <base href> is resolved against the document URL
+        while (begin != end && ::isspace((unsigned char)*begin))
+            ++begin;
+        while (begin != end && ::isspace((unsigned char)end[-1]))
+            --end;
+        impl::resolveUrl(documentUrl_, begin, end, url_, scratch_);
+        base_ = url_;
+        hasBase_ = true;
+        return;
+    }
+
+    if (strcmp(attribute, "srcset") != 0)
+    {
+        emit(link, begin, end);
+        return;
+    }
+
+    // srcset: comma separated URLs each followed by optional descriptors.
+    // A URL ends at a space, trailing commas are not part of it.
+    while (begin != end)
+    {
+        while (begin != end && (::isspace((unsigned char)*begin) || *begin == ','))
+            ++begin;
+        const char *url = begin;
+        while (begin != end && !::isspace((unsigned char)*begin))
+            ++begin;
+        const char *urlEnd = begin;
+        while (urlEnd != url && urlEnd[-1] == ',')
+            --urlEnd;
+        if (urlEnd == begin)
+            while (begin != end && *begin != ',')
+                ++begin;
+        if (url != urlEnd)
+            emit(link, url, urlEnd);
+    }
+}
+
+inline void LinkExtractor::emit(Link &link, const char *begin, const char *end)
+{
+    while (begin != end && ::isspace((unsigned char)*begin))
+        ++begin;
+    while (begin != end && ::isspace((unsigned char)end[-1]))
+        --end;
+    impl::resolveUrl(base_, begin, end, url_, scratch_);
+    onLink(link);
+}
+
+inline void LinkExtractor::onLink(const Link &link)
+{
+    if (handler_)
+        handler_(link);
+}
+
+} }
+
+#endif
@@ -0,0 +1,193 @@
+// htmlcxx2.
+// A simple non-validating parser written in C++.
+//
+// Counting of heap allocations.
+
+#ifndef __HTML_MEMORY_H__
+#define __HTML_MEMORY_H__
+
+#include <cstdlib>
+#include <new>
+#ifdef _MSC_VER
+#include <malloc.h>
+#endif
+
+#include "htmlcxx2_html.hpp"
+
+namespace htmlcxx2 {
+namespace HTML {
+
+namespace impl {
+
+    struct AllocationCounts
+    {
+        size_t allocations;
+        size_t frees;
+        size_t bytes;
+    };
+
+    inline AllocationCounts& threadAllocations()
+    {
+        static thread_local AllocationCounts counts = { 0, 0, 0 };
+        return counts;
+    }
+
+    // Set before main() by the translation unit replacing operator new
+    inline bool& allocationsCounted()
+    {
+        static bool counted = false;
+        return counted;
+    }
+
+} // impl
+
+//
+// AllocationCounter
+//
+
+// Counts the heap allocations made by the current thread, parsing included,
+// since it was constructed or reset. The counts are only kept once the global
+// operator new and delete are replaced, by defining HTMLCXX2_COUNT_ALLOCATIONS
+// before including this file in exactly one translation unit of the program:
+//
+//     AllocationCounter counter;
+//     parser.parseTree(html);
+//     printf("%zu allocations, %zu bytes\n", counter.allocations(), counter.bytes());
+//
+// What the tree keeps afterwards is ParserDom::memoryUsage(). Allocations
+// with an extended alignment (std::align_val_t) are counted as well when the
+// compiler has them.
+class AllocationCounter
+{
+public:
+    AllocationCounter() : start_(impl::threadAllocations()) { }
+
+    size_t allocations() const { return impl::threadAllocations().allocations - start_.allocations; }
+    size_t frees() const       { return impl::threadAllocations().frees - start_.frees; }
+    // Bytes requested, freed ones included
+    size_t bytes() const       { return impl::threadAllocations().bytes - start_.bytes; }
+    // Allocations not freed yet
+    size_t live() const        { return allocations() - frees(); }
+
+    void reset() { start_ = impl::threadAllocations(); }
+
+    // Whether the counting operator new is linked in. Only known once the
+    // static objects of that translation unit are initialized.
+    static bool enabled() { return impl::allocationsCounted(); }
+
+protected:
+    impl::AllocationCounts start_;
+};
+
+} }
+
+#ifdef HTMLCXX2_COUNT_ALLOCATIONS
+
+namespace htmlcxx2 {
+namespace HTML {
+namespace impl {
+
+    static const bool allocationsCountedSet = (allocationsCounted() = true);
+
+    inline void* countAllocation(void *p, size_t size)
+    {
+        if (!p)
+            throw std::bad_alloc();
+        AllocationCounts &counts = threadAllocations();
+        ++counts.allocations;
+        counts.bytes += size;
+        return p;
+    }
+
+    // Out of line so that the compiler does not see malloc() and free()
+    // meet through inlined operators, it warns of mismatched new and delete
+#ifdef _MSC_VER
+#define HTMLCXX2_NOINLINE __declspec(noinline)
+#else
+#define HTMLCXX2_NOINLINE __attribute__((noinline))
+#endif
+
+    HTMLCXX2_NOINLINE inline void* allocateCounted(size_t size)
+    {
+        return countAllocation(malloc(size ? size : 1), size);
+    }
+
+    HTMLCXX2_NOINLINE inline void releaseCounted(void *p)
+    {
+        if (!p)
+            return;
+        ++threadAllocations().frees;
+        free(p);
+    }
+
+#ifdef __cpp_aligned_new
+    HTMLCXX2_NOINLINE inline void* allocateCounted(size_t size, std::align_val_t alignment)
+    {
+        void *p = nullptr;
+#ifdef _MSC_VER
+        p = _aligned_malloc(size ? size : 1, static_cast<size_t>(alignment));
+#else
+        const size_t boundary = static_cast<size_t>(alignment) < sizeof(void*) ? sizeof(void*)
+            : static_cast<size_t>(alignment);
+        if (posix_memalign(&p, boundary, size ? size : 1) != 0)
+            p = nullptr;
+#endif
+        return countAllocation(p, size);
+    }
+
+    HTMLCXX2_NOINLINE inline void releaseCounted(void *p, std::align_val_t)
+    {
+        if (!p)
+            return;
+        ++threadAllocations().frees;
+#ifdef _MSC_VER
+        _aligned_free(p);
+#else
+        free(p);
+#endif
+    }
+#endif
+
+#undef HTMLCXX2_NOINLINE
+
+} // impl
+} }
+
+// The array and nothrow forms call these
+void* operator new(size_t size)
+{
+    return htmlcxx2::HTML::impl::allocateCounted(size);
+}
+
+void operator delete(void *p) noexcept
+{
+    htmlcxx2::HTML::impl::releaseCounted(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    operator delete(p);
+}
+
+#ifdef __cpp_aligned_new
+
+void* operator new(size_t size, std::align_val_t alignment)
+{
+    return htmlcxx2::HTML::impl::allocateCounted(size, alignment);
+}
+
+void operator delete(void *p, std::align_val_t alignment) noexcept
+{
+    htmlcxx2::HTML::impl::releaseCounted(p, alignment);
+}
+
+void operator delete(void *p, size_t, std::align_val_t alignment) noexcept
+{
+    operator delete(p, alignment);
+}
+
+#endif
+
+#endif
+
+#endif
@@ -0,0 +1,299 @@
+// htmlcxx2.
+// A simple non-validating parser written in C++.
+//
+// Parallel speculative parsing of large documents.
+
+#ifndef __HTML_PARSER_PARALLEL_H__
+#define __HTML_PARSER_PARALLEL_H__
+
+#include <thread>
+#include <exception>
+#include <system_error>
+#include <vector>
+#include <deque>
+#include <string>
+#include <utility>
+#include <algorithm>
+
+#include "htmlcxx2_html.hpp"
+
+namespace htmlcxx2 {
+namespace HTML {
+
+namespace impl {
+
+    struct ChunkToken
+    {
+        Node node;
+        bool isClosingTag;
+        // Literal mode right after this token
+        const char *literalAfter;
+    };
+
+    // Records the token stream of a region of a document instead of building a tree.
+    class ChunkTokenizer : public ParserSax
+    {
+    public:
+        ChunkTokenizer() : tokens(), endOffset(0), endLiteral(nullptr) { }
+
+        // Tokenize html from offset, assuming a token boundary in the given literal
+        // mode there, up to the first token boundary at or after stopOffset.
+        void tokenize(const std::string &html, size_t offset, const char *literal,
+                size_t stopOffset)
+        {
+            currentOffset_ = offset;
+            literal_ = literal;
+            cdata_ = false;
+            parseTokens(html.c_str() + offset, html.c_str() + html.length(), stopOffset);
+            endOffset = currentOffset_;
+            endLiteral = literal_;
+        }
+
+        // See ParserSax::unmatchedQuotes_, over all the tokenize() calls
+        size_t unmatchedQuote(char quote) const { return unmatchedQuotes_[quote == '"']; }
+
+        // Not moved as they grow, regions may hold millions of tokens
+        std::deque<ChunkToken> tokens;
+        size_t endOffset;
+        const char *endLiteral;
+
+    protected:
+        // Text always leaves literal mode (or ends the document), comments never
+        // occur inside it and tags report the mode they switched to.
+        virtual void onFoundTag(Node &node, bool isClosingTag)
+        {
+            ChunkToken token = { std::move(node), isClosingTag, literal_ };
+            tokens.push_back(std::move(token));
+        }
+        virtual void onFoundText(Node &node)
+        {
+            ChunkToken token = { std::move(node), false, nullptr };
+            tokens.push_back(std::move(token));
+        }
+        virtual void onFoundComment(Node &node)
+        {
+            ChunkToken token = { std::move(node), false, nullptr };
+            tokens.push_back(std::move(token));
+        }
+    };
+
+    // Joins its threads however the scope is left, a joinable std::thread
+    // being destroyed would terminate the program
+    class ThreadGroup
+    {
+    public:
+        // Room for all the threads, adding one then never throws
+        explicit ThreadGroup(size_t size) : threads_() { threads_.reserve(size); }
+        ~ThreadGroup() { join(); }
+
+        void add(std::thread &&thread) { threads_.push_back(std::move(thread)); }
+        void join()
+        {
+            for (size_t i = 0; i < threads_.size(); ++i)
+                if (threads_[i].joinable())
+                    threads_[i].join();
+        }
+
+    protected:
+        std::vector<std::thread> threads_;
+    };
+
+} // impl
+
+//
+// ParserDomParallel
+//
+
+// Splits big documents at likely tag starts and tokenizes the pieces on several
+// threads, each one guessing that its piece starts outside of literal text,
+// comments and attribute values. The token streams are then stitched together
+// in document order: a piece is used from the first token boundary where it
+// agrees with the real parser state, mismatching regions are tokenized again
+// serially. The resulting tree is identical to the one of ParserDom.
+// Exceptions thrown on the threads are rethrown by parseTree(), and the
+// document is parsed serially if the threads cannot be started.
+class ParserDomParallel : public ParserDom
+{
+public:
+    // threads == 0 uses std::thread::hardware_concurrency(). Documents shorter
+    // than two chunks of minChunkSize are parsed serially.
+    explicit ParserDomParallel(unsigned threads = 0, size_t minChunkSize = 1 << 20) :
+        threads_(threads), minChunkSize_(minChunkSize ? minChunkSize : 1), emittedLiteral_(nullptr) { }
+    ~ParserDomParallel() { }
+
+    const Tree& parseTree(const std::string &html);
+    // Wide documents are parsed serially
+    using ParserDom::parseTree;
+
+protected:
+    std::vector<size_t> splitPoints(const std::string &html) const;
+    void emit(std::deque<impl::ChunkToken> &tokens, size_t from);
+
+    unsigned threads_;
+    size_t minChunkSize_;
+    // Literal mode after the last token emitted
+    const char *emittedLiteral_;
+};
+
+inline std::vector<size_t> ParserDomParallel::splitPoints(const std::string &html) const
+{
+    size_t threads = threads_ ? threads_ : std::thread::hardware_concurrency();
+    if (threads == 0)
+        threads = 1;
+    size_t chunks = std::min(threads, html.length() / minChunkSize_);
+    std::vector<size_t> points(1, 0);
+    if (chunks < 2)
+        return points;
+
+    const size_t chunkSize = html.length() / chunks;
+    for (size_t i = 1; i < chunks; ++i)
+    {
+        // Split right before something looking like an opening or closing tag
+        size_t pos = std::max(i * chunkSize, points.back() + 1);
+        while ((pos = html.find('<', pos)) != std::string::npos)
+        {
+            if (pos + 1 < html.length()
+                    && (::isalpha((unsigned char)html[pos + 1]) || html[pos + 1] == '/'))
+                break;
+            ++pos;
+        }
+        if (pos == std::string::npos)
+            break;
+        points.push_back(pos);
+    }
+    return points;
+}
+
+inline void ParserDomParallel::emit(std::deque<impl::ChunkToken> &tokens, size_t from)
+{
+    enterPhase(ParserTimes::PHASE_HANDLERS);
+    for (size_t i = from; i < tokens.size(); ++i)
+    {
+        Node &node = tokens[i].node;
+        if (impl::STATS_ENABLED && node.invalidUtf8() != std::string::npos)
+            ++stats_.invalidUtf8;
+        // Text is literal right after a tag switching to literal mode
+        const bool literal = emittedLiteral_ != nullptr;
+        emittedLiteral_ = tokens[i].literalAfter;
+        if (!keepToken(node, literal))
+            continue;
+        if (node.isTag())
+            onFoundTag(node, tokens[i].isClosingTag);
+        else if (node.isText())
+            onFoundText(node);
+        else
+            onFoundComment(node);
+    }
+    enterPhase(ParserTimes::PHASE_SCAN);
+}
+
+inline const Tree& ParserDomParallel::parseTree(const std::string &html)
+{
+    // A budget is for the worst documents, they are better parsed serially
+    // than tokenized again past where the parse stops
+    const std::vector<size_t> points = splitPoints(html);
+    if (points.size() < 2 || budget_.limited())
+        return ParserDom::parseTree(html);
+
+    // The threads tokenizing count as scanning
+    beginTiming();
+
+    // Speculative tokenization, the first chunk is exact
+    const size_t chunks = points.size();
+    std::vector<impl::ChunkTokenizer> spec(chunks);
+    for (size_t i = 0; i < chunks; ++i)
+        spec[i].setValidateUtf8(validateUtf8_);
+    std::vector<std::exception_ptr> errors(chunks);
+    impl::ThreadGroup workers(chunks - 1);
+    bool started = true;
+    try
+    {
+        for (size_t i = 1; i < chunks; ++i)
+        {
+            const size_t stop = i + 1 < chunks ? points[i + 1] : static_cast<size_t>(-1);
+            workers.add(std::thread([&html, &spec, &points, &errors, i, stop]()
+            {
+                try
+                {
+                    spec[i].tokenize(html, points[i], nullptr, stop);
+                }
+                catch (...)
+                {
+                    errors[i] = std::current_exception();
+                }
+            }));
+        }
+    }
+    catch (const std::system_error&)
+    {
+        started = false;
+    }
+    if (!started)
+    {
+        workers.join();
+        return ParserDom::parseTree(html);
+    }
+    spec[0].tokenize(html, 0, nullptr, points[1]);
+    workers.join();
+    for (size_t i = 1; i < chunks; ++i)
+        if (errors[i])
+            std::rethrow_exception(errors[i]);
+
+    // Stitch the chunks together
+    cdata_ = false;
+    literal_ = 0;
+    currentOffset_ = 0;
+    stats_ = ParserStats();
+    status_ = PARSE_COMPLETE;
+    emittedLiteral_ = nullptr;
+    onBeginParsing();
+    emit(spec[0].tokens, 0);
+    size_t pos = spec[0].endOffset;
+    const char *literal = spec[0].endLiteral;
+
+    impl::ChunkTokenizer serial;
+    serial.setValidateUtf8(validateUtf8_);
+    for (size_t i = 1; i < chunks; ++i)
+    {
+        std::deque<impl::ChunkToken> &tokens = spec[i].tokens;
+        while (pos < spec[i].endOffset)
+        {
+            // Look for a token starting at pos in the same state
+            size_t lo = 0, hi = tokens.size();
+            while (lo < hi)
+            {
+                size_t mid = lo + (hi - lo) / 2;
+                if (tokens[mid].node.offset() < pos)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            if (lo < tokens.size() && tokens[lo].node.offset() == pos
+                    && (lo ? tokens[lo - 1].literalAfter : nullptr) == literal)
+            {
+                emit(tokens, lo);
+                pos = spec[i].endOffset;
+                literal = spec[i].endLiteral;
+                break;
+            }
+
+            // Wrong guess: continue serially one token at a time until the
+            // streams resynchronize
+            serial.tokens.clear();
+            serial.tokenize(html, pos, literal, pos + 1);
+            emit(serial.tokens, 0);
+            pos = serial.endOffset;
+            literal = serial.endLiteral;
+        }
+    }
+
+    literal_ = literal;
+    currentOffset_ = pos;
+    onEndParsing();
+    endTiming();
+    return root();
+}
+
+} }
+
+#endif
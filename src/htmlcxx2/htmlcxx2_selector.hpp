@@ -0,0 +1,870 @@
+// htmlcxx2.
+// A simple non-validating parser written in C++.
+//
+// Compiled CSS selectors.
+
+#ifndef __HTML_SELECTOR_H__
+#define __HTML_SELECTOR_H__
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <functional>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+#include "htmlcxx2_html.hpp"
+
+namespace htmlcxx2 {
+namespace HTML {
+
+namespace impl {
+
+    enum SelectorPseudo
+    {
+        PSEUDO_FIRST_CHILD = 1,
+        PSEUDO_LAST_CHILD  = 2,
+        PSEUDO_EMPTY       = 4
+    };
+
+    struct SelectorAttribute
+    {
+        std::string name;
+        // 0 (present), '=', '~', '|', '^', '$' or '*'
+        char op;
+        std::string value;
+    };
+
+    struct SelectorCompound
+    {
+        SelectorCompound() : tag(), id(), classes(), attributes(), pseudo(0), combinator(0) { }
+
+        // Lower case, empty matches any element
+        std::string tag;
+        std::string id;
+        std::vector<std::string> classes;
+        std::vector<SelectorAttribute> attributes;
+        unsigned pseudo;
+        // Relation to the compound on the left: ' ', '>', '+', '~' or 0 if none
+        char combinator;
+    };
+
+    struct SelectorComplex
+    {
+        // Right to left, the subject first
+        std::vector<SelectorCompound> compounds;
+        // Bloom filter keys every ancestor chain of a match must contain
+        std::vector<uint32_t> ancestorKeys;
+    };
+
+    // Elements without content. The tree of ParserDom gets them as parents of
+    // what follows until a closing tag flattens them.
+    const char VOID_ELEM[][8] =
+    {
+        "\x04" "area", "\x04" "base", "\x02" "br", "\x03" "col", "\x05" "embed",
+        "\x02" "hr", "\x03" "img", "\x05" "input", "\x04" "link", "\x04" "meta",
+        "\x05" "param", "\x06" "source", "\x05" "track", "\x03" "wbr"
+    };
+
+    inline bool isVoidElement(const std::string &tagName)
+    {
+        if (tagName.length() > 6)
+            return false;
+        for (size_t i = 0; i < sizeof(VOID_ELEM) / sizeof(VOID_ELEM[0]); ++i)
+            if (tagName.length() == static_cast<size_t>(VOID_ELEM[i][0])
+                    && memcmp(tagName.data(), &VOID_ELEM[i][1], tagName.length()) == 0)
+                return true;
+        return false;
+    }
+
+    inline uint32_t selectorKey(char kind, const char *begin, const char *end)
+    {
+        // FNV-1a, seeded with the kind of the name
+        uint32_t hash = (2166136261u ^ static_cast<unsigned char>(kind)) * 16777619u;
+        for (; begin != end; ++begin)
+            hash = (hash ^ static_cast<unsigned char>(*begin)) * 16777619u;
+        return hash;
+    }
+
+    inline uint32_t selectorKey(char kind, const std::string &name)
+    {
+        return selectorKey(kind, name.data(), name.data() + name.length());
+    }
+
+    // Counting bloom filter over the tag names, ids and classes of the ancestors
+    // of the node being matched. Saturated counters stay set.
+    class AncestorFilter
+    {
+    public:
+        AncestorFilter() { memset(counters_, 0, sizeof(counters_)); }
+
+        void add(uint32_t key)
+        {
+            increment(key & MASK);
+            increment((key >> 12) & MASK);
+        }
+        void remove(uint32_t key)
+        {
+            decrement(key & MASK);
+            decrement((key >> 12) & MASK);
+        }
+        bool mayContain(uint32_t key) const
+        {
+            return counters_[key & MASK] && counters_[(key >> 12) & MASK];
+        }
+
+    protected:
+        enum { MASK = 0xfff };
+
+        void increment(uint32_t i) { if (counters_[i] != 0xff) ++counters_[i]; }
+        void decrement(uint32_t i) { if (counters_[i] != 0xff) --counters_[i]; }
+
+        unsigned char counters_[MASK + 1];
+    };
+
+} // impl
+
+//
+// Selector
+//
+
+// A CSS selector compiled once and matched against any number of trees.
+// Supported: type and universal selectors, #id, .class, [attr], [attr=v],
+// [attr~=v], [attr|=v], [attr^=v], [attr$=v], [attr*=v], :first-child,
+// :last-child, :only-child, :empty, the descendant, '>', '+' and '~'
+// combinators and selector lists. Tag and attribute names are case
+// insensitive, ids, classes and attribute values are not.
+class Selector
+{
+public:
+    Selector() : complexes_(), needTags_(false), needIds_(false), needClasses_(false) { }
+    // Throws std::invalid_argument if the selector cannot be parsed
+    explicit Selector(const std::string &selector) :
+        complexes_(), needTags_(false), needIds_(false), needClasses_(false) { compile(selector); }
+
+    void compile(const std::string &selector);
+
+    // Whether the node is matched by the selector
+    bool match(const Tree::iterator &it) const;
+    // All matching nodes in document order. Candidates are taken from the
+    // indexes when given (they must have been built for this tree), otherwise
+    // the tree is walked once.
+    std::vector<Tree::iterator> select(const Tree &tree, const TagIndex *tagIndex = nullptr,
+            const ElementIndex *elementIndex = nullptr) const;
+
+protected:
+    typedef impl::SelectorCompound Compound;
+    typedef impl::SelectorComplex Complex;
+
+    static bool matchComplex(const Complex &complex, size_t i, const Tree::iterator &it);
+    static bool matchCompound(const Compound &compound, const Tree::iterator &it);
+    static const ElementIndex::Nodes* candidates(const Compound &compound,
+            const TagIndex *tagIndex, const ElementIndex *elementIndex);
+    void pushAncestor(const Node &node, impl::AncestorFilter &filter,
+            std::vector<uint32_t> &keys) const;
+
+    std::vector<Complex> complexes_;
+    bool needTags_;
+    bool needIds_;
+    bool needClasses_;
+};
+
+namespace impl {
+
+    class SelectorParser
+    {
+    public:
+        SelectorParser(const std::string &selector) :
+            pos_(selector.c_str()), end_(selector.c_str() + selector.length()) { }
+
+        void parse(std::vector<SelectorComplex> &complexes)
+        {
+            do
+            {
+                complexes.push_back(SelectorComplex());
+                parseComplex(complexes.back());
+                skipSpace();
+            } while (pos_ != end_ && *pos_++ == ',');
+            if (pos_ != end_)
+                fail();
+        }
+
+    protected:
+        void fail() const
+        {
+            throw std::invalid_argument("htmlcxx2: invalid selector");
+        }
+
+        void skipSpace()
+        {
+            while (pos_ != end_ && ::isspace((unsigned char)*pos_))
+                ++pos_;
+        }
+
+        static bool isNameChar(char ch)
+        {
+            return ::isalnum((unsigned char)ch) || ch == '-' || ch == '_'
+                || (static_cast<unsigned char>(ch) & 0x80);
+        }
+
+        std::string parseName()
+        {
+            const char *begin = pos_;
+            while (pos_ != end_ && isNameChar(*pos_))
+                ++pos_;
+            if (begin == pos_)
+                fail();
+            return std::string(begin, pos_);
+        }
+
+        void parseComplex(SelectorComplex &complex)
+        {
+            std::vector<SelectorCompound> compounds;
+            skipSpace();
+            compounds.push_back(SelectorCompound());
+            parseCompound(compounds.back());
+            for (;;)
+            {
+                const char *save = pos_;
+                skipSpace();
+                if (pos_ == end_ || *pos_ == ',')
+                    break;
+                char combinator = ' ';
+                if (*pos_ == '>' || *pos_ == '+' || *pos_ == '~')
+                {
+                    combinator = *pos_++;
+                    skipSpace();
+                }
+                else if (save == pos_)
+                    fail();
+                compounds.back().combinator = combinator;
+                compounds.push_back(SelectorCompound());
+                parseCompound(compounds.back());
+            }
+
+            // Store right to left, each compound keeping the combinator to its left
+            complex.compounds.assign(compounds.rbegin(), compounds.rend());
+            for (size_t i = 0; i < complex.compounds.size(); ++i)
+                complex.compounds[i].combinator = i + 1 < complex.compounds.size() ?
+                    compounds[compounds.size() - i - 2].combinator : 0;
+        }
+
+        void parseCompound(SelectorCompound &compound)
+        {
+            const char *begin = pos_;
+            if (pos_ != end_ && *pos_ == '*')
+                ++pos_;
+            else if (pos_ != end_ && isNameChar(*pos_))
+                compound.tag = toLower(parseName());
+
+            while (pos_ != end_)
+            {
+                if (*pos_ == '#')
+                {
+                    ++pos_;
+                    std::string id = parseName();
+                    if (!compound.id.empty() && compound.id != id)
+                        compound.pseudo |= ~0u; // never matches
+                    compound.id = id;
+                }
+                else if (*pos_ == '.')
+                {
+                    ++pos_;
+                    compound.classes.push_back(parseName());
+                }
+                else if (*pos_ == '[')
+                {
+                    ++pos_;
+                    compound.attributes.push_back(parseAttribute());
+                }
+                else if (*pos_ == ':')
+                {
+                    ++pos_;
+                    std::string pseudo = toLower(parseName());
+                    if (pseudo == "first-child")
+                        compound.pseudo |= PSEUDO_FIRST_CHILD;
+                    else if (pseudo == "last-child")
+                        compound.pseudo |= PSEUDO_LAST_CHILD;
+                    else if (pseudo == "only-child")
+                        compound.pseudo |= PSEUDO_FIRST_CHILD | PSEUDO_LAST_CHILD;
+                    else if (pseudo == "empty")
+                        compound.pseudo |= PSEUDO_EMPTY;
+                    else
+                        fail();
+                }
+                else
+                    break;
+            }
+            if (begin == pos_)
+                fail();
+        }
+
+        SelectorAttribute parseAttribute()
+        {
+            SelectorAttribute attribute;
+            skipSpace();
+            attribute.name = toLower(parseName());
+            attribute.op = 0;
+            skipSpace();
+            if (pos_ == end_)
+                fail();
+            if (*pos_ != ']')
+            {
+                if (*pos_ != '=')
+                {
+                    if (!strchr("~|^$*", *pos_) || pos_ + 1 == end_ || pos_[1] != '=')
+                        fail();
+                    attribute.op = *pos_++;
+                }
+                else
+                    attribute.op = '=';
+                ++pos_;
+                skipSpace();
+                if (pos_ != end_ && (*pos_ == '"' || *pos_ == '\''))
+                {
+                    const char *close = pos_ + 1;
+                    while (close != end_ && *close != *pos_)
+                        ++close;
+                    if (close == end_)
+                        fail();
+                    attribute.value.assign(pos_ + 1, close);
+                    pos_ = close + 1;
+                }
+                else
+                    attribute.value = parseName();
+                skipSpace();
+            }
+            if (pos_ == end_ || *pos_++ != ']')
+                fail();
+            return attribute;
+        }
+
+        const char *pos_;
+        const char *end_;
+    };
+
+    inline bool matchSelectorValue(const SelectorAttribute &attribute,
+            const char *begin, const char *end)
+    {
+        const std::string &value = attribute.value;
+        const size_t length = static_cast<size_t>(end - begin);
+        switch (attribute.op)
+        {
+        case 0:
+            return true;
+        case '=':
+            return value.compare(0, std::string::npos, begin, length) == 0;
+        case '^':
+            return !value.empty() && length >= value.length()
+                && memcmp(begin, value.data(), value.length()) == 0;
+        case '$':
+            return !value.empty() && length >= value.length()
+                && memcmp(end - value.length(), value.data(), value.length()) == 0;
+        case '*':
+            return !value.empty() && std::search(begin, end, value.begin(), value.end()) != end;
+        case '|':
+            return length >= value.length()
+                && memcmp(begin, value.data(), value.length()) == 0
+                && (length == value.length() || begin[value.length()] == '-');
+        case '~':
+            while (begin != end)
+            {
+                while (begin != end && ::isspace((unsigned char)*begin))
+                    ++begin;
+                const char *word = begin;
+                while (begin != end && !::isspace((unsigned char)*begin))
+                    ++begin;
+                if (word != begin && value.compare(0, std::string::npos, word, begin - word) == 0)
+                    return true;
+            }
+            return false;
+        }
+        return false;
+    }
+
+    // Whether the id, classes and attributes of the compound match the tag
+    inline bool matchSelectorAttributes(const SelectorCompound &compound, const Node &node)
+    {
+        // One pass over the tag text, the first occurrence of an attribute
+        // counts as in Node::attribute()
+        const size_t count = compound.attributes.size();
+        unsigned long long seen = 0;
+        bool seenId = false, seenClass = false, ok = true;
+        scanAttributes(node.text().c_str(), [&](const char *keyBegin, const char *keyEnd,
+                const char *valueBegin, const char *valueEnd)
+        {
+            if (!valueBegin)
+                valueBegin = valueEnd = keyEnd;
+            if (!compound.id.empty() && !seenId && iequals(keyBegin, keyEnd, "id"))
+            {
+                seenId = true;
+                ok = compound.id.compare(0, std::string::npos, valueBegin, valueEnd - valueBegin) == 0;
+            }
+            else if (!compound.classes.empty() && !seenClass && iequals(keyBegin, keyEnd, "class"))
+            {
+                seenClass = true;
+                SelectorAttribute word = { std::string(), '~', std::string() };
+                for (size_t i = 0; ok && i < compound.classes.size(); ++i)
+                {
+                    word.value = compound.classes[i];
+                    ok = matchSelectorValue(word, valueBegin, valueEnd);
+                }
+            }
+            for (size_t i = 0; ok && i < count && i < 64; ++i)
+            {
+                if (!(seen & (1ull << i))
+                        && iequals(keyBegin, keyEnd, compound.attributes[i].name.c_str()))
+                {
+                    seen |= 1ull << i;
+                    ok = matchSelectorValue(compound.attributes[i], valueBegin, valueEnd);
+                }
+            }
+            return ok;
+        });
+        return ok
+            && (compound.id.empty() || seenId)
+            && (compound.classes.empty() || seenClass)
+            && (count == 0 || seen == (count >= 64 ? ~0ull : (1ull << count) - 1));
+    }
+
+} // impl
+
+inline void Selector::compile(const std::string &selector)
+{
+    complexes_.clear();
+    needTags_ = needIds_ = needClasses_ = false;
+    impl::SelectorParser(selector).parse(complexes_);
+
+    // Compounds left of a descendant or child combinator match ancestors of
+    // the subject, their names must be in the ancestor filter
+    for (size_t i = 0; i < complexes_.size(); ++i)
+    {
+        Complex &complex = complexes_[i];
+        for (size_t j = 1; j < complex.compounds.size(); ++j)
+        {
+            const char combinator = complex.compounds[j - 1].combinator;
+            if (combinator != ' ' && combinator != '>')
+                continue;
+            const Compound &compound = complex.compounds[j];
+            if (!compound.tag.empty())
+            {
+                complex.ancestorKeys.push_back(impl::selectorKey('t', compound.tag));
+                needTags_ = true;
+            }
+            if (!compound.id.empty())
+            {
+                complex.ancestorKeys.push_back(impl::selectorKey('#', compound.id));
+                needIds_ = true;
+            }
+            for (size_t k = 0; k < compound.classes.size(); ++k)
+            {
+                complex.ancestorKeys.push_back(impl::selectorKey('.', compound.classes[k]));
+                needClasses_ = true;
+            }
+        }
+    }
+}
+
+inline bool Selector::matchCompound(const Compound &compound, const Tree::iterator &it)
+{
+    if (!it->isTag())
+        return false;
+    if (!compound.tag.empty() && compound.tag != it->tagName())
+        return false;
+    if (compound.pseudo)
+    {
+        if (compound.pseudo & impl::PSEUDO_FIRST_CHILD)
+        {
+            Tree::sibling_iterator sib(it);
+            for (--sib; sib && !sib->isTag(); --sib)
+                ;
+            if (sib)
+                return false;
+        }
+        if (compound.pseudo & impl::PSEUDO_LAST_CHILD)
+        {
+            Tree::sibling_iterator sib(it);
+            for (++sib; sib && !sib->isTag(); ++sib)
+                ;
+            if (sib)
+                return false;
+        }
+        if (compound.pseudo & impl::PSEUDO_EMPTY)
+        {
+            for (Tree::sibling_iterator child = it.begin(); child != it.end(); ++child)
+                if (!child->isComment())
+                    return false;
+        }
+        if (compound.pseudo & ~(impl::PSEUDO_FIRST_CHILD | impl::PSEUDO_LAST_CHILD
+                | impl::PSEUDO_EMPTY))
+            return false;
+    }
+    if (compound.id.empty() && compound.classes.empty() && compound.attributes.empty())
+        return true;
+    return impl::matchSelectorAttributes(compound, *it);
+}
+
+inline bool Selector::matchComplex(const Complex &complex, size_t i, const Tree::iterator &it)
+{
+    const Compound &compound = complex.compounds[i];
+    if (!matchCompound(compound, it))
+        return false;
+    if (i + 1 == complex.compounds.size())
+        return true;
+
+    switch (compound.combinator)
+    {
+    case '>':
+    {
+        Tree::iterator parent = Tree::parent(it);
+        return parent && matchComplex(complex, i + 1, parent);
+    }
+    case ' ':
+        for (Tree::iterator parent = Tree::parent(it); parent && parent->isTag();
+                parent = Tree::parent(parent))
+            if (matchComplex(complex, i + 1, parent))
+                return true;
+        return false;
+    case '+':
+    case '~':
+    {
+        Tree::sibling_iterator sib(it);
+        for (--sib; sib; --sib)
+        {
+            if (!sib->isTag())
+                continue;
+            if (matchComplex(complex, i + 1, Tree::iterator(sib)))
+                return true;
+            if (compound.combinator == '+')
+                break;
+        }
+        return false;
+    }
+    }
+    return false;
+}
+
+inline bool Selector::match(const Tree::iterator &it) const
+{
+    for (size_t i = 0; i < complexes_.size(); ++i)
+        if (matchComplex(complexes_[i], 0, it))
+            return true;
+    return false;
+}
+
+inline const ElementIndex::Nodes* Selector::candidates(const Compound &compound,
+        const TagIndex *tagIndex, const ElementIndex *elementIndex)
+{
+    if (elementIndex && !compound.id.empty())
+        return &elementIndex->getElementsById(compound.id);
+    if (elementIndex && !compound.classes.empty())
+    {
+        const ElementIndex::Nodes *best = nullptr;
+        for (size_t i = 0; i < compound.classes.size(); ++i)
+        {
+            const ElementIndex::Nodes &nodes = elementIndex->getElementsByClassName(compound.classes[i]);
+            if (!best || nodes.size() < best->size())
+                best = &nodes;
+        }
+        return best;
+    }
+    if (tagIndex && !compound.tag.empty())
+        return &tagIndex->find(compound.tag);
+    return nullptr;
+}
+
+inline void Selector::pushAncestor(const Node &node, impl::AncestorFilter &filter,
+        std::vector<uint32_t> &keys) const
+{
+    const size_t first = keys.size();
+    if (needTags_)
+        keys.push_back(impl::selectorKey('t', node.tagName()));
+    if (needIds_ || needClasses_)
+    {
+        bool seenId = !needIds_, seenClass = !needClasses_;
+        impl::scanAttributes(node.text().c_str(), [&](const char *keyBegin, const char *keyEnd,
+                const char *valueBegin, const char *valueEnd)
+        {
+            if (!valueBegin)
+                return true;
+            if (!seenId && impl::iequals(keyBegin, keyEnd, "id"))
+            {
+                seenId = true;
+                keys.push_back(impl::selectorKey('#', valueBegin, valueEnd));
+            }
+            else if (!seenClass && impl::iequals(keyBegin, keyEnd, "class"))
+            {
+                seenClass = true;
+                while (valueBegin != valueEnd)
+                {
+                    while (valueBegin != valueEnd && ::isspace((unsigned char)*valueBegin))
+                        ++valueBegin;
+                    const char *name = valueBegin;
+                    while (valueBegin != valueEnd && !::isspace((unsigned char)*valueBegin))
+                        ++valueBegin;
+                    if (name != valueBegin)
+                        keys.push_back(impl::selectorKey('.', name, valueBegin));
+                }
+            }
+            return !(seenId && seenClass);
+        });
+    }
+    for (size_t i = first; i < keys.size(); ++i)
+        filter.add(keys[i]);
+}
+
+inline std::vector<Tree::iterator> Selector::select(const Tree &tree,
+        const TagIndex *tagIndex, const ElementIndex *elementIndex) const
+{
+    std::vector<Tree::iterator> result;
+
+    if (tagIndex || elementIndex)
+    {
+        // Only match the nodes the indexes give for the subject of each complex
+        bool indexed = true;
+        for (size_t i = 0; indexed && i < complexes_.size(); ++i)
+        {
+            const ElementIndex::Nodes *nodes = candidates(complexes_[i].compounds[0],
+                    tagIndex, elementIndex);
+            if (!nodes)
+                indexed = false;
+            else
+                for (size_t j = 0; j < nodes->size(); ++j)
+                    if (matchComplex(complexes_[i], 0, (*nodes)[j]))
+                        result.push_back((*nodes)[j]);
+        }
+        if (indexed)
+        {
+            if (complexes_.size() > 1)
+            {
+                // Document order is offset order
+                std::sort(result.begin(), result.end(),
+                        [](const Tree::iterator &lhs, const Tree::iterator &rhs)
+                {
+                    return lhs->offset() < rhs->offset();
+                });
+                result.erase(std::unique(result.begin(), result.end()), result.end());
+            }
+            return result;
+        }
+        result.clear();
+    }
+
+    // Walk the tree keeping the names of the ancestors of the current node in
+    // a bloom filter, which rejects most nodes before matching right to left
+    impl::AncestorFilter filter;
+    std::vector<Tree::iterator> ancestors;
+    std::vector<size_t> keyCounts;
+    std::vector<uint32_t> keys;
+    for (Tree::iterator it = tree.begin(); it != tree.end(); ++it)
+    {
+        while (!ancestors.empty() && ancestors.back() != Tree::parent(it))
+        {
+            const size_t first = keyCounts.back();
+            for (size_t i = first; i < keys.size(); ++i)
+                filter.remove(keys[i]);
+            keys.resize(first);
+            keyCounts.pop_back();
+            ancestors.pop_back();
+        }
+
+        if (it->isTag())
+        {
+            for (size_t i = 0; i < complexes_.size(); ++i)
+            {
+                const Complex &complex = complexes_[i];
+                bool possible = true;
+                for (size_t k = 0; possible && k < complex.ancestorKeys.size(); ++k)
+                    possible = filter.mayContain(complex.ancestorKeys[k]);
+                if (possible && matchComplex(complex, 0, it))
+                {
+                    result.push_back(it);
+                    break;
+                }
+            }
+        }
+
+        if (it.begin() != it.end())
+        {
+            ancestors.push_back(it);
+            keyCounts.push_back(keys.size());
+            if (it->isTag())
+                pushAncestor(*it, filter, keys);
+        }
+    }
+    return result;
+}
+
+//
+// SelectorSax
+//
+
+// Matches a selector on the event stream of the parser without building a
+// tree. Only the open elements are kept, each with the set of compounds it
+// matches, so memory grows with the nesting depth and not with the document.
+// Supported: everything Selector supports except the pseudo classes and the
+// '+' and '~' combinators, with at most 64 compounds in total.
+//
+// Elements are matched against their ancestors at the time their opening tag
+// is seen. The tree of ParserDom is the same for documents that close their
+// elements, while its flattening of unclosed elements can later move nodes
+// out of them. Void elements (br, img...) are taken as closed right away, as
+// the closing tag of their parent flattens them. Text and comments are not
+// even copied.
+class SelectorSax : public ParserSax
+{
+public:
+    // Receives the source range of each matched element once it is closed:
+    // opening to closing tag, or only the opening tag if it is never closed
+    // (as Node::length() in ParserDom). Inner elements are reported first.
+    typedef std::function<void(size_t offset, size_t length)> Handler;
+
+    // Throws std::invalid_argument if the selector cannot be parsed or
+    // needs more than the open elements
+    explicit SelectorSax(const std::string &selector, Handler handler = Handler());
+    ~SelectorSax() { }
+
+protected:
+    struct OpenElement
+    {
+        std::string tagName;
+        size_t offset;
+        size_t length;
+        // Compounds matched by this element, by it or one of its ancestors
+        uint64_t matched;
+        uint64_t inherited;
+    };
+
+    virtual void onBeginParsing();
+    virtual void onFoundTag(Node &node, bool isClosingTag);
+    virtual void onEndParsing();
+    // Called for each matched element, calls the handler by default
+    virtual void onMatch(size_t offset, size_t length);
+
+    void close(size_t count, size_t closeEnd);
+
+    // All compounds left to right, one complex after the other
+    std::vector<impl::SelectorCompound> compounds_;
+    // Compounds starting a complex, ending one, or following a child or a
+    // descendant combinator
+    uint64_t first_;
+    uint64_t subject_;
+    uint64_t child_;
+    uint64_t descendant_;
+    std::vector<OpenElement> open_;
+    Handler handler_;
+};
+
+inline SelectorSax::SelectorSax(const std::string &selector, Handler handler) :
+    compounds_(), first_(0), subject_(0), child_(0), descendant_(0), open_(),
+    handler_(handler)
+{
+    tagsOnly_ = true;
+    std::vector<impl::SelectorComplex> complexes;
+    impl::SelectorParser(selector).parse(complexes);
+    for (size_t i = 0; i < complexes.size(); ++i)
+    {
+        const std::vector<impl::SelectorCompound> &compounds = complexes[i].compounds;
+        if (compounds_.size() + compounds.size() > 64)
+            throw std::invalid_argument("htmlcxx2: selector too long to stream");
+        for (size_t j = compounds.size(); j-- > 0; )
+        {
+            const impl::SelectorCompound &compound = compounds[j];
+            const uint64_t bit = 1ull << compounds_.size();
+            if (compound.pseudo || compound.combinator == '+' || compound.combinator == '~')
+                throw std::invalid_argument("htmlcxx2: selector not supported when streaming");
+            if (compound.combinator == '>')
+                child_ |= bit;
+            else if (compound.combinator == ' ')
+                descendant_ |= bit;
+            else
+                first_ |= bit;
+            if (j == 0)
+                subject_ |= bit;
+            compounds_.push_back(compound);
+        }
+    }
+}
+
+inline void SelectorSax::onBeginParsing()
+{
+    open_.clear();
+}
+
+inline void SelectorSax::onFoundTag(Node &node, bool isClosingTag)
+{
+    if (isClosingTag)
+    {
+        // Same rules as ParserDom: close the innermost element of that name
+        // with everything opened inside of it, ignore the tag if none
+        for (size_t i = open_.size(); i-- > 0; )
+        {
+            if (impl::icompare(open_[i].tagName.c_str(), node.tagName().c_str()) == 0)
+            {
+                close(open_.size() - i, node.offset() + node.length());
+                break;
+            }
+        }
+        return;
+    }
+
+    const uint64_t parentMatched = open_.empty() ? 0 : open_.back().matched;
+    const uint64_t parentInherited = open_.empty() ? 0 : open_.back().inherited;
+    // A compound can match if the one on its left matched in the right place
+    uint64_t candidates = first_ | (child_ & (parentMatched << 1))
+        | (descendant_ & (parentInherited << 1));
+    uint64_t matched = 0;
+    for (size_t i = 0; candidates; ++i, candidates >>= 1)
+    {
+        if (!(candidates & 1))
+            continue;
+        const impl::SelectorCompound &compound = compounds_[i];
+        if (!compound.tag.empty() && compound.tag != node.tagName())
+            continue;
+        if ((!compound.id.empty() || !compound.classes.empty() || !compound.attributes.empty())
+                && !impl::matchSelectorAttributes(compound, node))
+            continue;
+        matched |= 1ull << i;
+    }
+
+    if (impl::isVoidElement(node.tagName()))
+    {
+        if (matched & subject_)
+            onMatch(node.offset(), node.length());
+        return;
+    }
+    OpenElement element = { node.tagName(), node.offset(), node.length(), matched,
+        parentInherited | matched };
+    open_.push_back(element);
+}
+
+inline void SelectorSax::onEndParsing()
+{
+    close(open_.size(), 0);
+}
+
+inline void SelectorSax::close(size_t count, size_t closeEnd)
+{
+    // The last one gets the closing tag, the others stay unclosed
+    for (size_t i = 0; i < count; ++i)
+    {
+        const OpenElement &element = open_.back();
+        if (element.matched & subject_)
+        {
+            const bool closed = closeEnd && i + 1 == count;
+            onMatch(element.offset, closed ? closeEnd - element.offset : element.length);
+        }
+        open_.pop_back();
+    }
+}
+
+inline void SelectorSax::onMatch(size_t offset, size_t length)
+{
+    if (handler_)
+        handler_(offset, length);
+}
+
+} }
+
+#endif
@@ -0,0 +1,527 @@
+// htmlcxx2.
+// A simple non-validating parser written in C++.
+//
+// Binary snapshots of parsed documents.
+
+#ifndef __HTML_SNAPSHOT_H__
+#define __HTML_SNAPSHOT_H__
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <stdexcept>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "htmlcxx2_html.hpp"
+
+namespace htmlcxx2 {
+namespace HTML {
+
+// Snapshot layout, all in the byte order of the writer (checked on load):
+//
+//   SnapshotHeader
+//   SnapshotNode[nodeCount]           in pre-order, the root first
+//   SnapshotAttribute[attributeCount] grouped by node
+//   char[stringsSize]                 NUL terminated tag names, "" first
+//
+// Texts are not stored, nodes and attributes refer to the source document
+// by offset and length.
+
+struct SnapshotHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t flags;
+    uint32_t nodeSize;
+    uint64_t nodeCount;
+    uint64_t attributeCount;
+    uint64_t stringsSize;
+    uint64_t sourceLength;
+    uint64_t reserved;
+};
+
+struct SnapshotNode
+{
+    // As Node::offset() and Node::length()
+    uint64_t offset;
+    uint64_t length;
+    // Length of Node::text() and of the closing tag, both at the ends of the
+    // node in the source
+    uint32_t textLength;
+    uint32_t closingLength;
+    // Node indexes, Snapshot::NONE if none
+    uint32_t parent;
+    uint32_t firstChild;
+    uint32_t lastChild;
+    uint32_t prevSibling;
+    uint32_t nextSibling;
+    // Offset of the tag name in the strings
+    uint32_t tag;
+    uint32_t firstAttribute;
+    uint32_t attributeCount;
+    // Node::Kind
+    uint32_t kind;
+    uint32_t reserved;
+
+    bool isRoot() const    { return kind == Node::NODE_ROOT; }
+    bool isTag() const     { return kind == Node::NODE_TAG; }
+    bool isComment() const { return kind == Node::NODE_COMMENT; }
+    bool isText() const    { return kind == Node::NODE_TEXT; }
+};
+
+// Attribute key and value in the source, as found by Node::parseAttributes()
+struct SnapshotAttribute
+{
+    uint64_t keyOffset;
+    uint64_t valueOffset;
+    uint32_t keyLength;
+    uint32_t valueLength;
+};
+
+//
+// Snapshot
+//
+
+// Read only view of a snapshot in memory, typically a MappedFile. Nothing is
+// copied or allocated per node: the records are used in place and the
+// iterators are indexes. The data must outlive the view.
+class Snapshot
+{
+public:
+    enum { VERSION = 1 };
+    enum Flags { WITH_ATTRIBUTES = 1 };
+    enum : uint32_t { NONE = 0xffffffffu };
+
+    class iterator;
+    class sibling_iterator;
+
+    // Serializes a tree built by ParserDom, with the attribute spans of the
+    // tags if asked.
+    static std::string write(const Tree &tree, bool withAttributes = false);
+
+    Snapshot() : header_(nullptr), nodes_(nullptr), attributes_(nullptr), strings_(nullptr) { }
+    // data must be 8 byte aligned. Throws std::runtime_error if it is not a
+    // valid snapshot of this version and byte order.
+    Snapshot(const void *data, size_t size);
+
+    size_t size() const { return header_ ? static_cast<size_t>(header_->nodeCount) : 0; }
+    size_t sourceLength() const { return header_ ? static_cast<size_t>(header_->sourceLength) : 0; }
+    bool hasAttributes() const { return header_ && (header_->flags & WITH_ATTRIBUTES); }
+
+    const SnapshotNode& node(size_t index) const { return nodes_[index]; }
+    const char* tagName(const SnapshotNode &node) const { return strings_ + node.tag; }
+    const SnapshotAttribute* attributesBegin(const SnapshotNode &node) const
+    {
+        return attributes_ + node.firstAttribute;
+    }
+    const SnapshotAttribute* attributesEnd(const SnapshotNode &node) const
+    {
+        return attributes_ + node.firstAttribute + node.attributeCount;
+    }
+
+    // Pre-order, from the root
+    iterator begin() const;
+    iterator end() const;
+
+    // Rebuilds the tree ParserDom returned for the source, which must be the
+    // document the snapshot was written for
+    Tree toTree(const std::string &html) const;
+
+protected:
+    const SnapshotHeader *header_;
+    const SnapshotNode *nodes_;
+    const SnapshotAttribute *attributes_;
+    const char *strings_;
+};
+
+// Pre-order iterator. Nodes are stored in pre-order, so increments are
+// index increments.
+class Snapshot::iterator
+{
+public:
+    iterator() : snapshot_(nullptr), index_(NONE) { }
+    iterator(const Snapshot *snapshot, uint32_t index) : snapshot_(snapshot), index_(index) { }
+
+    const SnapshotNode& operator*() const  { return snapshot_->node(index_); }
+    const SnapshotNode* operator->() const { return &snapshot_->node(index_); }
+    iterator& operator++()    { ++index_; return *this; }
+    iterator operator++(int)  { iterator ret(*this); ++index_; return ret; }
+    iterator& operator--()    { --index_; return *this; }
+    iterator operator--(int)  { iterator ret(*this); --index_; return ret; }
+    bool operator==(const iterator &rhs) const { return index_ == rhs.index_; }
+    bool operator!=(const iterator &rhs) const { return index_ != rhs.index_; }
+    // False for the parent of the root
+    operator bool() const { return index_ != NONE; }
+
+    uint32_t index() const { return index_; }
+    iterator parent() const { return iterator(snapshot_, (*this)->parent); }
+    // Children
+    sibling_iterator begin() const;
+    sibling_iterator end() const;
+
+protected:
+    const Snapshot *snapshot_;
+    uint32_t index_;
+};
+
+class Snapshot::sibling_iterator
+{
+public:
+    sibling_iterator() : snapshot_(nullptr), index_(NONE) { }
+    sibling_iterator(const Snapshot *snapshot, uint32_t index) : snapshot_(snapshot), index_(index) { }
+
+    const SnapshotNode& operator*() const  { return snapshot_->node(index_); }
+    const SnapshotNode* operator->() const { return &snapshot_->node(index_); }
+    sibling_iterator& operator++() { index_ = (*this)->nextSibling; return *this; }
+    sibling_iterator& operator--() { index_ = (*this)->prevSibling; return *this; }
+    bool operator==(const sibling_iterator &rhs) const { return index_ == rhs.index_; }
+    bool operator!=(const sibling_iterator &rhs) const { return index_ != rhs.index_; }
+    operator bool() const { return index_ != NONE; }
+    operator iterator() const { return iterator(snapshot_, index_); }
+
+    uint32_t index() const { return index_; }
+
+protected:
+    const Snapshot *snapshot_;
+    uint32_t index_;
+};
+
+inline Snapshot::sibling_iterator Snapshot::iterator::begin() const
+{
+    return sibling_iterator(snapshot_, (*this)->firstChild);
+}
+
+inline Snapshot::sibling_iterator Snapshot::iterator::end() const
+{
+    return sibling_iterator(snapshot_, NONE);
+}
+
+inline Snapshot::iterator Snapshot::begin() const
+{
+    return iterator(this, 0);
+}
+
+inline Snapshot::iterator Snapshot::end() const
+{
+    return iterator(this, static_cast<uint32_t>(size()));
+}
+
+namespace impl {
+
+    const char snapshotMagic[8] = { 'h', 't', 'm', 'l', 'c', 'x', 'x', '2' };
+    const uint32_t snapshotByteOrder = 0x01020304;
+
+} // impl
+
+inline std::string Snapshot::write(const Tree &tree, bool withAttributes)
+{
+    std::vector<SnapshotNode> nodes;
+    std::vector<SnapshotAttribute> attributes;
+    std::string strings(1, '\0');
+    std::unordered_map<std::string, uint32_t> tags;
+    uint64_t sourceLength = 0;
+
+    // Open ancestors of the current node
+    std::vector<std::pair<const void*, uint32_t> > path;
+    for (Tree::iterator it = tree.begin(); it != tree.end(); ++it)
+    {
+        if (nodes.size() >= NONE)
+            throw std::runtime_error("htmlcxx2: too many nodes for a snapshot");
+        const uint32_t index = static_cast<uint32_t>(nodes.size());
+        const Node &node = *it;
+        const void *parent = Tree::parent(it).node;
+        while (!path.empty() && path.back().first != parent)
+            path.pop_back();
+
+        SnapshotNode record;
+        memset(&record, 0, sizeof(record));
+        record.offset = node.offset();
+        record.length = node.length();
+        record.textLength = static_cast<uint32_t>(node.text().length());
+        record.closingLength = static_cast<uint32_t>(node.closingText().length());
+        record.parent = path.empty() ? NONE : path.back().second;
+        record.firstChild = record.lastChild = NONE;
+        record.prevSibling = record.nextSibling = NONE;
+        record.kind = node.kind();
+        if (node.isRoot())
+            sourceLength = node.length();
+        if (!node.tagName().empty())
+        {
+            // Also kept for the unmatched closing tags turned into comments
+            std::unordered_map<std::string, uint32_t>::const_iterator found = tags.find(node.tagName());
+            if (found == tags.end())
+            {
+                found = tags.insert(std::make_pair(node.tagName(),
+                        static_cast<uint32_t>(strings.length()))).first;
+                strings.append(node.tagName().c_str(), node.tagName().length() + 1);
+            }
+            record.tag = found->second;
+        }
+
+        record.firstAttribute = static_cast<uint32_t>(attributes.size());
+        if (withAttributes && node.isTag())
+        {
+            const char *text = node.text().c_str();
+            impl::scanAttributes(text, [&](const char *keyBegin, const char *keyEnd,
+                    const char *valueBegin, const char *valueEnd)
+            {
+                if (!valueBegin)
+                    valueBegin = valueEnd = keyEnd;
+                SnapshotAttribute attribute;
+                attribute.keyOffset = node.offset() + (keyBegin - text);
+                attribute.valueOffset = node.offset() + (valueBegin - text);
+                attribute.keyLength = static_cast<uint32_t>(keyEnd - keyBegin);
+                attribute.valueLength = static_cast<uint32_t>(valueEnd - valueBegin);
+                attributes.push_back(attribute);
+                return true;
+            });
+        }
+        record.attributeCount = static_cast<uint32_t>(attributes.size()) - record.firstAttribute;
+
+        if (record.parent != NONE)
+        {
+            SnapshotNode &parentRecord = nodes[record.parent];
+            if (parentRecord.lastChild != NONE)
+            {
+                nodes[parentRecord.lastChild].nextSibling = index;
+                record.prevSibling = parentRecord.lastChild;
+            }
+            else
+                parentRecord.firstChild = index;
+            parentRecord.lastChild = index;
+        }
+        nodes.push_back(record);
+        path.push_back(std::make_pair(static_cast<const void*>(it.node), index));
+    }
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, impl::snapshotMagic, sizeof(header.magic));
+    header.version = VERSION;
+    header.byteOrder = impl::snapshotByteOrder;
+    header.flags = withAttributes ? WITH_ATTRIBUTES : 0;
+    header.nodeSize = sizeof(SnapshotNode);
+    header.nodeCount = nodes.size();
+    header.attributeCount = attributes.size();
+    header.stringsSize = strings.length();
+    header.sourceLength = sourceLength;
+
+    std::string data;
+    data.reserve(sizeof(header) + nodes.size() * sizeof(SnapshotNode)
+            + attributes.size() * sizeof(SnapshotAttribute) + strings.length());
+    data.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    if (!nodes.empty())
+        data.append(reinterpret_cast<const char*>(&nodes[0]), nodes.size() * sizeof(SnapshotNode));
+    if (!attributes.empty())
+        data.append(reinterpret_cast<const char*>(&attributes[0]),
+                attributes.size() * sizeof(SnapshotAttribute));
+    data.append(strings);
+    return data;
+}
+
+inline Snapshot::Snapshot(const void *data, size_t size) :
+    header_(nullptr), nodes_(nullptr), attributes_(nullptr), strings_(nullptr)
+{
+    const char *bytes = static_cast<const char*>(data);
+    if (reinterpret_cast<uintptr_t>(bytes) % 8 != 0)
+        throw std::runtime_error("htmlcxx2: snapshot data is not aligned");
+    const SnapshotHeader *header = reinterpret_cast<const SnapshotHeader*>(bytes);
+    if (size < sizeof(SnapshotHeader)
+            || memcmp(header->magic, impl::snapshotMagic, sizeof(header->magic)) != 0
+            || header->byteOrder != impl::snapshotByteOrder
+            || header->version != VERSION
+            || header->nodeSize != sizeof(SnapshotNode))
+        throw std::runtime_error("htmlcxx2: not a snapshot of this version");
+
+    // Check every size and link once so that navigation needs no checks
+    size_t left = size - sizeof(SnapshotHeader);
+    if (header->nodeCount == 0 || header->nodeCount >= NONE
+            || header->nodeCount > left / sizeof(SnapshotNode))
+        throw std::runtime_error("htmlcxx2: corrupt snapshot");
+    left -= static_cast<size_t>(header->nodeCount) * sizeof(SnapshotNode);
+    if (header->attributeCount >= NONE || header->attributeCount > left / sizeof(SnapshotAttribute))
+        throw std::runtime_error("htmlcxx2: corrupt snapshot");
+    left -= static_cast<size_t>(header->attributeCount) * sizeof(SnapshotAttribute);
+    if (header->stringsSize == 0 || header->stringsSize != left)
+        throw std::runtime_error("htmlcxx2: corrupt snapshot");
+
+    const SnapshotNode *nodes = reinterpret_cast<const SnapshotNode*>(bytes + sizeof(SnapshotHeader));
+    const SnapshotAttribute *attributes = reinterpret_cast<const SnapshotAttribute*>(nodes + header->nodeCount);
+    const char *strings = reinterpret_cast<const char*>(attributes + header->attributeCount);
+    if (strings[header->stringsSize - 1] != '\0')
+        throw std::runtime_error("htmlcxx2: corrupt snapshot");
+
+    const uint64_t count = header->nodeCount;
+    const uint64_t source = header->sourceLength;
+    for (uint64_t i = 0; i < count; ++i)
+    {
+        const SnapshotNode &node = nodes[i];
+        const bool ok = (node.parent == NONE ? i == 0 : node.parent < i)
+            && (node.firstChild == NONE || (node.firstChild > i && node.firstChild < count))
+            && (node.lastChild == NONE || (node.lastChild > i && node.lastChild < count))
+            && (node.prevSibling == NONE || node.prevSibling < i)
+            && (node.nextSibling == NONE || (node.nextSibling > i && node.nextSibling < count))
+            && node.tag < header->stringsSize
+            && node.attributeCount <= header->attributeCount
+            && node.firstAttribute <= header->attributeCount - node.attributeCount
+            && node.offset <= source && node.length <= source - node.offset
+            && node.textLength <= node.length && node.closingLength <= node.length;
+        if (!ok)
+            throw std::runtime_error("htmlcxx2: corrupt snapshot");
+    }
+    for (uint64_t i = 0; i < header->attributeCount; ++i)
+    {
+        const SnapshotAttribute &attribute = attributes[i];
+        if (attribute.keyOffset > source || attribute.keyLength > source - attribute.keyOffset
+                || attribute.valueOffset > source || attribute.valueLength > source - attribute.valueOffset)
+            throw std::runtime_error("htmlcxx2: corrupt snapshot");
+    }
+
+    header_ = header;
+    nodes_ = nodes;
+    attributes_ = attributes;
+    strings_ = strings;
+}
+
+inline Tree Snapshot::toTree(const std::string &html) const
+{
+    if (html.length() != sourceLength())
+        throw std::invalid_argument("htmlcxx2: not the source of the snapshot");
+
+    Tree tree;
+    std::vector<Tree::iterator> its;
+    its.reserve(size());
+    for (size_t i = 0; i < size(); ++i)
+    {
+        const SnapshotNode &record = nodes_[i];
+        const Node node(strings_ + record.tag,
+                html.substr(static_cast<size_t>(record.offset), record.textLength),
+                html.substr(static_cast<size_t>(record.offset + record.length - record.closingLength),
+                    record.closingLength),
+                static_cast<size_t>(record.offset), static_cast<size_t>(record.length),
+                static_cast<Node::Kind>(record.kind));
+        if (record.parent == NONE)
+            its.push_back(tree.insert(tree.end(), node));
+        else
+            its.push_back(tree.append_child(its[record.parent], node));
+    }
+    return tree;
+}
+
+//
+// MappedFile
+//
+
+// A read only memory mapping of a whole file, page aligned as Snapshot needs
+class MappedFile
+{
+public:
+    // Throws std::runtime_error if the file cannot be mapped
+    explicit MappedFile(const std::string &path);
+    ~MappedFile();
+
+    const void* data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+    void *data_;
+    size_t size_;
+#ifdef _WIN32
+    HANDLE file_;
+    HANDLE mapping_;
+#endif
+};
+
+#ifdef _WIN32
+
+inline MappedFile::MappedFile(const std::string &path) :
+    data_(nullptr), size_(0), file_(INVALID_HANDLE_VALUE), mapping_(nullptr)
+{
+    file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL, nullptr);
+    LARGE_INTEGER size;
+    if (file_ == INVALID_HANDLE_VALUE || !GetFileSizeEx(file_, &size))
+    {
+        if (file_ != INVALID_HANDLE_VALUE)
+            CloseHandle(file_);
+        throw std::runtime_error("htmlcxx2: cannot open " + path);
+    }
+    size_ = static_cast<size_t>(size.QuadPart);
+    if (size_ == 0)
+        return;
+    mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping_)
+        data_ = MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+    if (!data_)
+    {
+        if (mapping_)
+            CloseHandle(mapping_);
+        CloseHandle(file_);
+        throw std::runtime_error("htmlcxx2: cannot map " + path);
+    }
+}
+
+inline MappedFile::~MappedFile()
+{
+    if (data_)
+        UnmapViewOfFile(data_);
+    if (mapping_)
+        CloseHandle(mapping_);
+    CloseHandle(file_);
+}
+
+#else
+
+inline MappedFile::MappedFile(const std::string &path) :
+    data_(nullptr), size_(0)
+{
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || ::fstat(fd, &st) != 0)
+    {
+        if (fd >= 0)
+            ::close(fd);
+        throw std::runtime_error("htmlcxx2: cannot open " + path);
+    }
+    size_ = static_cast<size_t>(st.st_size);
+    if (size_ != 0)
+    {
+        void *data = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            ::close(fd);
+            throw std::runtime_error("htmlcxx2: cannot map " + path);
+        }
+        data_ = data;
+    }
+    ::close(fd);
+}
+
+inline MappedFile::~MappedFile()
+{
+    if (data_)
+        ::munmap(data_, size_);
+}
+
+#endif
+
+} }
+
+#endif
@@ -0,0 +1,222 @@
+// htmlcxx2.
+// A simple non-validating parser written in C++.
+//
+// Collection and export of parse timings.
+
+#ifndef __HTML_TRACE_H__
+#define __HTML_TRACE_H__
+
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+
+#include "htmlcxx2_html.hpp"
+
+namespace htmlcxx2 {
+namespace HTML {
+
+namespace impl {
+
+    inline void appendJsonString(std::string &out, const std::string &value)
+    {
+        out += '"';
+        for (size_t i = 0; i < value.length(); ++i)
+        {
+            const unsigned char c = static_cast<unsigned char>(value[i]);
+            if (c == '"' || c == '\\')
+            {
+                out += '\\';
+                out += static_cast<char>(c);
+            }
+            else if (c < 0x20)
+            {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                out += escaped;
+            }
+            else
+                out += static_cast<char>(c);
+        }
+        out += '"';
+    }
+
+    inline void appendCsvField(std::string &out, const std::string &value)
+    {
+        if (value.find_first_of(",\"\r\n") == std::string::npos)
+        {
+            out += value;
+            return;
+        }
+        out += '"';
+        for (size_t i = 0; i < value.length(); ++i)
+        {
+            if (value[i] == '"')
+                out += '"';
+            out += value[i];
+        }
+        out += '"';
+    }
+
+    // Nanoseconds as microseconds with a fraction
+    inline void appendMicroseconds(std::string &out, uint64_t nanoseconds)
+    {
+        char number[32];
+        snprintf(number, sizeof(number), "%llu.%03u",
+                static_cast<unsigned long long>(nanoseconds / 1000),
+                static_cast<unsigned>(nanoseconds % 1000));
+        out += number;
+    }
+
+} // impl
+
+//
+// ParseTrace
+//
+
+// Keeps the ParserTimes of some of the documents parsed, from any number of
+// threads, and writes them out as a Chrome trace (chrome://tracing, Perfetto)
+// or as CSV:
+//
+//     ParseTrace trace(100);
+//     ...
+//     parser.setTiming(trace.sample());
+//     parser.parseTree(html);
+//     if (parser.times().total)
+//         trace.add(url, parser.times());
+//
+// In the Chrome trace each document is an event on the thread which parsed
+// it, with the phases as consecutive events inside: they are totals, not the
+// order in which the time was spent.
+class ParseTrace
+{
+public:
+    // Samples one document out of sampleEvery (0 samples none)
+    explicit ParseTrace(size_t sampleEvery = 1) :
+        mutex_(), records_(), threads_(), counter_(0), sampleEvery_(sampleEvery) { }
+
+    // Whether to time the next document
+    bool sample() { return sampleEvery_ && counter_.fetch_add(1) % sampleEvery_ == 0; }
+    void add(const std::string &document, const ParserTimes &times);
+
+    size_t size() const;
+    void clear();
+
+    std::string toChromeTrace() const;
+    std::string toCsv() const;
+
+protected:
+    struct Record
+    {
+        std::string document;
+        ParserTimes times;
+        size_t thread;
+    };
+
+    mutable std::mutex mutex_;
+    std::vector<Record> records_;
+    std::vector<std::thread::id> threads_;
+    std::atomic<size_t> counter_;
+    size_t sampleEvery_;
+};
+
+inline void ParseTrace::add(const std::string &document, const ParserTimes &times)
+{
+    const std::thread::id id = std::this_thread::get_id();
+    std::lock_guard<std::mutex> lock(mutex_);
+    const size_t thread = std::find(threads_.begin(), threads_.end(), id) - threads_.begin();
+    if (thread == threads_.size())
+        threads_.push_back(id);
+    Record record = { document, times, thread + 1 };
+    records_.push_back(record);
+}
+
+inline size_t ParseTrace::size() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return records_.size();
+}
+
+inline void ParseTrace::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    records_.clear();
+}
+
+inline std::string ParseTrace::toChromeTrace() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint64_t origin = records_.empty() ? 0 : records_[0].times.start;
+    for (size_t i = 0; i < records_.size(); ++i)
+        origin = std::min(origin, records_[i].times.start);
+
+    std::string out("{\"traceEvents\":[");
+    bool first = true;
+    auto event = [&](const std::string &name, uint64_t start, uint64_t duration, size_t thread)
+    {
+        out += first ? "\n" : ",\n";
+        first = false;
+        out += "{\"name\":";
+        impl::appendJsonString(out, name);
+        out += ",\"cat\":\"htmlcxx2\",\"ph\":\"X\",\"ts\":";
+        impl::appendMicroseconds(out, start - origin);
+        out += ",\"dur\":";
+        impl::appendMicroseconds(out, duration);
+        out += ",\"pid\":1,\"tid\":";
+        out += std::to_string(thread);
+        out += "}";
+    };
+    for (size_t i = 0; i < records_.size(); ++i)
+    {
+        const Record &record = records_[i];
+        event(record.document, record.times.start, record.times.total, record.thread);
+        uint64_t start = record.times.start;
+        for (int phase = 0; phase < ParserTimes::PHASES; ++phase)
+        {
+            if (!record.times.phases[phase])
+                continue;
+            event(ParserTimes::phaseName(static_cast<ParserTimes::Phase>(phase)), start,
+                    record.times.phases[phase], record.thread);
+            start += record.times.phases[phase];
+        }
+    }
+    out += "\n],\"displayTimeUnit\":\"ms\"}\n";
+    return out;
+}
+
+inline std::string ParseTrace::toCsv() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string out("document,thread,total_us");
+    for (int phase = 0; phase < ParserTimes::PHASES; ++phase)
+    {
+        out += ',';
+        out += ParserTimes::phaseName(static_cast<ParserTimes::Phase>(phase));
+        out += "_us";
+    }
+    out += '\n';
+    for (size_t i = 0; i < records_.size(); ++i)
+    {
+        const Record &record = records_[i];
+        impl::appendCsvField(out, record.document);
+        out += ',';
+        out += std::to_string(record.thread);
+        out += ',';
+        impl::appendMicroseconds(out, record.times.total);
+        for (int phase = 0; phase < ParserTimes::PHASES; ++phase)
+        {
+            out += ',';
+            impl::appendMicroseconds(out, record.times.phases[phase]);
+        }
+        out += '\n';
+    }
+    return out;
+}
+
+} }
+
+#endif
@@ -44,7 +44,7 @@ namespace kp
 
 /// A node in the tree, combining links to other nodes as well as the actual data.
 template<class T>
-class tree_node_ { // size: 5*4=20 bytes (on 32 bit arch), can be reduced by 8.
+class tree_node_ { // size: 8*4=32 bytes (on 32 bit arch) plus the data, can be reduced by 8.
     public:
         tree_node_();
         tree_node_(const T&);
@@ -52,18 +52,24 @@ class tree_node_ { // size: 5*4=20 bytes (on 32 bit arch), can be reduced by 8.
         tree_node_<T> *parent;
        tree_node_<T> *first_child, *last_child;
         tree_node_<T> *prev_sibling, *next_sibling;
+        /// Cached counts, only maintained when the owning tree has cache_counts() enabled,
+        /// but stored in every node: 3 words more whether the counts are cached or not.
+        /// A subtree_size of 0 means that the counts of this node are not tracked.
+        size_t children_count, subtree_size, sibling_index;
         T data;
 }; // __attribute__((packed));
 
 template<class T>
 tree_node_<T>::tree_node_()
-    : parent(0), first_child(0), last_child(0), prev_sibling(0), next_sibling(0)
+    : parent(0), first_child(0), last_child(0), prev_sibling(0), next_sibling(0),
+      children_count(0), subtree_size(0), sibling_index(0)
     {
     }
 
 template<class T>
 tree_node_<T>::tree_node_(const T& val)
-    : parent(0), first_child(0), last_child(0), prev_sibling(0), next_sibling(0), data(val)
+    : parent(0), first_child(0), last_child(0), prev_sibling(0), next_sibling(0),
+      children_count(0), subtree_size(0), sibling_index(0), data(val)
     {
     }
 
@@ -85,8 +91,11 @@ class tree {
         tree(const T&);
         tree(const iterator_base&);
         tree(const tree<T, tree_node_allocator>&);
+        /// Takes over the nodes of the other tree, which is left empty.
+        tree(tree<T, tree_node_allocator>&&);
         ~tree();
         tree<T,tree_node_allocator>& operator=(const tree<T, tree_node_allocator>&);
+        tree<T,tree_node_allocator>& operator=(tree<T, tree_node_allocator>&&);
 
         /// Base class for iterators, only pointers stored, no traversal logic.
 #ifdef __SGI_STL_PORT
@@ -212,6 +221,7 @@ class tree {
                 sibling_iterator(tree_node *);
                 sibling_iterator(const sibling_iterator&);
                 sibling_iterator(const iterator_base&);
+                sibling_iterator& operator=(const sibling_iterator&) = default;
 
                 bool    operator==(const sibling_iterator&) const;
                 bool    operator!=(const sibling_iterator&) const;
@@ -402,6 +412,14 @@ class tree {
         static sibling_iterator child(const iterator_base& position, size_t);
         /// Return iterator to the sibling indicated by index
         sibling_iterator sibling(const iterator_base& position, size_t);                  
+
+        /// Keep child counts, subtree sizes and sibling indices cached in the nodes. With the
+        /// cache enabled size(), number_of_children() and index() are O(1) and child() walks
+        /// from the nearer end of the sibling list; in exchange every structural change costs
+        /// an extra walk up to the root. Enabling the cache on a non-empty tree is O(n).
+        void     cache_counts(bool);
+        /// Check whether counts are cached (see cache_counts()).
+        bool     counts_cached() const;
         
         /// For debugging only: verify internal consistency by inspecting all pointers in the tree
         /// (which will also trigger a valgrind error in case something got corrupted).
@@ -419,8 +437,23 @@ class tree {
         tree_node *head, *feet;    // head/feet are always dummy; if an iterator points to them it is invalid
     private:
         tree_node_allocator alloc_;
+        bool cache_counts_;
         void head_initialise_();
         void copy_(const tree<T, tree_node_allocator>& other);
+        void move_(tree<T, tree_node_allocator>& other);
+        void erase_children_(tree_node *);
+
+        /// Cached counts bookkeeping, all of these are no-ops unless cache_counts_ is set.
+        /// Account for the range of siblings first..last which has just been linked in.
+        void counts_linked_(tree_node *first, tree_node *last);
+        /// Account for 'children' siblings holding 'nodes' nodes which have just been
+        /// unlinked from 'parent'; 'next' is the node which followed them (or 0).
+        void counts_unlinked_(tree_node *parent, tree_node *next, size_t children, size_t nodes);
+        /// Account for 'node' (plus its children) having moved away from 'old_parent'.
+        void counts_moved_(tree_node *node, tree_node *old_parent);
+        void renumber_(tree_node *from) const;
+        void renumber_children_(tree_node *parent) const;
+        static void count_subtree_(tree_node *top);
 
         /// Comparator class for two nodes of a tree (used for sorting and searching).
         template<class StrictWeakOrdering>
@@ -489,6 +522,8 @@ void tree<T, tree_node_allocator>::head_initialise_()
     feet->last_child=0;
     feet->prev_sibling=head;
     feet->next_sibling=0;
+
+    cache_counts_=false;
     }
 
 template <class T, class tree_node_allocator>
@@ -506,10 +541,42 @@ tree<T, tree_node_allocator>::tree(const tree<T, tree_node_allocator>& other)
     copy_(other);
     }
 
+template <class T, class tree_node_allocator>
+tree<T,tree_node_allocator>& tree<T, tree_node_allocator>::operator=(tree<T, tree_node_allocator>&& other)
+    {
+    if(this != &other)
+        move_(other);
+    return *this;
+    }
+
+template <class T, class tree_node_allocator>
+tree<T, tree_node_allocator>::tree(tree<T, tree_node_allocator>&& other)
+    {
+    head_initialise_();
+    move_(other);
+    }
+
+template <class T, class tree_node_allocator>
+void tree<T, tree_node_allocator>::move_(tree<T, tree_node_allocator>& other)
+    {
+    clear();
+    cache_counts_=other.cache_counts_;
+    if(other.head->next_sibling!=other.feet) {
+        // Top level nodes have no parent, only the sibling links to head and feet change.
+        head->next_sibling=other.head->next_sibling;
+        feet->prev_sibling=other.feet->prev_sibling;
+        head->next_sibling->prev_sibling=head;
+        feet->prev_sibling->next_sibling=feet;
+        other.head->next_sibling=other.feet;
+        other.feet->prev_sibling=other.head;
+        }
+    }
+
 template <class T, class tree_node_allocator>
 void tree<T, tree_node_allocator>::copy_(const tree<T, tree_node_allocator>& other) 
     {
     clear();
+    cache_counts_=other.cache_counts_;
     pre_order_iterator it=other.begin(), to=begin();
     while(it!=other.end()) {
         to=insert(to, (*it));
@@ -541,18 +608,30 @@ void tree<T, tree_node_allocator>::erase_children(const iterator_base& it)
 //    std::cout << "erase_children " << it.node << std::endl;
     if(it.node==0) return;
 
-    tree_node *cur=it.node->first_child;
+    if(cache_counts_ && it.node->first_child!=0) {
+        size_t nodes=it.node->subtree_size-1;
+        for(tree_node *pos=it.node; pos!=0; pos=pos->parent)
+            pos->subtree_size-=nodes;
+        it.node->children_count=0;
+        }
+    erase_children_(it.node);
+    }
+
+template<class T, class tree_node_allocator> 
+void tree<T, tree_node_allocator>::erase_children_(tree_node *node)
+    {
+    tree_node *cur=node->first_child;
     tree_node *prev=0;
 
     while(cur!=0) {
         prev=cur;
         cur=cur->next_sibling;
-        erase_children(pre_order_iterator(prev));
+        erase_children_(prev);
         alloc_.destroy(prev);
         alloc_.deallocate(prev,1);
         }
-    it.node->first_child=0;
-    it.node->last_child=0;
+    node->first_child=0;
+    node->last_child=0;
     }
 
 template<class T, class tree_node_allocator> 
@@ -577,6 +656,7 @@ iter tree<T, tree_node_allocator>::erase(iter it)
     else {
         cur->next_sibling->prev_sibling=cur->prev_sibling;
         }
+    counts_unlinked_(cur->parent, cur->next_sibling, 1, 1);
 
     alloc_.destroy(cur);
     alloc_.deallocate(cur,1);
@@ -820,6 +900,7 @@ iter tree<T, tree_node_allocator>::append_child(iter position)
     tmp->prev_sibling=position.node->last_child;
     position.node->last_child=tmp;
     tmp->next_sibling=0;
+    counts_linked_(tmp, tmp);
     return tmp;
      }
 
@@ -847,6 +928,7 @@ iter tree<T, tree_node_allocator>::prepend_child(iter position)
     tmp->next_sibling=position.node->first_child;
     position.node->prev_child=tmp;
     tmp->prev_sibling=0;
+    counts_linked_(tmp, tmp);
     return tmp;
      }
 
@@ -878,6 +960,7 @@ iter tree<T, tree_node_allocator>::append_child(iter position, const T& x)
     tmp->prev_sibling=position.node->last_child;
     position.node->last_child=tmp;
     tmp->next_sibling=0;
+    counts_linked_(tmp, tmp);
     return tmp;
     }
 
@@ -905,6 +988,7 @@ iter tree<T, tree_node_allocator>::prepend_child(iter position, const T& x)
     tmp->next_sibling=position.node->first_child;
     position.node->first_child=tmp;
     tmp->prev_sibling=0;
+    counts_linked_(tmp, tmp);
     return tmp;
     }
 
@@ -998,6 +1082,7 @@ iter tree<T, tree_node_allocator>::insert(iter position, const T& x)
         }
     else
         tmp->prev_sibling->next_sibling=tmp;
+    counts_linked_(tmp, tmp);
     return tmp;
     }
 
@@ -1028,6 +1113,7 @@ typename tree<T, tree_node_allocator>::sibling_iterator tree<T, tree_node_alloca
         }
     else
         tmp->prev_sibling->next_sibling=tmp;
+    counts_linked_(tmp, tmp);
     return tmp;
     }
 
@@ -1053,6 +1139,7 @@ iter tree<T, tree_node_allocator>::insert_after(iter position, const T& x)
     else {
         tmp->next_sibling->prev_sibling=tmp;
         }
+    counts_linked_(tmp, tmp);
     return tmp;
     }
 
@@ -1133,6 +1220,11 @@ iter tree<T, tree_node_allocator>::replace(iter position, const iterator_base& f
         }
     tmp->next_sibling=current_to->next_sibling;
     tmp->parent=current_to->parent;
+    if(cache_counts_) {
+        // current_to has no children left, so the counts upwards are unchanged
+        tmp->subtree_size=1;
+        tmp->sibling_index=current_to->sibling_index;
+        }
 //    kp::destructor(&current_to->data);
     alloc_.destroy(current_to);
     alloc_.deallocate(current_to,1);
@@ -1234,6 +1326,14 @@ iter tree<T, tree_node_allocator>::flatten(iter position)
     position.node->first_child=0;
     position.node->last_child=0;
 
+    if(cache_counts_) {
+        // the parent's subtree keeps the same nodes, only the children move up a level
+        if(position.node->parent)
+            position.node->parent->children_count+=position.node->children_count;
+        position.node->children_count=0;
+        position.node->subtree_size=1;
+        renumber_(position.node->next_sibling);
+        }
     return position;
     }
 
@@ -1249,9 +1349,13 @@ iter tree<T, tree_node_allocator>::reparent(iter position, sibling_iterator begi
     
     if(begin==end) return begin;
     // determine last node
+    size_t children=1, nodes=first->subtree_size;
     while((++begin)!=end) {
         last=last->next_sibling;
+        ++children;
+        nodes+=last->subtree_size;
         }
+    tree_node *old_parent=first->parent, *old_next=last->next_sibling;
     // move subtree
     if(first->prev_sibling==0) {
         first->parent->first_child=last->next_sibling;
@@ -1283,6 +1387,8 @@ iter tree<T, tree_node_allocator>::reparent(iter position, sibling_iterator begi
         if(pos==last) break;
         pos=pos->next_sibling;
         }
+    counts_unlinked_(old_parent, old_next, children, nodes);
+    counts_linked_(first, last);
 
     return first;
     }
@@ -1317,6 +1423,7 @@ template <typename iter> iter tree<T, tree_node_allocator>::move_after(iter targ
     if(dst->next_sibling)
         if(dst->next_sibling==src) // already in the right spot
             return source;
+   tree_node *old_parent=src->parent;
 
    // take src out of the tree
    if(src->prev_sibling!=0) src->prev_sibling->next_sibling=src->next_sibling;
@@ -1331,6 +1438,7 @@ template <typename iter> iter tree<T, tree_node_allocator>::move_after(iter targ
    dst->next_sibling=src;
    src->prev_sibling=dst;
    src->parent=dst->parent;
+   counts_moved_(src, old_parent);
    return src;
    }
 
@@ -1346,6 +1454,7 @@ template <typename iter> iter tree<T, tree_node_allocator>::move_before(iter tar
     if(dst->prev_sibling)
         if(dst->prev_sibling==src) // already in the right spot
             return source;
+   tree_node *old_parent=src->parent;
 
    // take src out of the tree
    if(src->prev_sibling!=0) src->prev_sibling->next_sibling=src->next_sibling;
@@ -1360,6 +1469,7 @@ template <typename iter> iter tree<T, tree_node_allocator>::move_before(iter tar
    dst->prev_sibling=src;
    src->next_sibling=dst;
    src->parent=dst->parent;
+   counts_moved_(src, old_parent);
    return src;
    }
 
@@ -1382,6 +1492,7 @@ typename tree<T, tree_node_allocator>::sibling_iterator tree<T, tree_node_alloca
     if(dst_prev_sibling)
         if(dst_prev_sibling==src) // already in the right spot
             return source;
+    tree_node *old_parent=src->parent;
 
     // take src out of the tree
     if(src->prev_sibling!=0) src->prev_sibling->next_sibling=src->next_sibling;
@@ -1397,7 +1508,10 @@ typename tree<T, tree_node_allocator>::sibling_iterator tree<T, tree_node_alloca
         dst->prev_sibling=src;
         src->parent=dst->parent;
         }
+    else
+        src->parent=target.parent_;
     src->next_sibling=dst;
+    counts_moved_(src, old_parent);
     return src;
     }
 
@@ -1422,6 +1536,7 @@ template <typename iter> iter tree<T, tree_node_allocator>::move_ontop(iter targ
 
     // remove target
     erase(target);
+    tree_node *old_parent=src->parent;
 
     // take src out of the tree
     if(src->prev_sibling!=0) src->prev_sibling->next_sibling=src->next_sibling;
@@ -1437,6 +1552,7 @@ template <typename iter> iter tree<T, tree_node_allocator>::move_ontop(iter targ
     src->prev_sibling=b_prev_sibling;
     src->next_sibling=b_next_sibling;
     src->parent=b_parent;
+    counts_moved_(src, old_parent);
     return src;
     }
 
@@ -1519,6 +1635,8 @@ void tree<T, tree_node_allocator>::sort(sibling_iterator from, sibling_iterator
             (*eit)->parent->last_child=(*eit);
         }
     else next->prev_sibling=(*eit);
+    if(cache_counts_)
+        renumber_children_((*eit)->parent);
 
     if(deep) {    // sort the children of each node too
         sibling_iterator bcs(*nodes.begin());
@@ -1597,6 +1715,11 @@ template <class T, class tree_node_allocator>
 size_t tree<T, tree_node_allocator>::size() const
     {
     size_t i=0;
+    if(cache_counts_) {
+        for(tree_node *pos=head->next_sibling; pos!=feet; pos=pos->next_sibling)
+            i+=pos->subtree_size;
+        return i;
+        }
     pre_order_iterator it=begin(), eit=end();
     while(it!=eit) {
         ++i;
@@ -1608,6 +1731,8 @@ size_t tree<T, tree_node_allocator>::size() const
 template <class T, class tree_node_allocator>
 size_t tree<T, tree_node_allocator>::size(const iterator_base& top) const
     {
+    if(top.node->subtree_size!=0)
+        return top.node->subtree_size;
     size_t i=0;
     pre_order_iterator it=top, eit=top;
     eit.skip_children();
@@ -1696,6 +1821,8 @@ size_t tree<T, tree_node_allocator>::max_depth(const iterator_base& pos) const
 template <class T, class tree_node_allocator>
 size_t tree<T, tree_node_allocator>::number_of_children(const iterator_base& it)
     {
+    if(it.node->subtree_size!=0)
+        return it.node->children_count;
     tree_node *pos=it.node->first_child;
     if(pos==0) return 0;
     
@@ -1747,6 +1874,7 @@ void tree<T, tree_node_allocator>::swap(sibling_iterator it)
         nxt->next_sibling=it.node;
         it.node->prev_sibling=nxt;
         it.node->next_sibling=nxtnxt;
+        std::swap(nxt->sibling_index, it.node->sibling_index);
         }
     }
 
@@ -1780,6 +1908,16 @@ void tree<T, tree_node_allocator>::swap(iterator one, iterator two)
         two.node->prev_sibling=pre1;
         if(pre1) pre1->next_sibling=two.node;
         else     par1->first_child=two.node;
+
+        if(cache_counts_) {
+            std::swap(one.node->sibling_index, two.node->sibling_index);
+            if(par1!=par2) {
+                for(tree_node *pos=par1; pos!=0; pos=pos->parent)
+                    pos->subtree_size+=two.node->subtree_size-one.node->subtree_size;
+                for(tree_node *pos=par2; pos!=0; pos=pos->parent)
+                    pos->subtree_size+=one.node->subtree_size-two.node->subtree_size;
+                }
+            }
         }
     }
 
@@ -1829,6 +1967,8 @@ typename tree<T, tree_node_allocator>::iterator tree<T, tree_node_allocator>::lo
 template <class T, class tree_node_allocator>
 size_t tree<T, tree_node_allocator>::index(sibling_iterator it) const
     {
+    if(it.node->subtree_size!=0)
+        return it.node->sibling_index;
     size_t ind=0;
     if(it.node->parent==0) {
         while(it.node->prev_sibling!=head) {
@@ -1882,13 +2022,147 @@ void tree<T, tree_node_allocator>::debug_verify_consistency() const
             else
                 assert(it.node->next_sibling->prev_sibling==it.node);
             }
+        if(cache_counts_) {
+            size_t children=0, nodes=1;
+            for(tree_node *pos=it.node->first_child; pos!=0; pos=pos->next_sibling) {
+                assert(pos->sibling_index==children);
+                ++children;
+                nodes+=pos->subtree_size;
+                }
+            assert(it.node->children_count==children);
+            assert(it.node->subtree_size==nodes);
+            }
         ++it;
         }
     }
 
+template <class T, class tree_node_allocator>
+void tree<T, tree_node_allocator>::cache_counts(bool enable)
+    {
+    if(enable==cache_counts_) return;
+    cache_counts_=enable;
+    if(enable) {
+        for(tree_node *pos=head->next_sibling; pos!=feet; pos=pos->next_sibling)
+            count_subtree_(pos);
+        renumber_children_(0);
+        }
+    else {
+        for(iterator it=begin(); it!=end(); ++it)
+            it.node->subtree_size=0;
+        }
+    }
+
+template <class T, class tree_node_allocator>
+bool tree<T, tree_node_allocator>::counts_cached() const
+    {
+    return cache_counts_;
+    }
+
+template <class T, class tree_node_allocator>
+void tree<T, tree_node_allocator>::counts_linked_(tree_node *first, tree_node *last)
+    {
+    if(!cache_counts_) return;
+    size_t children=0, nodes=0;
+    for(tree_node *pos=first; ; pos=pos->next_sibling) {
+        if(pos->subtree_size==0)
+            count_subtree_(pos);
+        ++children;
+        nodes+=pos->subtree_size;
+        if(pos==last) break;
+        }
+    if(first->parent!=0) {
+        first->parent->children_count+=children;
+        for(tree_node *pos=first->parent; pos!=0; pos=pos->parent)
+            pos->subtree_size+=nodes;
+        }
+    renumber_(first);
+    }
+
+template <class T, class tree_node_allocator>
+void tree<T, tree_node_allocator>::counts_unlinked_(tree_node *parent, tree_node *next, size_t children, size_t nodes)
+    {
+    if(!cache_counts_) return;
+    if(parent!=0) {
+        parent->children_count-=children;
+        for(tree_node *pos=parent; pos!=0; pos=pos->parent)
+            pos->subtree_size-=nodes;
+        }
+    renumber_(next);
+    }
+
+template <class T, class tree_node_allocator>
+void tree<T, tree_node_allocator>::counts_moved_(tree_node *node, tree_node *old_parent)
+    {
+    if(!cache_counts_) return;
+    if(old_parent!=node->parent) {
+        if(old_parent!=0) {
+            --old_parent->children_count;
+            for(tree_node *pos=old_parent; pos!=0; pos=pos->parent)
+                pos->subtree_size-=node->subtree_size;
+            }
+        if(node->parent!=0) {
+            ++node->parent->children_count;
+            for(tree_node *pos=node->parent; pos!=0; pos=pos->parent)
+                pos->subtree_size+=node->subtree_size;
+            }
+        renumber_children_(old_parent);
+        }
+    renumber_children_(node->parent);
+    }
+
+template <class T, class tree_node_allocator>
+void tree<T, tree_node_allocator>::renumber_(tree_node *from) const
+    {
+    if(from==0 || from==feet) return;
+    tree_node *prev=from->prev_sibling;
+    size_t ind=(prev==0 || prev==head) ? 0 : prev->sibling_index+1;
+    for(; from!=0 && from!=feet; from=from->next_sibling)
+        from->sibling_index=ind++;
+    }
+
+template <class T, class tree_node_allocator>
+void tree<T, tree_node_allocator>::renumber_children_(tree_node *parent) const
+    {
+    renumber_(parent!=0 ? parent->first_child : head->next_sibling);
+    }
+
+template <class T, class tree_node_allocator>
+void tree<T, tree_node_allocator>::count_subtree_(tree_node *top)
+    {
+    // Post-order walk without recursion, so that deep documents cannot blow the stack.
+    tree_node *pos=top;
+    while(pos->first_child)
+        pos=pos->first_child;
+    for(;;) {
+        size_t children=0, nodes=1;
+        for(tree_node *ch=pos->first_child; ch!=0; ch=ch->next_sibling) {
+            ch->sibling_index=children++;
+            nodes+=ch->subtree_size;
+            }
+        pos->children_count=children;
+        pos->subtree_size=nodes;
+        if(pos==top) break;
+        if(pos->next_sibling) {
+            pos=pos->next_sibling;
+            while(pos->first_child)
+                pos=pos->first_child;
+            }
+        else
+            pos=pos->parent;
+        }
+    }
+
 template <class T, class tree_node_allocator>
 typename tree<T, tree_node_allocator>::sibling_iterator tree<T, tree_node_allocator>::child(const iterator_base& it, size_t num) 
     {
+    if(it.node->subtree_size!=0 && num>=it.node->children_count/2) {
+        // walk from the back, the count tells us how far
+        assert(num<it.node->children_count);
+        tree_node *tmp=it.node->last_child;
+        for(size_t i=it.node->children_count-1; i>num; --i)
+            tmp=tmp->prev_sibling;
+        return tmp;
+        }
     tree_node *tmp=it.node->first_child;
     while(num--) {
         assert(tmp!=0);
@@ -2028,6 +2302,8 @@ void tree<T, tree_node_allocator>::iterator_base::skip_children(bool skip)
 template <class T, class tree_node_allocator>
 size_t tree<T, tree_node_allocator>::iterator_base::number_of_children() const
     {
+    if(node->subtree_size!=0)
+        return node->children_count;
     tree_node *pos=node->first_child;
     if(pos==0) return 0;
     
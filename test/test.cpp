@@ -5,6 +5,17 @@
 
 #define CATCH_CONFIG_MAIN
 #include <htmlcxx2/htmlcxx2_html.hpp>
+#include <htmlcxx2/htmlcxx2_parallel.hpp>
+#include <htmlcxx2/htmlcxx2_selector.hpp>
+#include <htmlcxx2/htmlcxx2_extract.hpp>
+#include <htmlcxx2/htmlcxx2_links.hpp>
+#include <htmlcxx2/htmlcxx2_snapshot.hpp>
+#include <htmlcxx2/htmlcxx2_cache.hpp>
+#include <htmlcxx2/htmlcxx2_incremental.hpp>
+#include <htmlcxx2/htmlcxx2_lazy.hpp>
+#include <htmlcxx2/htmlcxx2_diff.hpp>
+#include <htmlcxx2/htmlcxx2_trace.hpp>
+#include <htmlcxx2/htmlcxx2_charset.hpp>
 #include "catch.hpp"
 
 using namespace htmlcxx2::HTML;
@@ -268,3 +279,1676 @@ R"(<div>
 }
 
 
+TEST_CASE("cached counts")
+{
+    // Unclosed and stray closing tags make the parser flatten nodes.
+    std::string html(
+R"(<div><p>One<p>Two<b>Three</div>
+<ul><li>1<li>2<li>3</ul></span>
+<table><tr><td>a<td>b</table>)");
+    ParserDom parser;
+    parser.setCachedCounts(true);
+    Tree cached = parser.parseTree(html);
+    REQUIRE(cached.counts_cached());
+    cached.debug_verify_consistency();
+
+    Tree plain = cached;
+    plain.cache_counts(false);
+    REQUIRE(!plain.counts_cached());
+    REQUIRE(cached.size() == plain.size());
+
+    Tree::pre_order_iterator it = cached.begin(), plainIt = plain.begin();
+    for (; it != cached.end(); ++it, ++plainIt)
+    {
+        REQUIRE(cached.size(it) == plain.size(plainIt));
+        REQUIRE(it.number_of_children() == plainIt.number_of_children());
+        REQUIRE(Tree::number_of_children(it) == Tree::number_of_children(plainIt));
+        REQUIRE(cached.index(it) == plain.index(plainIt));
+        for (size_t i = 0; i < it.number_of_children(); ++i)
+            REQUIRE(*Tree::child(it, i) == *Tree::child(plainIt, i));
+    }
+
+    // Structural edits keep the counts up to date.
+    it = findTag(cached.begin(), cached.end(), "ul");
+    size_t removed = cached.size(Tree::child(it, 2));
+    cached.erase(Tree::child(it, 2));
+    cached.flatten(it);
+    cached.debug_verify_consistency();
+    it = findTag(cached.begin(), cached.end(), "table");
+    cached.reparent(it, cached.begin().begin(), Tree::sibling_iterator(it));
+    cached.debug_verify_consistency();
+    REQUIRE(cached.size() == plain.size() - removed);
+}
+
+static void requireSameTree(const Tree &lhs, const Tree &rhs)
+{
+    REQUIRE(lhs.size() == rhs.size());
+    Tree::pre_order_iterator it = lhs.begin(), rit = rhs.begin();
+    for (; it != lhs.end(); ++it, ++rit)
+    {
+        REQUIRE(Tree::depth(it) == Tree::depth(rit));
+        REQUIRE(it->kind() == rit->kind());
+        REQUIRE(it->tagName() == rit->tagName());
+        REQUIRE(it->text() == rit->text());
+        REQUIRE(it->closingText() == rit->closingText());
+        REQUIRE(it->offset() == rit->offset());
+        REQUIRE(it->length() == rit->length());
+    }
+}
+
+TEST_CASE("parallel parse")
+{
+    // Split points will fall inside scripts, comments and attribute values.
+    std::string page(
+R"(<div class="item"><a href="/x?a=1&b=2" title="<b>bold</b>">link</a>
+<script>if (a < b && "</div>") document.write("<p>");</script>
+<!-- <div> commented out </div> -->
+<p>Text <br> more<span>unclosed</p></div>
+<style>p > a { color: red; }</style><textarea><b>raw</b></textarea>
+)");
+    std::string html("<html><body>");
+    for (int i = 0; i < 200; ++i)
+        html += page;
+    html += "<!-- unterminated comment <p>";
+
+    ParserDom serial;
+    Tree expected = serial.parseTree(html);
+    for (size_t chunk = 7; chunk < html.length(); chunk = chunk * 3 + 1)
+    {
+        ParserDomParallel parallel(64, chunk);
+        requireSameTree(parallel.parseTree(html), expected);
+    }
+
+    // Exceptions reach the caller, the threads are joined first
+    struct Throwing : public ParserDomParallel
+    {
+        Throwing() : ParserDomParallel(8, 1024), armed(true) { }
+        void onFoundTag(Node &node, bool isClosingTag)
+        {
+            if (armed && node.tagName() == "textarea")
+                throw std::runtime_error("handler");
+            ParserDomParallel::onFoundTag(node, isClosingTag);
+        }
+        bool armed;
+    } throwing;
+    REQUIRE_THROWS_AS(throwing.parseTree(html), const std::runtime_error&);
+    throwing.armed = false;
+    requireSameTree(throwing.parseTree(html), expected);
+}
+
+TEST_CASE("tag index")
+{
+    std::string html(
+R"(<div><a href="1">1</a><p>Text<a href="2">2</a>
+<img src="x.png"><A HREF="3">3</A></div><p>unclosed<div><a>4</a><img>
+</span></p><a>5</a>)");
+    ParserDom parser;
+    parser.setTagIndex(true);
+    const Tree &domTree = parser.parseTree(html);
+    const TagIndex &index = parser.tagIndex();
+
+    REQUIRE(index.find("a").size() == 5);
+    REQUIRE(index.find("IMG").size() == 2);
+    REQUIRE(index.find("span").empty());
+    REQUIRE(index.find("a")[2]->text() == "<A HREF=\"3\">");
+
+    const char *tags[] = { "a", "p", "img", "div", "span" };
+    for (const char *tag : tags)
+    {
+        for (Tree::iterator it = domTree.begin(); it != domTree.end(); ++it)
+        {
+            REQUIRE(findTag(it, domTree.end(), tag, index) == findTag(it, domTree.end(), tag));
+            REQUIRE(rfindTag(it, domTree.begin(), tag, index) == rfindTag(it, domTree.begin(), tag));
+        }
+        REQUIRE(rfindTag(domTree.end(), domTree.begin(), tag, index)
+                == rfindTag(domTree.end(), domTree.begin(), tag));
+    }
+
+    parser.setTagIndex(false);
+    parser.parseTree(html);
+    REQUIRE(parser.tagIndex().empty());
+}
+
+TEST_CASE("element index")
+{
+    std::string html(
+R"(<div id="main" class="page wide"><p class=" intro  lead ">Text</p>
+<p ID='second' CLASS="lead">More<span class="lead lead">x</span></p>
+<p id="main">duplicate id</p><a id=bare class=wide>y</a></div>)");
+    ParserDom parser;
+    Tree domTree = parser.parseTree(html);
+    ElementIndex index(domTree);
+
+    Tree::iterator it = index.getElementById("main");
+    REQUIRE(it);
+    REQUIRE(it->tagName() == "div");
+    REQUIRE(index.getElementById("second")->tagName() == "p");
+    REQUIRE(index.getElementById("bare")->tagName() == "a");
+    REQUIRE(!index.getElementById("missing"));
+
+    const ElementIndex::Nodes &lead = index.getElementsByClassName("lead");
+    REQUIRE(lead.size() == 3);
+    REQUIRE(lead[0]->text() == "<p class=\" intro  lead \">");
+    REQUIRE(lead[1]->text() == "<p ID='second' CLASS=\"lead\">");
+    REQUIRE(lead[2]->tagName() == "span");
+    REQUIRE(index.getElementsByClassName("wide").size() == 2);
+    REQUIRE(index.getElementsByClassName("intro").size() == 1);
+    REQUIRE(index.getElementsByClassName("Lead").empty());
+
+    // The index does not parse the attributes of the nodes
+    REQUIRE(it->attributeKeys().empty());
+}
+
+TEST_CASE("selector")
+{
+    std::string html(
+R"(<div class="article main" id="a1">
+  <h1>Title</h1>
+  <p class="lead">Intro <a href="/one">one</a> <a name="x">anchor</a></p>
+  <section><p>Nested <span><a href="/two" lang="en-US">two</a></span></p></section>
+  <p lang="en">Last <a href="http://three/" rel="nofollow ugc">three</a></p>
+  <ul><li>1</li><li></li><li><!-- only a comment --></li></ul>
+</div>
+<div class="other"><p><a href="/four">four</a></p></div>)");
+    ParserDom parser;
+    parser.setTagIndex(true);
+    const Tree &domTree = parser.parseTree(html);
+    ElementIndex elements(domTree);
+
+    auto texts = [&](const std::string &selector)
+    {
+        Selector compiled(selector);
+        std::vector<Tree::iterator> found = compiled.select(domTree);
+
+        // The indexed and brute force results are the same
+        REQUIRE(compiled.select(domTree, &parser.tagIndex(), &elements) == found);
+        std::vector<Tree::iterator> brute;
+        for (Tree::iterator it = domTree.begin(); it != domTree.end(); ++it)
+            if (compiled.match(it))
+                brute.push_back(it);
+        REQUIRE(brute == found);
+
+        std::vector<std::string> ret;
+        for (size_t i = 0; i < found.size(); ++i)
+            ret.push_back(found[i]->content(html));
+        return ret;
+    };
+    typedef std::vector<std::string> Strings;
+
+    REQUIRE(texts("div.article > p a[href]") == Strings({ "one", "three" }));
+    REQUIRE(texts("div.article p a[href]") == Strings({ "one", "two", "three" }));
+    REQUIRE(texts("DIV A[HREF^='/']") == Strings({ "one", "two", "four" }));
+    REQUIRE(texts("a[href$=\"/\"], a[name]") == Strings({ "anchor", "three" }));
+    REQUIRE(texts("[rel~=ugc]") == Strings({ "three" }));
+    REQUIRE(texts("[lang|=en]") == Strings({ "two", "Last <a href=\"http://three/\" rel=\"nofollow ugc\">three</a>" }));
+    REQUIRE(texts("a[href*=thr]") == Strings({ "three" }));
+    REQUIRE(texts("#a1 > h1 + p > a:first-child") == Strings({ "one" }));
+    REQUIRE(texts("h1 ~ p > a:last-child") == Strings({ "anchor", "three" }));
+    REQUIRE(texts("li:empty").size() == 2);
+    REQUIRE(texts("li:only-child").empty());
+    REQUIRE(texts(".main.article section span > a") == Strings({ "two" }));
+    REQUIRE(texts(".other a, #a1 section a") == Strings({ "two", "four" }));
+    REQUIRE(texts("#missing a").empty());
+    REQUIRE(texts("*").size() == 18);
+
+    REQUIRE_THROWS_AS(Selector("div >"), const std::invalid_argument&);
+    REQUIRE_THROWS_AS(Selector("a[href"), const std::invalid_argument&);
+    REQUIRE_THROWS_AS(Selector("p:hover"), const std::invalid_argument&);
+    REQUIRE_THROWS_AS(Selector(""), const std::invalid_argument&);
+
+    // A compiled selector is reused on other documents
+    Selector links("p > a[href]");
+    ParserDom other;
+    REQUIRE(links.select(other.parseTree("<p><a href=x>x</a><b><a href=y>y</a></b></p>")).size() == 1);
+}
+
+TEST_CASE("streaming selector")
+{
+    std::string html(
+R"(<div class="article main" id="a1">
+  <h1>Title</h1>
+  <p class="lead">Intro <a href="/one">one</a> <a name="x">anchor</a></p>
+  <section><p>Nested <span><a href="/two" lang="en-US">two</a></span></p></section>
+  <p lang="en">Last <a href="http://three/" rel="nofollow ugc">three</a></p>
+</div>
+<DIV class="other"><p><a href="/four">four</a></P></div>)");
+    ParserDom parser;
+    const Tree &domTree = parser.parseTree(html);
+
+    typedef std::vector<std::pair<size_t, size_t> > Spans;
+    auto stream = [&](const std::string &selector, const std::string &input)
+    {
+        Spans spans;
+        SelectorSax matcher(selector, [&](size_t offset, size_t length)
+        {
+            spans.push_back(std::make_pair(offset, length));
+        });
+        matcher.parse(input);
+        std::sort(spans.begin(), spans.end());
+        return spans;
+    };
+
+    // Same elements as the DOM based selector for well formed documents
+    const char *selectors[] = { "div.article > p a[href]", "div.article p a[href]",
+        "DIV A[HREF^='/']", "a[href$=\"/\"], a[name]", "[lang|=en]", "#a1 section a, .other a",
+        "p > a, div a", "*", "#missing a", "div div" };
+    for (size_t i = 0; i < sizeof(selectors) / sizeof(selectors[0]); ++i)
+    {
+        Spans expected;
+        std::vector<Tree::iterator> found = Selector(selectors[i]).select(domTree);
+        for (size_t j = 0; j < found.size(); ++j)
+            expected.push_back(std::make_pair(found[j]->offset(), found[j]->length()));
+        REQUIRE(stream(selectors[i], html) == expected);
+    }
+
+    // Inner elements are reported first, unclosed ones with their opening tag
+    std::vector<std::string> order;
+    const std::string nested("<b><i>x</i><br><i>y</b>");
+    SelectorSax matcher("b, i, br", [&](size_t offset, size_t length)
+    {
+        order.push_back(nested.substr(offset, length));
+    });
+    matcher.parse(nested);
+    REQUIRE(order == std::vector<std::string>({ "<i>x</i>", "<br>", "<i>", "<b><i>x</i><br><i>y</b>" }));
+
+    // Void elements are not parents of what follows them, and are not kept
+    const std::string media("<div><img src=a.png><p>x<br>y</p><input><hr></div><br><p>z</p>");
+    ParserDom mediaParser;
+    const Tree &mediaTree = mediaParser.parseTree(media);
+    const char *mediaSelectors[] = { "div > p", "div > img", "img p", "br", "p br", "div > hr" };
+    for (size_t i = 0; i < sizeof(mediaSelectors) / sizeof(mediaSelectors[0]); ++i)
+    {
+        Spans expected;
+        std::vector<Tree::iterator> found = Selector(mediaSelectors[i]).select(mediaTree);
+        for (size_t j = 0; j < found.size(); ++j)
+            expected.push_back(std::make_pair(found[j]->offset(), found[j]->length()));
+        REQUIRE(stream(mediaSelectors[i], media) == expected);
+    }
+    struct DepthProbe : public SelectorSax
+    {
+        DepthProbe() : SelectorSax("p"), deepest(0) { }
+        void onFoundTag(Node &node, bool isClosingTag)
+        {
+            SelectorSax::onFoundTag(node, isClosingTag);
+            deepest = std::max(deepest, open_.size());
+        }
+        size_t deepest;
+    } probe;
+    std::string flat;
+    for (int i = 0; i < 1000; ++i)
+        flat += "<br><img src=x>";
+    probe.parse("<div>" + flat + "</div>");
+    REQUIRE(probe.deepest == 1);
+
+    REQUIRE_THROWS_AS(SelectorSax("h1 + p"), const std::invalid_argument&);
+    REQUIRE_THROWS_AS(SelectorSax("li:first-child"), const std::invalid_argument&);
+    REQUIRE_THROWS_AS(SelectorSax("a["), const std::invalid_argument&);
+}
+
+TEST_CASE("extraction plan")
+{
+    std::string html(
+R"(<html><head><title>A &amp; B</title>
+<meta name="description" content="About A">
+<meta property="og:title" content="A"><meta property="og:image" content="/a.png">
+<link rel="stylesheet" href="/s.css"><link REL=canonical HREF="http://a/">
+</head><body><div><div>x</div>y</div>
+<a href="/one">one</a> <a>none</a> <a href=/two>two</a><img src="/i.png" alt>
+</body></html>)");
+
+    std::vector<std::string> found;
+    auto collect = [&](const std::string &prefix)
+    {
+        return [&found, prefix](const Node &, const std::string &value)
+        {
+            found.push_back(prefix + value);
+        };
+    };
+    ExtractionPlan plan;
+    plan.add("title", "", collect("title:"))
+        .add("meta[name=description]", "content", collect("description:"))
+        .add("meta[property^='og:']", "content", collect("og:"))
+        .add("link[rel=canonical]", "href", collect("canonical:"))
+        .add("a", "href", collect("a:"))
+        .add("img", "SRC", collect("img:"))
+        .add("*", "alt", collect("alt:"))
+        .add("div", "", collect("div:"));
+    REQUIRE(plan.size() == 8);
+
+    plan.run(html);
+    REQUIRE(found == std::vector<std::string>({ "title:A &amp; B", "description:About A",
+        "og:A", "og:/a.png", "canonical:http://a/", "div:x", "div:xy", "a:/one", "a:/two",
+        "img:/i.png", "alt:" }));
+
+    // The same as with the tree and Node::attribute()
+    ParserDom parser;
+    const Tree &domTree = parser.parseTree(html);
+    std::vector<std::string> hrefs;
+    for (Tree::iterator it = domTree.begin(); it != domTree.end(); ++it)
+    {
+        if (it->tagName() != "a")
+            continue;
+        it->parseAttributes();
+        std::string href;
+        if (it->attribute("href", href))
+            hrefs.push_back("a:" + href);
+    }
+    REQUIRE(hrefs == std::vector<std::string>({ "a:/one", "a:/two" }));
+
+    // Unclosed texts end with the document
+    found.clear();
+    plan.run("<title>open");
+    REQUIRE(found == std::vector<std::string>({ "title:open" }));
+
+    // Closing tags end the texts of the elements left open inside of them
+    found.clear();
+    ExtractionPlan texts;
+    texts.add("title", "", collect("title:"))
+        .add("p", "", collect("p:"))
+        .add("br", "", collect("br:"));
+    texts.run("<head><title>T</head><body><div><p>hello<br>there</div>world</p> and more</body>");
+    REQUIRE(found == std::vector<std::string>({ "title:T", "br:", "p:hellothere" }));
+
+    REQUIRE_THROWS_AS(plan.add("head > title", "", collect("")), const std::invalid_argument&);
+    REQUIRE_THROWS_AS(plan.add("a:first-child", "href", collect("")), const std::invalid_argument&);
+}
+
+TEST_CASE("link extractor")
+{
+    // RFC 3986 5.4
+    const char *examples[][2] =
+    {
+        { "g:h", "g:h" }, { "g", "http://a/b/c/g" }, { "./g", "http://a/b/c/g" },
+        { "g/", "http://a/b/c/g/" }, { "/g", "http://a/g" }, { "//g", "http://g" },
+        { "?y", "http://a/b/c/d;p?y" }, { "g?y", "http://a/b/c/g?y" },
+        { "#s", "http://a/b/c/d;p?q#s" }, { "g#s", "http://a/b/c/g#s" },
+        { "g?y#s", "http://a/b/c/g?y#s" }, { ";x", "http://a/b/c/;x" },
+        { "g;x", "http://a/b/c/g;x" }, { "", "http://a/b/c/d;p?q" }, { ".", "http://a/b/c/" },
+        { "./", "http://a/b/c/" }, { "..", "http://a/b/" }, { "../", "http://a/b/" },
+        { "../g", "http://a/b/g" }, { "../..", "http://a/" }, { "../../", "http://a/" },
+        { "../../g", "http://a/g" }, { "../../../g", "http://a/g" },
+        { "../../../../g", "http://a/g" }, { "/./g", "http://a/g" }, { "/../g", "http://a/g" },
+        { "g.", "http://a/b/c/g." }, { ".g", "http://a/b/c/.g" }, { "g..", "http://a/b/c/g.." },
+        { "..g", "http://a/b/c/..g" }, { "./../g", "http://a/b/g" }, { "./g/.", "http://a/b/c/g/" },
+        { "g/./h", "http://a/b/c/g/h" }, { "g/../h", "http://a/b/c/h" },
+        { "g;x=1/./y", "http://a/b/c/g;x=1/y" }, { "g;x=1/../y", "http://a/b/c/y" },
+        { "g?y/./x", "http://a/b/c/g?y/./x" }, { "g#s/../x", "http://a/b/c/g#s/../x" }
+    };
+    const std::string base("http://a/b/c/d;p?q");
+    std::string url, scratch;
+    for (size_t i = 0; i < sizeof(examples) / sizeof(examples[0]); ++i)
+    {
+        const char *ref = examples[i][0];
+        htmlcxx2::HTML::impl::resolveUrl(base, ref, ref + strlen(ref), url, scratch);
+        REQUIRE(url == examples[i][1]);
+    }
+    htmlcxx2::HTML::impl::resolveUrl("http://a", "g", "g" + 1, url, scratch);
+    REQUIRE(url == "http://a/g");
+
+    std::string html(
+R"(<html><head><link rel=stylesheet href="/s.css"><base href="sub/"><BASE href="/ignored/">
+<script src="app.js?a=1&amp;b=2"></script></head>
+<body><a href="p.html">p</a><a name="x">no link</a><a href=" ../up.html#top ">up</a>
+<img alt="i" src="i.png" srcset="i-1x.png 1x, data:a,b 2x,i,j.png, big.png 640w">
+<area href="http://other/"><iframe src=""></iframe><p src="not/a/link">
+<a href='q&#x3F;x&amp;y&lt;'>q</a></body></html>)");
+
+    std::vector<std::string> found;
+    LinkExtractor extractor([&](const LinkExtractor::Link &link)
+    {
+        found.push_back(std::string(link.tagName) + " " + link.attribute + " " + *link.url);
+        // Spans point into the document
+        REQUIRE(html.compare(link.offset, link.end - link.begin, link.begin, link.end - link.begin) == 0);
+    });
+    extractor.extract(html, "http://host/dir/index.html");
+    REQUIRE(extractor.baseUrl() == "http://host/dir/sub/");
+    REQUIRE(found == std::vector<std::string>({
+        "link href http://host/s.css",
+        "script src http://host/dir/sub/app.js?a=1&b=2",
+        "a href http://host/dir/sub/p.html",
+        "a href http://host/dir/up.html#top",
+        "img src http://host/dir/sub/i.png",
+        "img srcset http://host/dir/sub/i-1x.png",
+        "img srcset data:a,b",
+        "img srcset http://host/dir/sub/i,j.png",
+        "img srcset http://host/dir/sub/big.png",
+        "area href http://other/",
+        "iframe src http://host/dir/sub/",
+        "a href http://host/dir/sub/q?x&y<" }));
+
+    // Without a document URL relative links stay relative
+    found.clear();
+    LinkExtractor relative([&](const LinkExtractor::Link &link) { found.push_back(*link.url); });
+    relative.extract("<a href=a.html>a</a><a href=/b.html>b</a>");
+    REQUIRE(found == std::vector<std::string>({ "a.html", "/b.html" }));
+
+    // Text and comments are skipped, not turned into nodes
+    struct TextProbe : public LinkExtractor
+    {
+        TextProbe() : texts(0) { }
+        void onFoundText(Node&) { ++texts; }
+        void onFoundComment(Node&) { ++texts; }
+        size_t texts;
+    } probe;
+    probe.extract(html);
+    REQUIRE(probe.texts == 0);
+}
+
+TEST_CASE("snapshot")
+{
+    std::string html(
+R"(<html><head><title>T</title></head>
+<body class="main" data-x = 'y z' hidden><p>One<br>two</p><!-- note -->
+<ul><li>a<li>b</ul></span><div id=d>text</DIV></body></html>)");
+    ParserDom parser;
+    const Tree &domTree = parser.parseTree(html);
+
+    const std::string data = Snapshot::write(domTree, true);
+    // Aligned copy, as a mapping would be
+    std::vector<uint64_t> aligned((data.length() + 7) / 8);
+    memcpy(&aligned[0], data.data(), data.length());
+    Snapshot snapshot(&aligned[0], data.length());
+    REQUIRE(snapshot.size() == domTree.size());
+    REQUIRE(snapshot.sourceLength() == html.length());
+    REQUIRE(snapshot.hasAttributes());
+    requireSameTree(snapshot.toTree(html), domTree);
+
+    // Same navigation as the tree
+    Tree::iterator it = domTree.begin();
+    for (Snapshot::iterator sit = snapshot.begin(); sit != snapshot.end(); ++sit, ++it)
+    {
+        REQUIRE(snapshot.tagName(*sit) == it->tagName());
+        REQUIRE(sit->offset == it->offset());
+        REQUIRE(static_cast<bool>(sit.parent()) == static_cast<bool>(Tree::parent(it)));
+        if (sit.parent())
+            REQUIRE(sit.parent()->offset == Tree::parent(it)->offset());
+        size_t children = 0;
+        for (Snapshot::sibling_iterator child = sit.begin(); child != sit.end(); ++child)
+            ++children;
+        REQUIRE(children == domTree.number_of_children(it));
+
+        // Attribute spans are those of parseAttributes()
+        Node node = *it;
+        if (node.isTag())
+            node.parseAttributes();
+        std::vector<std::string> keys, values;
+        for (const SnapshotAttribute *a = snapshot.attributesBegin(*sit); a != snapshot.attributesEnd(*sit); ++a)
+        {
+            keys.push_back(htmlcxx2::HTML::impl::toLower(html.substr(a->keyOffset, a->keyLength)));
+            values.push_back(html.substr(a->valueOffset, a->valueLength));
+        }
+        REQUIRE(keys == node.attributeKeys());
+        REQUIRE(values == node.attributeValues());
+    }
+    REQUIRE(it == domTree.end());
+
+    // Through a file mapping
+    const std::string path("htmlcxx2_snapshot_test.bin");
+    FILE *file = fopen(path.c_str(), "wb");
+    REQUIRE(file);
+    fwrite(data.data(), 1, data.length(), file);
+    fclose(file);
+    {
+        MappedFile mapped(path);
+        Snapshot fromFile(mapped.data(), mapped.size());
+        requireSameTree(fromFile.toTree(html), domTree);
+    }
+    remove(path.c_str());
+    REQUIRE_THROWS_AS(MappedFile("htmlcxx2_no_such_file"), const std::runtime_error&);
+
+    // Damaged snapshots are refused
+    REQUIRE_THROWS_AS(Snapshot(&aligned[0], data.length() - 1), const std::runtime_error&);
+    reinterpret_cast<SnapshotNode*>(reinterpret_cast<char*>(&aligned[0]) + sizeof(SnapshotHeader))[2].parent = 7;
+    REQUIRE_THROWS_AS(Snapshot(&aligned[0], data.length()), const std::runtime_error&);
+    aligned[0] = 0;
+    REQUIRE_THROWS_AS(Snapshot(&aligned[0], data.length()), const std::runtime_error&);
+    REQUIRE_THROWS_AS(snapshot.toTree("other"), const std::invalid_argument&);
+}
+
+TEST_CASE("parse cache")
+{
+    // Moving a tree keeps its nodes
+    {
+        ParserDom parser;
+        Tree copy = parser.parseTree("<a><b>x</b></a>");
+        Tree moved(std::move(copy));
+        REQUIRE(copy.empty());
+        REQUIRE(moved.size() == 4);
+        copy = std::move(moved);
+        REQUIRE(moved.empty());
+        requireSameTree(copy, parser.parseTree("<a><b>x</b></a>"));
+    }
+
+    ParseCache cache(4);
+    const std::string page("<html><body><p>Parked domain</p></body></html>");
+    ParseCache::TreePtr first = cache.parse(page);
+    REQUIRE(cache.misses() == 1);
+    ParserDom parser;
+    requireSameTree(*first, parser.parseTree(page));
+
+    // Byte identical documents share the tree
+    REQUIRE(cache.parse(std::string(page)) == first);
+    REQUIRE(cache.find(page) == first);
+    REQUIRE(cache.hits() == 1);
+    REQUIRE_FALSE(cache.find(page + " "));
+    REQUIRE(cache.size() == 1);
+
+    // Bounded, and evicted trees stay usable
+    for (int i = 0; i < 20; ++i)
+        cache.parse("<p>" + std::to_string(i) + "</p>");
+    REQUIRE(cache.size() <= 4);
+    REQUIRE(first->size() == 5);
+    cache.clear();
+    REQUIRE(cache.size() == 0);
+
+    // Used entries get a second chance
+    ParseCache single(1);
+    ParseCache::TreePtr kept = single.parse(page);
+    single.parse(page);
+    single.parse("<p>other</p>");
+    REQUIRE(single.size() == 1);
+    REQUIRE(single.find("<p>other</p>"));
+
+    // Byte bound
+    ParseCache small(100, 64);
+    small.parse(std::string(100, 'x'));
+    REQUIRE(small.size() == 0);
+    for (int i = 0; i < 10; ++i)
+        small.parse("<b>" + std::to_string(i) + "</b>");
+    REQUIRE(small.size() * 8 <= 64);
+
+    // Concurrent use
+    ParseCache shared(8);
+    std::vector<std::thread> workers;
+    std::atomic<int> failures(0);
+    for (int t = 0; t < 8; ++t)
+    {
+        workers.push_back(std::thread([&shared, &failures, t]()
+        {
+            for (int i = 0; i < 200; ++i)
+            {
+                const std::string html = "<div><p>" + std::to_string((i * 7 + t) % 12) + "</p></div>";
+                ParseCache::TreePtr tree = shared.parse(html);
+                if (tree->size() != 4 || tree->begin()->length() != html.length())
+                    ++failures;
+            }
+        }));
+    }
+    for (size_t i = 0; i < workers.size(); ++i)
+        workers[i].join();
+    REQUIRE(failures == 0);
+    REQUIRE(shared.hits() + shared.misses() == 1600);
+    REQUIRE(shared.size() <= 8);
+}
+
+TEST_CASE("incremental parse")
+{
+    std::string html(
+R"(<html><head><title>Doc</title><script>var a = "<div>";</script></head>
+<body><div id="main"><p>First <b>bold</b> paragraph</p>
+<ul><li>one<li>two</ul><!-- comment -->
+<div class="x"><span>deep <i>text</i></span></div><br><img src="a.png">
+<p>Unclosed <em>em</p><textarea><b>raw</b></textarea></div>
+<section><p>Last</p></section></body></html>)");
+    ParserDomIncremental parser;
+    parser.setTagIndex(true);
+    parser.setCachedCounts(true);
+    parser.parseTree(html);
+    ParserDom reference;
+
+    // A small edit only reparses its element
+    size_t offset = html.find("deep");
+    html.replace(offset, 4, "shallow");
+    requireSameTree(parser.update(html, offset, 4, 7), reference.parseTree(html));
+    REQUIRE(parser.reparsedLength() < 40);
+    REQUIRE(parser.tagIndex().find("i").size() == 1);
+    REQUIRE(parser.tagIndex().find("i")[0]->offset() == html.find("<i>"));
+
+    // A quote without a match up to the end of the document leaves its tag at
+    // the next '>': one added anywhere later changes the tag
+    ParserDomIncremental quoted;
+    std::string unmatched("<html><body><a href=\"x\"><span class='q\"<style>><br></a>"
+        "<div><p>some text</p></div></body></html>");
+    quoted.parseTree(unmatched);
+    offset = unmatched.find("some");
+    unmatched.replace(offset, 4, "it's");
+    requireSameTree(quoted.update(unmatched, offset, 4, 4), reference.parseTree(unmatched));
+
+    const char *fragments[] = { "x", " ", "<b>", "</b>", "<div>", "</div>", "</p>", "<p>",
+        "<!--", "-->", "<script>", "</script>", "<", ">", "\"", "'", "&amp;", "</", "<li>",
+        "</span>", "</html>", "<i>t</i>", "</textarea>", "<span class='q\">'>", "<a title=\"q'>",
+        "class='q\"" };
+    unsigned seed = 12345;
+    auto random = [&seed](size_t n)
+    {
+        seed = seed * 1103515245u + 12345u;
+        return n ? (seed >> 8) % n : 0;
+    };
+    ParserDom indexed;
+    indexed.setTagIndex(true);
+    auto requireSameIndex = [&]()
+    {
+        indexed.parseTree(html);
+        const char *names[] = { "html", "head", "title", "script", "body", "div", "p", "b", "ul",
+            "li", "span", "i", "br", "img", "em", "textarea", "section", "a" };
+        for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i)
+        {
+            const TagIndex::Nodes &lhs = parser.tagIndex().find(names[i]);
+            const TagIndex::Nodes &rhs = indexed.tagIndex().find(names[i]);
+            REQUIRE(lhs.size() == rhs.size());
+            for (size_t j = 0; j < lhs.size(); ++j)
+                REQUIRE(lhs[j]->offset() == rhs[j]->offset());
+        }
+    };
+    for (int i = 0; i < 600; ++i)
+    {
+        if (i % 20 == 0)
+            requireSameIndex();
+        const size_t at = random(html.length() + 1);
+        const size_t removed = std::min(random(6), html.length() - at);
+        const std::string inserted = random(3) ? fragments[random(sizeof(fragments) / sizeof(fragments[0]))] : "";
+        html.replace(at, removed, inserted);
+        const Tree &updated = parser.update(html, at, removed, inserted.length());
+        requireSameTree(updated, reference.parseTree(html));
+        REQUIRE(updated.begin()->length() == html.length());
+
+        // Keep the document from growing without bounds
+        if (html.length() > 2000)
+        {
+            html.erase(1000, 500);
+            requireSameTree(parser.update(html, 1000, 500, 0), reference.parseTree(html));
+        }
+    }
+
+    // Tag index and counts are kept
+    requireSameIndex();
+    REQUIRE(parser.root().size() == reference.parseTree(html).size());
+
+    REQUIRE_THROWS_AS(parser.update(html, html.length() + 1, 0, 0), const std::invalid_argument&);
+    REQUIRE_THROWS_AS(parser.update(html, 0, 1, 2), const std::invalid_argument&);
+}
+
+TEST_CASE("parse timing")
+{
+    std::string html("<html><body>");
+    for (int i = 0; i < 2000; ++i)
+        html += "<div class=\"item\"><p>Text <b>bold</p><script>var x = 1;</script></div>\n";
+    html += "</body></html>";
+
+    ParserDom parser;
+    parser.parseTree(html);
+    REQUIRE(parser.times().total == 0);
+    REQUIRE(parser.times().phases[ParserTimes::PHASE_SCAN] == 0);
+
+    parser.setTiming(true);
+    parser.parseTree(html);
+    const ParserTimes &times = parser.times();
+    REQUIRE(times.total > 0);
+    uint64_t sum = 0;
+    for (int i = 0; i < ParserTimes::PHASES; ++i)
+        sum += times.phases[i];
+    REQUIRE(sum <= times.total);
+    REQUIRE(sum + ParserTimes::PHASES >= times.total);
+    REQUIRE(times.phases[ParserTimes::PHASE_NODES] > 0);
+    REQUIRE(times.phases[ParserTimes::PHASE_INSERT] > 0);
+    REQUIRE(times.phases[ParserTimes::PHASE_CLOSING] > 0);
+    REQUIRE(times.phases[ParserTimes::PHASE_HANDLERS] < times.total);
+
+    ParserDomParallel parallel(2, 4096);
+    parallel.setTiming(true);
+    requireSameTree(parallel.parseTree(html), parser.parseTree(html));
+    REQUIRE(parallel.times().total > 0);
+    REQUIRE(parallel.times().phases[ParserTimes::PHASE_INSERT] > 0);
+
+    ParseTrace trace(3);
+    REQUIRE(trace.sample());
+    REQUIRE(!trace.sample());
+    REQUIRE(!trace.sample());
+    REQUIRE(trace.sample());
+    REQUIRE(!ParseTrace(0).sample());
+
+    trace.add("http://example.com/a", parser.times());
+    trace.add("say \"hi\", twice", parallel.times());
+    REQUIRE(trace.size() == 2);
+
+    const std::string csv = trace.toCsv();
+    REQUIRE(csv.find("document,thread,total_us,scan_us,nodes_us,handlers_us,insert_us,closing_us\n") == 0);
+    REQUIRE(csv.find("\nhttp://example.com/a,1,") != std::string::npos);
+    REQUIRE(csv.find("\n\"say \"\"hi\"\", twice\",1,") != std::string::npos);
+    REQUIRE(std::count(csv.begin(), csv.end(), '\n') == 3);
+
+    const std::string json = trace.toChromeTrace();
+    REQUIRE(json.find("{\"traceEvents\":[") == 0);
+    REQUIRE(json.find("{\"name\":\"http://example.com/a\",\"cat\":\"htmlcxx2\",\"ph\":\"X\",\"ts\":") != std::string::npos);
+    REQUIRE(json.find("\"say \\\"hi\\\", twice\"") != std::string::npos);
+    REQUIRE(json.find("{\"name\":\"closing\"") != std::string::npos);
+
+    trace.clear();
+    REQUIRE(trace.size() == 0);
+}
+
+TEST_CASE("charset")
+{
+    REQUIRE(sniffCharset(std::string("\xff\xfe<\0", 4), "text/html; charset=windows-1251") == CHARSET_UTF16LE);
+    REQUIRE(sniffCharset(std::string("\xfe\xff\0<", 4)) == CHARSET_UTF16BE);
+    REQUIRE(sniffCharset("\xef\xbb\xbf<p>", "text/html; charset=windows-1251") == CHARSET_UTF8);
+    REQUIRE(sniffCharset("<p>", "text/html; charset=\"Windows-1251\"") == CHARSET_WINDOWS1251);
+    REQUIRE(sniffCharset("<meta charset=shift_jis>", "text/html") == CHARSET_SHIFT_JIS);
+    REQUIRE(sniffCharset("<head><META CHARSET='latin1'>") == CHARSET_WINDOWS1252);
+    REQUIRE(sniffCharset("<meta http-equiv=\"Content-Type\" content=\"text/html; charset=cp1251\">")
+            == CHARSET_WINDOWS1251);
+    REQUIRE(sniffCharset("<meta content=\"text/html; charset=cp1251\">") == CHARSET_UTF8);
+    REQUIRE(sniffCharset("<!-- <meta charset=cp1251> --><p>") == CHARSET_UTF8);
+    REQUIRE(sniffCharset("<meta charset=utf-16>") == CHARSET_UTF8);
+    REQUIRE(sniffCharset("<meta charset=nonsense><meta charset=cp1251>") == CHARSET_WINDOWS1251);
+    REQUIRE(sniffCharset(std::string(2000, ' ') + "<meta charset=cp1251>") == CHARSET_UTF8);
+    REQUIRE(charsetFromLabel(" UTF8\n") == CHARSET_UTF8);
+    REQUIRE(charsetFromLabel("koi8-r") == CHARSET_UNKNOWN);
+    REQUIRE_THROWS_AS(Decoder decoder(CHARSET_UNKNOWN), const std::invalid_argument&);
+
+    std::string buffer;
+    const std::string utf8 = "<p>caf\xc3\xa9</p>";
+    REQUIRE(&toUtf8(utf8, CHARSET_UTF8, buffer) == &utf8);
+    REQUIRE(toUtf8("\xef\xbb\xbf<p>", CHARSET_UTF8, buffer) == "<p>");
+    REQUIRE(toUtf8("<p>\xcf\xf0\xe8\xe2\xe5\xf2 \x80</p>", CHARSET_WINDOWS1251, buffer)
+            == "<p>\xd0\x9f\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82 \xd0\x82</p>");
+    REQUIRE(toUtf8("<p>caf\xe9 \x80</p>", CHARSET_WINDOWS1252, buffer) == "<p>caf\xc3\xa9 \xe2\x82\xac</p>");
+
+    // Shift_JIS: kanji, half-width katakana, a user defined character, a
+    // backslash, a lead byte whose ASCII trail is decoded again, an invalid
+    // byte and a lead byte at the end
+    OffsetMap sjisOffsets;
+    const std::string sjis = "<p>\x93\xfa\x96\x7b\x8c\xea\xb1\xf0\x40\\\x81 \xa0</p>\x88";
+    const std::string fromSjis = "<p>\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e\xef\xbd\xb1\xee\x80\x80\\"
+        "\xef\xbf\xbd \xef\xbf\xbd</p>\xef\xbf\xbd";
+    REQUIRE(toUtf8(sjis, CHARSET_SHIFT_JIS, buffer, &sjisOffsets) == fromSjis);
+    REQUIRE(toUtf8("\x82\xa0\x83\x41\x87\x40\xfa\x40\x81\x7f", CHARSET_SHIFT_JIS, buffer)
+            == "\xe3\x81\x82\xe3\x82\xa2\xe2\x91\xa0\xe2\x85\xb0\xef\xbf\xbd\x7f");
+    for (size_t chunk = 1; chunk < 4; ++chunk)
+    {
+        Decoder decoder(CHARSET_SHIFT_JIS);
+        std::string decoded;
+        for (size_t i = 0; i < sjis.length(); i += chunk)
+            decoder.decode(sjis.data() + i, std::min(chunk, sjis.length() - i), decoded);
+        decoder.finish(decoded);
+        REQUIRE(decoded == fromSjis);
+    }
+    REQUIRE(sjisOffsets.toInput(6) == 5);
+    REQUIRE(sjisOffsets.toInput(7) == 5);
+    REQUIRE(sjisOffsets.toInput(12) == 9);
+    REQUIRE(sjisOffsets.toInput(15) == 10);
+    REQUIRE(sjisOffsets.toInput(19) == 13);
+    REQUIRE(sjisOffsets.toOutput(10) == 15);
+    REQUIRE(sjisOffsets.toOutput(13) == 19);
+    REQUIRE(sjisOffsets.toOutput(sjis.length()) == fromSjis.length());
+
+    // UTF-16LE with a byte order mark, long ASCII runs, a euro sign, a
+    // surrogate pair and a lone surrogate
+    std::string ascii = "<html><body><div class=\"text\">";
+    for (int i = 0; i < 20; ++i)
+        ascii += "Some ASCII text ";
+    std::string utf16("\xff\xfe", 2), expected;
+    for (size_t i = 0; i < ascii.length(); ++i)
+        utf16 += std::string(1, ascii[i]) + '\0';
+    expected = ascii;
+    utf16 += std::string("\xac\x20\x3d\xd8\x00\xde\x00\xd8", 8);
+    expected += "\xe2\x82\xac\xf0\x9f\x98\x80\xef\xbf\xbd";
+    for (size_t i = 0; i < 6; ++i)
+        utf16 += std::string(1, "</div>"[i]) + '\0';
+    expected += "</div>";
+    utf16 += '<';
+
+    OffsetMap offsets;
+    REQUIRE(toUtf8(utf16, CHARSET_UTF16LE, buffer, &offsets) == expected + "\xef\xbf\xbd");
+    for (size_t chunk = 1; chunk < 10; ++chunk)
+    {
+        Decoder decoder(CHARSET_UTF16LE);
+        std::string decoded;
+        for (size_t i = 0; i < utf16.length(); i += chunk)
+            decoder.decode(utf16.data() + i, std::min(chunk, utf16.length() - i), decoded);
+        decoder.finish(decoded);
+        REQUIRE(decoded == buffer);
+        REQUIRE(decoder.offsets().toInput(expected.length()) == offsets.toInput(expected.length()));
+    }
+    REQUIRE(offsets.toInput(0) == 2);
+    REQUIRE(offsets.toInput(ascii.length()) == 2 + 2 * ascii.length());
+    REQUIRE(offsets.toInput(ascii.length() + 1) == 2 + 2 * ascii.length());
+    REQUIRE(offsets.toInput(ascii.length() + 3) == 4 + 2 * ascii.length());
+    REQUIRE(offsets.toInput(ascii.length() + 7) == 8 + 2 * ascii.length());
+    REQUIRE(offsets.toOutput(8 + 2 * ascii.length()) == ascii.length() + 7);
+    REQUIRE(offsets.toOutput(0) == 0);
+    REQUIRE(offsets.toOutput(2) == 0);
+    REQUIRE(offsets.toOutput(utf16.length()) == buffer.length());
+    for (size_t i = 0; i < ascii.length(); ++i)
+        REQUIRE(offsets.toOutput(offsets.toInput(i)) == i);
+
+    ParserDom parser;
+    Tree tree = parser.parseTree(buffer);
+    offsets.toInput(tree);
+    Tree::iterator div = tree.begin();
+    while (div->tagName() != "div")
+        ++div;
+    REQUIRE(div->offset() == 2 + 2 * 12);
+    REQUIRE(div->offset() + div->length() == utf16.length() - 1);
+    // The byte order mark is before everything
+    REQUIRE(tree.begin()->offset() == 2);
+    REQUIRE(tree.begin()->offset() + tree.begin()->length() == utf16.length());
+}
+
+TEST_CASE("utf-8 validation")
+{
+    const size_t npos = std::string::npos;
+    REQUIRE(impl::findInvalidUtf8("", 0) == npos);
+    const std::string valid = "ASCII, caf\xc3\xa9, \xe2\x82\xac, \xf0\x9f\x98\x80, \xf4\x8f\xbf\xbf and more ASCII";
+    REQUIRE(impl::findInvalidUtf8(valid.data(), valid.length()) == npos);
+    const char *invalid[] = { "\x80", "\xc0\x80", "\xc1\xbf", "\xe0\x80\x80", "\xed\xa0\x80",
+        "\xf0\x80\x80\x80", "\xf4\x90\x80\x80", "\xf5\x80\x80\x80", "\xc3", "\xe2\x82", "\xe2\x82(",
+        "\xf0\x9f\x98", "\xff" };
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); ++i)
+    {
+        const std::string text = "Long enough for a word or two" + std::string(invalid[i]) + "!";
+        REQUIRE(impl::findInvalidUtf8(text.data(), text.length()) == 29);
+        REQUIRE(impl::findInvalidUtf8(text.data(), 29) == npos);
+    }
+
+    const std::string html = "<p title=\"caf\xe9\">ok \xff text</p><!-- caf\xc3\xa9 --><b>caf\xc3\xa9</b>";
+    ParserDom parser;
+    Tree tree = parser.parseTree(html);
+    for (Tree::iterator it = tree.begin(); it != tree.end(); ++it)
+        REQUIRE(it->invalidUtf8() == npos);
+
+    parser.setValidateUtf8(true);
+    tree = parser.parseTree(html);
+    std::vector<size_t> found;
+    for (Tree::iterator it = tree.begin(); it != tree.end(); ++it)
+        found.push_back(it->invalidUtf8());
+    const size_t expected[] = { npos, 13, 3, npos, npos, npos };
+    REQUIRE(found == std::vector<size_t>(expected, expected + 6));
+
+    std::string big;
+    for (int i = 0; i < 2000; ++i)
+        big += i % 7 ? "<li>caf\xc3\xa9 <a href=\"/\">link</a></li>\n" : "<li>caf\xe9 <a href=\"/\xff\">link</a></li>\n";
+    ParserDomParallel parallel(4, 4096);
+    parallel.setValidateUtf8(true);
+    const Tree &parallelTree = parallel.parseTree(big);
+    tree = parser.parseTree(big);
+    Tree::iterator it = tree.begin(), pit = parallelTree.begin();
+    for (; it != tree.end(); ++it, ++pit)
+        REQUIRE(it->invalidUtf8() == pit->invalidUtf8());
+    // Not counted without HTMLCXX2_STATS
+    REQUIRE(parser.stats().invalidUtf8 == 0);
+    REQUIRE(parallel.stats().invalidUtf8 == 0);
+
+    std::string text = "a\xf1\x80\x80\xe1\x80\xc2" "b\x80" "c\x80\xbf" "d";
+    REQUIRE(repairUtf8(text) == 6);
+    REQUIRE(text == "a\xef\xbf\xbd\xef\xbf\xbd\xef\xbf\xbd" "b\xef\xbf\xbd" "c\xef\xbf\xbd\xef\xbf\xbd" "d");
+    REQUIRE(repairUtf8(text) == 0);
+    text = "caf\xc3\xa9 \xe2\x82";
+    REQUIRE(repairUtf8(text, impl::findInvalidUtf8(text.data(), text.length())) == 1);
+    REQUIRE(text == "caf\xc3\xa9 \xef\xbf\xbd");
+    REQUIRE(repairUtf8(text, text.length()) == 0);
+}
+
+template <typename String>
+static String wideOf(const std::string &utf8)
+{
+    String wide;
+    for (size_t i = 0; i < utf8.length(); )
+    {
+        const unsigned char c = static_cast<unsigned char>(utf8[i]);
+        const size_t n = c < 0x80 ? 0 : c < 0xe0 ? 1 : c < 0xf0 ? 2 : 3;
+        uint32_t code = n ? c & (0x3f >> n) : c;
+        for (size_t j = 1; j <= n; ++j)
+            code = (code << 6) | (static_cast<unsigned char>(utf8[i + j]) & 0x3f);
+        i += n + 1;
+        if (code >= 0x10000 && sizeof(typename String::value_type) == 2)
+        {
+            wide += static_cast<typename String::value_type>(0xd800 + ((code - 0x10000) >> 10));
+            code = 0xdc00 + ((code - 0x10000) & 0x3ff);
+        }
+        wide += static_cast<typename String::value_type>(code);
+    }
+    return wide;
+}
+
+TEST_CASE("wide documents")
+{
+    std::string html = "<html><head><title>Caf\xc3\xa9 \xe2\x82\xac</title>"
+        "<script>if (a <b && c > d) document.write('</p>');</SCRIPT >"
+        "<style>p { content: \"\xf0\x9f\x98\x80\"; }</style></head>"
+        "<body><!-- comment --><?xml version='1.0'?>"
+        "<p title=\"a > b\" data-x='\xd0\xbf\xd1\x80\xd0\xb8 > \xf0\x9f\x98\x80' id=x>"
+        "<\xc3\xa9 not a tag> 1 < 2 \xf0\x9f\x98\x80</p></e\xcc\x81><br/>";
+    for (int i = 0; i < 50; ++i)
+        html += "<a href=\"/some/long/path/to/a/page.html?with=query&and=more\" title='\xe2\x80\x94'>link</a>\n";
+    html += "</body></html>";
+
+    ParserDom utf8Parser;
+    const Tree &expected = utf8Parser.parseTree(html);
+
+    ParserDom parser;
+    requireSameTree(parser.parseTree(wideOf<std::u16string>(html)), expected);
+    requireSameTree(parser.parseTree(wideOf<std::wstring>(html)), expected);
+
+    // And so do the other parsers
+    ParserDomParallel parallel(4, 64);
+    requireSameTree(parallel.parseTree(wideOf<std::u16string>(html)), expected);
+    requireSameTree(parallel.parseTree(wideOf<std::wstring>(html)), expected);
+    ParserDomLazy lazy(2);
+    lazy.parseTree(wideOf<std::u16string>(html));
+    requireSameTree(lazy.expandAll(), expected);
+    lazy.parseTree(wideOf<std::wstring>(html));
+    requireSameTree(lazy.expandAll(), expected);
+    ParserDomIncremental incremental;
+    incremental.parseTree(wideOf<std::u16string>(html));
+    REQUIRE(incremental.reparsedLength() == html.length());
+    std::string edited(html);
+    edited.insert(html.find("link"), "<b>bold</b>");
+    ParserDom editedParser;
+    requireSameTree(incremental.update(edited, html.find("link"), 0, 11),
+            editedParser.parseTree(edited));
+    requireSameTree(incremental.parseTree(wideOf<std::wstring>(html)), expected);
+
+    // Unpaired surrogates become U+FFFD
+    std::u16string broken = u"<p>a";
+    broken += static_cast<char16_t>(0xd800);
+    broken += u"b";
+    broken += static_cast<char16_t>(0xdc00);
+    broken += u"</p>";
+    broken += static_cast<char16_t>(0xd83d);
+    const Tree &tree = parser.parseTree(broken);
+    Tree::iterator it = tree.begin();
+    ++it;
+    ++it;
+    REQUIRE(it->text() == "a\xef\xbf\xbd" "b\xef\xbf\xbd");
+    it.skip_children();
+    ++it;
+    REQUIRE(it->text() == "\xef\xbf\xbd");
+    REQUIRE(tree.begin()->length() == 18);
+
+    const char16_t quoted[] = u"0123456789\"abcdef";
+    for (size_t i = 0; i < 11; ++i)
+        REQUIRE(impl::findNextQuote(quoted + i, quoted + 17, '"') == quoted + 10);
+    REQUIRE(impl::findNextQuote(quoted + 11, quoted + 17, '"') == quoted + 17);
+    REQUIRE(impl::findNextQuote(quoted, quoted + 10, '"') == quoted + 10);
+}
+
+TEST_CASE("parse options")
+{
+    std::string html(
+R"(<!DOCTYPE html>
+<?xml version="1.0"?>
+<html>
+  <head>
+    <title>Options</title>
+    <script> if (a < b) x = "<p>"; </script>
+    <style>p { color: red; }</style>
+  </head>
+  <body>
+    <!-- comment -->
+    <%= server %>
+    <p>Text <b>bold</b> </p></3>
+    <textarea>  </textarea></i>
+    <ul>
+      <li>one
+      <li>two
+    </ul>
+  </body>
+</html>
+)");
+    ParserDom full;
+    const Tree &all = full.parseTree(html);
+    ParseOptions options;
+    options.whitespaceText = false;
+    options.comments = false;
+    options.processingInstructions = false;
+    options.literalText = false;
+    ParserDom parser;
+    parser.setOptions(options);
+    const Tree &tree = parser.parseTree(html);
+    REQUIRE(tree.size() * 2 <= all.size());
+
+    // The same tree without the dropped leaves
+    Tree::iterator it = tree.begin();
+    for (Tree::iterator ait = all.begin(); ait != all.end(); ++ait)
+    {
+        const std::string parent = Tree::parent(ait) ? Tree::parent(ait)->tagName() : "";
+        const bool literal = parent == "script" || parent == "style" || parent == "textarea";
+        std::string text = ait->text();
+        if (ait->isText() && literal)
+            text.clear();
+        else if (ait->isText() && text.find_first_not_of(" \n") == std::string::npos)
+            continue;
+        else if (ait->isComment() && !(text.length() > 2 && text[1] == '/' && ::isalpha(text[2])))
+            continue;
+        REQUIRE(it != tree.end());
+        REQUIRE(Tree::depth(it) == Tree::depth(ait));
+        REQUIRE(it->kind() == ait->kind());
+        REQUIRE(it->text() == text);
+        REQUIRE(it->offset() == ait->offset());
+        REQUIRE(it->length() == ait->length());
+        ++it;
+    }
+    REQUIRE(it == tree.end());
+    // Literal text keeps where it is
+    Tree::iterator script = tree.begin();
+    while (script->tagName() != "script")
+        ++script;
+    REQUIRE(html.substr(script.begin()->offset(), script.begin()->length()) == R"( if (a < b) x = "<p>"; )");
+
+    options = ParseOptions();
+    options.comments = false;
+    parser.setOptions(options);
+    size_t comments = 0;
+    for (Tree::iterator it = parser.parseTree(html).begin(); it != parser.root().end(); ++it)
+        if (it->isComment())
+        {
+            ++comments;
+            REQUIRE((it->text()[1] == '?' || it->text()[1] == '%' || it->text() == "</i>"));
+        }
+    REQUIRE(comments == 3);
+
+    // Same trees from the other parsers
+    options.whitespaceText = false;
+    options.literalText = false;
+    parser.setOptions(options);
+    std::string big;
+    for (int i = 0; i < 100; ++i)
+        big += html;
+    ParserDomParallel parallel(4, 2048);
+    parallel.setOptions(options);
+    requireSameTree(parallel.parseTree(big), parser.parseTree(big));
+
+    ParserDomIncremental incremental;
+    incremental.setOptions(options);
+    incremental.parseTree(html);
+    const char *fragments[] = { "x", " ", "\n", "<b>", "</b>", "<p>", "</p>", "<!--", "-->",
+        "<script>", "</script>", "<?", "<", ">", "</" };
+    unsigned seed = 54321;
+    auto random = [&seed](size_t n)
+    {
+        seed = seed * 1103515245u + 12345u;
+        return n ? (seed >> 8) % n : 0;
+    };
+    for (int i = 0; i < 400; ++i)
+    {
+        const size_t at = random(html.length() + 1);
+        const size_t removed = std::min(random(4), html.length() - at);
+        const std::string inserted = random(4) ? fragments[random(sizeof(fragments) / sizeof(fragments[0]))] : "";
+        html.replace(at, removed, inserted);
+        requireSameTree(incremental.update(html, at, removed, inserted.length()), parser.parseTree(html));
+    }
+}
+
+TEST_CASE("lazy parse")
+{
+    std::string html(
+R"(<html><head><title>Doc</title><script>var a = "<div>";</script></head>
+<body><div id="main"><p>First <b>bold</b> paragraph</p>
+<ul><li>one<li>two</ul><!-- comment -->
+<div class="x"><span>deep <i>text</i></span></div><br><img src="a.png">
+<p>Unclosed <em>em</p><textarea><b>raw</b></textarea></div>
+<section><p>Last</p></section></body></html>)");
+    ParserDom reference;
+    const Tree &expected = reference.parseTree(html);
+
+    // Only the first levels are built until asked for
+    ParserDomLazy parser(3);
+    parser.parseTree(html);
+    ParserDomLazy::iterator walk = parser.begin();
+    while (walk->tagName() != "div")
+        ++walk;
+    Tree::iterator main = walk.base();
+    REQUIRE(!parser.isExpanded(main));
+    REQUIRE(main.number_of_children() == 0);
+    Tree::sibling_iterator child = parser.children(main);
+    REQUIRE(parser.isExpanded(main));
+    Tree::iterator expectedMain = expected.begin();
+    while (expectedMain->tagName() != "div")
+        ++expectedMain;
+    Tree::sibling_iterator expectedChild = expectedMain.begin();
+    for (; expectedChild != expectedMain.end(); ++child, ++expectedChild)
+    {
+        REQUIRE(child != main.end());
+        REQUIRE(child->offset() == expectedChild->offset());
+        REQUIRE(child->length() == expectedChild->length());
+        REQUIRE(child->text() == expectedChild->text());
+    }
+    REQUIRE(child == main.end());
+    requireSameTree(parser.expandAll(), expected);
+
+    // Iterators build what they go through, and nothing they skip
+    const size_t mainOffset = main->offset();
+    parser.parseTree(html);
+    Tree::iterator expectedIt = expected.begin();
+    for (ParserDomLazy::iterator it = parser.begin(); it != parser.end(); ++it, ++expectedIt)
+    {
+        REQUIRE(it->offset() == expectedIt->offset());
+        REQUIRE(it->text() == expectedIt->text());
+        if (it->offset() == mainOffset)
+        {
+            it.skipChildren();
+            expectedIt.skip_children();
+            REQUIRE(!parser.isExpanded(it.base()));
+        }
+    }
+    REQUIRE(expectedIt == expected.end());
+    parser.setTagIndex(true);
+    parser.parseTree(html);
+    ParserDom indexed;
+    indexed.setTagIndex(true);
+    indexed.parseTree(html);
+    REQUIRE(parser.tagIndex().find("li").size() == 2);
+    REQUIRE(parser.tagIndex().find("p").size() == 3);
+    for (size_t i = 0; i < 3; ++i)
+        REQUIRE(parser.tagIndex().find("p")[i]->offset() == indexed.tagIndex().find("p")[i]->offset());
+    requireSameTree(parser.root(), expected);
+
+    // Many elements flattened below the depth built, one after the other
+    std::string flattened("<html><body><div>");
+    for (int i = 0; i < 100000; ++i)
+        flattened += "<p>a<br>b</p>";
+    flattened += "</div></body></html>";
+    parser.parseTree(flattened);
+    size_t walked = 0;
+    for (ParserDomLazy::iterator it = parser.begin(); it != parser.end(); ++it)
+        ++walked;
+    REQUIRE(walked == reference.parseTree(flattened).size());
+
+    // Same trees at any depth, whatever closes the elements left unbuilt
+    const char *fragments[] = { "x", " ", "<b>", "</b>", "<div>", "</div>", "</p>", "<p>",
+        "<!--", "-->", "<script>", "</script>", "<", ">", "</", "<li>", "</span>", "</body>",
+        "<i>t</i>", "<textarea>", "</textarea>", "<DIV>", "</Div>" };
+    unsigned seed = 2468;
+    auto random = [&seed](size_t n)
+    {
+        seed = seed * 1103515245u + 12345u;
+        return n ? (seed >> 8) % n : 0;
+    };
+    for (int i = 0; i < 300; ++i)
+    {
+        std::string document;
+        const size_t count = random(60);
+        for (size_t j = 0; j < count; ++j)
+            document += fragments[random(sizeof(fragments) / sizeof(fragments[0]))];
+        reference.parseTree(document);
+        for (size_t depth = 1; depth < 5; ++depth)
+        {
+            ParserDomLazy lazy(depth);
+            lazy.parseTree(document);
+            requireSameTree(lazy.expandAll(), expected);
+
+            // Walking the nodes as they are built
+            lazy.parseTree(document);
+            Tree::iterator expectedIt = expected.begin();
+            for (ParserDomLazy::iterator it = lazy.begin(); it != lazy.end(); ++it, ++expectedIt)
+            {
+                REQUIRE(expectedIt != expected.end());
+                REQUIRE(it->offset() == expectedIt->offset());
+                REQUIRE(it->length() == expectedIt->length());
+                REQUIRE(*it == *expectedIt);
+            }
+            REQUIRE(expectedIt == expected.end());
+            requireSameTree(lazy.root(), expected);
+        }
+    }
+}
+
+TEST_CASE("parse budget")
+{
+    std::string page(
+R"(<div class="item"><a href="/x?a=1">link</a><script>var a = "<p>";</script>
+<!-- comment --><p>Text <br> more<span>x</span></p></div>
+)");
+    std::string html("<html><body>");
+    for (int i = 0; i < 2000; ++i)
+        html += page;
+    html += "</body></html>";
+
+    ParserDom parser, reference;
+    requireSameTree(parser.parseTree(html), reference.parseTree(html));
+    REQUIRE(parser.status() == PARSE_COMPLETE);
+
+    // Stopped parses leave the tree of the bytes parsed
+    ParseBudget budget;
+    budget.maxBytes = 10000;
+    parser.setBudget(budget);
+    const Tree &bytes = parser.parseTree(html);
+    REQUIRE(parser.status() == PARSE_BYTE_LIMIT);
+    REQUIRE(bytes.begin()->length() >= 10000);
+    REQUIRE(bytes.begin()->length() < 10100);
+    requireSameTree(bytes, reference.parseTree(html.substr(0, bytes.begin()->length())));
+
+    budget = ParseBudget();
+    budget.maxTokens = 1000;
+    parser.setBudget(budget);
+    const Tree tokens = parser.parseTree(html);
+    REQUIRE(parser.status() == PARSE_TOKEN_LIMIT);
+    requireSameTree(tokens, reference.parseTree(html.substr(0, tokens.begin()->length())));
+    struct Counter : public ParserSax
+    {
+        Counter() : count(0) { }
+        void onFoundTag(Node&, bool) { ++count; }
+        void onFoundText(Node&) { ++count; }
+        void onFoundComment(Node&) { ++count; }
+        size_t count;
+    } counter;
+    counter.setBudget(budget);
+    counter.parse(html);
+    REQUIRE(counter.status() == PARSE_TOKEN_LIMIT);
+    REQUIRE(counter.count >= 1000);
+    REQUIRE(counter.count <= 1001);
+
+    budget = ParseBudget();
+    budget.maxDepth = 3;
+    parser.setBudget(budget);
+    const Tree depth = parser.parseTree(html);
+    REQUIRE(parser.status() == PARSE_DEPTH_LIMIT);
+    REQUIRE(depth.begin()->length() == html.find("<a "));
+    REQUIRE(depth.max_depth(depth.begin()) == 3);
+    requireSameTree(depth, reference.parseTree(html.substr(0, depth.begin()->length())));
+
+    // The clock is only read now and then
+    budget = ParseBudget();
+    budget.deadline = 1;
+    parser.setBudget(budget);
+    const Tree &late = parser.parseTree(html);
+    REQUIRE(parser.status() == PARSE_DEADLINE_EXCEEDED);
+    REQUIRE(late.begin()->length() < html.length());
+    requireSameTree(late, reference.parseTree(html.substr(0, late.begin()->length())));
+
+    budget = ParseBudget();
+    budget.timeout = 60000000000ull;
+    budget.maxDepth = 10;
+    parser.setBudget(budget);
+    requireSameTree(parser.parseTree(html), reference.parseTree(html));
+    REQUIRE(parser.status() == PARSE_COMPLETE);
+
+    // ParserDomParallel parses serially with a budget
+    budget = ParseBudget();
+    budget.maxTokens = 1000;
+    ParserDomParallel parallel(4, 4096);
+    parallel.setBudget(budget);
+    requireSameTree(parallel.parseTree(html), tokens);
+    REQUIRE(parallel.status() == PARSE_TOKEN_LIMIT);
+    parallel.setBudget(ParseBudget());
+    requireSameTree(parallel.parseTree(html), reference.parseTree(html));
+    REQUIRE(parallel.status() == PARSE_COMPLETE);
+
+    // ParserDomLazy builds everything with a budget, whatever its depth
+    for (size_t levels = 1; levels < 4; ++levels)
+    {
+        ParserDomLazy lazy(levels);
+        budget = ParseBudget();
+        budget.maxDepth = 3;
+        lazy.setBudget(budget);
+        lazy.parseTree(html);
+        REQUIRE(lazy.status() == PARSE_DEPTH_LIMIT);
+        size_t walked = 0;
+        for (ParserDomLazy::iterator it = lazy.begin(); it != lazy.end(); ++it, ++walked)
+            REQUIRE(lazy.isExpanded(it.base()));
+        REQUIRE(walked == depth.size());
+        requireSameTree(lazy.root(), depth);
+        budget = ParseBudget();
+        budget.maxTokens = 1000;
+        lazy.setBudget(budget);
+        lazy.parseTree(html);
+        REQUIRE(lazy.status() == PARSE_TOKEN_LIMIT);
+        requireSameTree(lazy.root(), tokens);
+        lazy.setBudget(ParseBudget());
+        lazy.parseTree(html);
+        REQUIRE(lazy.status() == PARSE_COMPLETE);
+        requireSameTree(lazy.root(), reference.parseTree(html));
+    }
+
+    // ParserDomIncremental parses again what a budget stopped
+    ParserDomIncremental incremental;
+    budget = ParseBudget();
+    budget.maxBytes = 1000;
+    incremental.setBudget(budget);
+    reference.setBudget(budget);
+    incremental.parseTree(html);
+    REQUIRE(incremental.status() == PARSE_BYTE_LIMIT);
+    std::string edited(html);
+    const size_t link = edited.find("link");
+    edited.replace(link, 4, "anchor");
+    requireSameTree(incremental.update(edited, link, 4, 6), reference.parseTree(edited));
+    REQUIRE(incremental.status() == PARSE_BYTE_LIMIT);
+    const size_t last = edited.rfind("more");
+    edited.replace(last, 4, "less");
+    requireSameTree(incremental.update(edited, last, 4, 4), reference.parseTree(edited));
+    incremental.setBudget(ParseBudget());
+    reference.setBudget(ParseBudget());
+    edited.insert(last, "x");
+    requireSameTree(incremental.update(edited, last, 0, 1), reference.parseTree(edited));
+    REQUIRE(incremental.status() == PARSE_COMPLETE);
+    REQUIRE(incremental.reparsedLength() == edited.length());
+    edited.erase(last, 1);
+    requireSameTree(incremental.update(edited, last, 1, 0), reference.parseTree(edited));
+    REQUIRE(incremental.reparsedLength() < 100);
+}
+
+TEST_CASE("offset index")
+{
+    std::string html(
+R"(<html><head><title>Doc</title></head>
+<body><div id="main"><p>First <b>bold</b> paragraph</p>
+<ul><li>one<li>two</ul><!-- comment --><p>Unclosed <em>em</p>
+<section><p>Last</p></section></body></html><div><span>open)");
+    ParserDom parser;
+    const Tree &tree = parser.parseTree(html);
+    OffsetIndex index(tree);
+    REQUIRE(index.size() == tree.size());
+
+    Tree::iterator node = index.find(html.find("old"));
+    REQUIRE(node->isText());
+    REQUIRE(node->text() == "bold");
+    node = index.find(html.find("</b>") + 2);
+    REQUIRE(node->tagName() == "b");
+    node = index.find(html.find("First"), html.find(" paragraph"));
+    REQUIRE(node->tagName() == "p");
+    REQUIRE(node->offset() == html.find("<p>"));
+    REQUIRE(index.find(0, html.length())->isRoot());
+    REQUIRE(!index.find(html.length()));
+    REQUIRE(index.find(html.find("open"))->text() == "open");
+
+    std::pair<OffsetIndex::Nodes::const_iterator, OffsetIndex::Nodes::const_iterator> range =
+        index.startingIn(html.find("<ul>"), html.find("<!--"));
+    REQUIRE(range.second - range.first == 5);
+    REQUIRE((*range.first)->tagName() == "ul");
+    REQUIRE((*(range.second - 1))->text() == "two");
+
+    // Same as looking at every node, on malformed documents too
+    const char *fragments[] = { "x", " ", "<b>", "</b>", "<div>", "</div>", "</p>", "<p>",
+        "<!--", "-->", "<script>", "</script>", "<", ">", "</", "<li>", "</span>", "</body>",
+        "<i>t</i>", "<textarea>", "</textarea>" };
+    unsigned seed = 97531;
+    auto random = [&seed](size_t n)
+    {
+        seed = seed * 1103515245u + 12345u;
+        return n ? (seed >> 8) % n : 0;
+    };
+    for (int i = 0; i < 200; ++i)
+    {
+        std::string document;
+        const size_t count = random(80);
+        for (size_t j = 0; j < count; ++j)
+            document += fragments[random(sizeof(fragments) / sizeof(fragments[0]))];
+        const Tree &parsed = parser.parseTree(document);
+        index.build(parsed);
+        for (size_t begin = 0; begin <= document.length(); ++begin)
+        {
+            const size_t end = begin + random(8) + 1;
+            Tree::iterator expected, found = index.find(begin, end);
+            for (Tree::iterator it = parsed.begin(); it != parsed.end(); ++it)
+                if (it->offset() <= begin && it->offset() + it->length() >= end)
+                    expected = it;
+            REQUIRE(found == expected);
+        }
+    }
+}
+
+TEST_CASE("line index")
+{
+    std::string html("<html>\r\n<body>\n<p>caf\xc3\xa9 \xe2\x82\xac <b>x</b></p>\n\n<!-- end -->");
+    LineIndex lines(html);
+    REQUIRE(lines.lines() == 5);
+    REQUIRE(lines.lineOffset(1) == 0);
+    REQUIRE(lines.lineOffset(3) == html.find("<p>"));
+    REQUIRE(lines.lineOffset(6) == html.length());
+
+    LineIndex::Position position = lines.position(html.find("<b>"));
+    REQUIRE(position.line == 3);
+    REQUIRE(position.column == 14);
+    position = lines.utf8Position(html.find("<b>"), html);
+    REQUIRE(position.line == 3);
+    REQUIRE(position.column == 11);
+    position = lines.position(html.find('\r'));
+    REQUIRE(position.line == 1);
+    REQUIRE(position.column == 7);
+    position = lines.position(html.length() + 10);
+    REQUIRE(position.line == 5);
+    REQUIRE(position.column == 13);
+
+    // Every offset of a longer document
+    std::string document;
+    for (int i = 0; i < 300; ++i)
+        document += i % 7 ? "<p>\xc3\xa9t\xc3\xa9 text</p>" : "\n";
+    lines.build(document);
+    size_t line = 1, column = 1, characters = 1;
+    for (size_t offset = 0; offset <= document.length(); ++offset)
+    {
+        position = lines.position(offset);
+        REQUIRE(position.line == line);
+        REQUIRE(position.column == column);
+        REQUIRE(lines.utf8Position(offset, document).column == characters);
+        if (offset < document.length() && document[offset] == '\n')
+            line++, column = characters = 1;
+        else
+        {
+            ++column;
+            if (offset + 1 >= document.length() || (document[offset + 1] & 0xc0) != 0x80)
+                ++characters;
+        }
+    }
+}
+
+static void requireSameHashes(const Tree &lhs, const Tree &rhs)
+{
+    REQUIRE(lhs.size() == rhs.size());
+    for (Tree::iterator it = lhs.begin(), rit = rhs.begin(); it != lhs.end(); ++it, ++rit)
+        REQUIRE(it->hash() == rit->hash());
+}
+
+TEST_CASE("subtree hashes")
+{
+    const std::string nav("<nav><ul><li><a href=\"/\">Home</a><li><a href=\"/about\">About</a></ul></nav>");
+    const std::string first("<html><body>" + nav + "<p>First page</p></body></html>");
+    const std::string second("<html><body><div>" + nav + "</div><p>Second <b>page</b></p></body></html>");
+    ParserDom parser;
+    parser.setSubtreeHashes(true);
+    Tree one = parser.parseTree(first);
+    const Tree &two = parser.parseTree(second);
+
+    // The same navigation in both documents, the rest differs
+    Tree::iterator navOne = std::find_if(one.begin(), one.end(), [](const Node &node) { return node.tagName() == "nav"; });
+    Tree::iterator navTwo = std::find_if(two.begin(), two.end(), [](const Node &node) { return node.tagName() == "nav"; });
+    REQUIRE(navOne->hash() == navTwo->hash());
+    REQUIRE(one.begin()->hash() != two.begin()->hash());
+    REQUIRE(Tree::parent(navOne)->hash() != Tree::parent(navTwo)->hash());
+
+    // Consistent with Node::operator==, which ignores case and attributes
+    Tree upper = parser.parseTree("<P CLASS=a>Some TEXT<BR></P>");
+    const Tree &lower = parser.parseTree("<p>some text<br></p>");
+    REQUIRE(upper.begin()->hash() == lower.begin()->hash());
+    REQUIRE(upper.equal_subtree(upper.begin(), lower.begin()));
+
+    // Hashes match equal_subtree() on every pair of nodes of random documents,
+    // and are the same from every parser
+    const char *fragments[] = { "x", "X", " ", "<b>", "</b>", "<div>", "</div>", "</p>", "<p>",
+        "<!--", "-->", "<script>", "</script>", "<", ">", "</", "<li>", "</span>", "<i>t</i>" };
+    unsigned seed = 8642;
+    auto random = [&seed](size_t n)
+    {
+        seed = seed * 1103515245u + 12345u;
+        return n ? (seed >> 8) % n : 0;
+    };
+    ParserDomParallel parallel(4, 16);
+    parallel.setSubtreeHashes(true);
+    ParserDomIncremental incremental;
+    incremental.setSubtreeHashes(true);
+    std::string html("<div><p>start</p></div>");
+    incremental.parseTree(html);
+    for (int i = 0; i < 200; ++i)
+    {
+        std::string document;
+        const size_t count = random(40);
+        for (size_t j = 0; j < count; ++j)
+            document += fragments[random(sizeof(fragments) / sizeof(fragments[0]))];
+        const Tree &tree = parser.parseTree(document);
+        for (Tree::iterator a = tree.begin(); a != tree.end(); ++a)
+            for (Tree::iterator b = a; b != tree.end(); ++b)
+                REQUIRE((a->hash() == b->hash()) == tree.equal_subtree(a, b));
+
+        requireSameHashes(parallel.parseTree(document), tree);
+        ParserDomLazy lazy(2);
+        lazy.setSubtreeHashes(true);
+        lazy.parseTree(document);
+        requireSameHashes(lazy.expandAll(), tree);
+
+        const size_t at = random(html.length() + 1);
+        const size_t removed = std::min(random(4), html.length() - at);
+        const std::string inserted = fragments[random(sizeof(fragments) / sizeof(fragments[0]))];
+        html.replace(at, removed, inserted);
+        requireSameHashes(incremental.update(html, at, removed, inserted.length()), parser.parseTree(html));
+    }
+}
+
+static size_t editedNodes(const Tree &tree, const std::vector<TreeDiff::Edit> &edits,
+        TreeDiff::Operation operation)
+{
+    size_t nodes = 0;
+    for (size_t i = 0; i < edits.size(); ++i)
+    {
+        if (edits[i].operation != operation)
+            continue;
+        const Tree::iterator &it = operation == TreeDiff::DIFF_REMOVE ? edits[i].before : edits[i].after;
+        nodes += tree.size(it);
+    }
+    return nodes;
+}
+
+TEST_CASE("tree diff")
+{
+    std::string page("<html><head><title>News</title></head><body><nav><a href=\"/\">Home</a></nav>\n");
+    for (int i = 0; i < 50; ++i)
+        page += "<div class=\"item\"><h2>Title " + std::to_string(i) + "</h2><p>Text <b>" + std::to_string(i) + "</b></p></div>\n";
+    page += "<footer>(c)</footer></body></html>";
+    ParserDom parser;
+    Tree before = parser.parseTree(page);
+    TreeDiff diff;
+    REQUIRE(diff.compute(before, before).empty());
+    REQUIRE(diff.matched() == before.size());
+
+    // One of each edit, the item removed going with its line break
+    std::string changed(page);
+    changed.replace(changed.find("Title 7"), 7, "Title seven");
+    changed.replace(changed.find("<div class=\"item\"><h2>Title 20"), 0, "<div class=\"ad\">Buy</div>");
+    const size_t removed = changed.find("<div class=\"item\"><h2>Title 30");
+    changed.erase(removed, changed.find("<div", removed + 1) - removed);
+    changed.replace(changed.find("href=\"/\""), 8, "href=\"/home\"");
+    Tree after = parser.parseTree(changed);
+    const std::vector<TreeDiff::Edit> &edits = diff.compute(before, after);
+    REQUIRE(edits.size() == 5);
+    REQUIRE(edits[0].operation == TreeDiff::DIFF_MODIFY);
+    REQUIRE(edits[0].after->text() == "<a href=\"/home\">");
+    REQUIRE(edits[1].operation == TreeDiff::DIFF_MODIFY);
+    REQUIRE(edits[1].before->text() == "Title 7");
+    REQUIRE(edits[1].after->text() == "Title seven");
+    REQUIRE(edits[2].operation == TreeDiff::DIFF_INSERT);
+    REQUIRE(edits[2].after->text() == "<div class=\"ad\">");
+    REQUIRE(edits[2].before->tagName() == "body");
+    REQUIRE(edits[3].operation == TreeDiff::DIFF_REMOVE);
+    REQUIRE(edits[3].before->text() == "\n");
+    REQUIRE(edits[4].operation == TreeDiff::DIFF_REMOVE);
+    REQUIRE(edits[4].before->text() == "<div class=\"item\">");
+    REQUIRE(edits[4].before.begin().begin()->text() == "Title 30");
+    REQUIRE(edits[4].after->tagName() == "body");
+
+    // Every node is matched, removed or inserted, on random edits
+    const char *fragments[] = { "x", " ", "<b>", "</b>", "<div>", "</div>", "</p>", "<p>",
+        "<!--", "-->", "<", ">", "</", "<li>", "<i>t</i>" };
+    unsigned seed = 1357;
+    auto random = [&seed](size_t n)
+    {
+        seed = seed * 1103515245u + 12345u;
+        return n ? (seed >> 8) % n : 0;
+    };
+    std::string html(page);
+    for (int i = 0; i < 200; ++i)
+    {
+        std::string edited(html);
+        for (size_t k = random(4); k > 0; --k)
+        {
+            const size_t at = random(edited.length() + 1);
+            edited.replace(at, std::min(random(20), edited.length() - at),
+                    fragments[random(sizeof(fragments) / sizeof(fragments[0]))]);
+        }
+        before = parser.parseTree(html);
+        after = parser.parseTree(edited);
+        const std::vector<TreeDiff::Edit> &script = diff.compute(before, after);
+        REQUIRE(diff.matched() + editedNodes(before, script, TreeDiff::DIFF_REMOVE) == before.size());
+        REQUIRE(diff.matched() + editedNodes(after, script, TreeDiff::DIFF_INSERT) == after.size());
+        for (size_t k = 0; k < script.size(); ++k)
+            if (script[k].operation == TreeDiff::DIFF_MODIFY)
+            {
+                REQUIRE(script[k].before->kind() == script[k].after->kind());
+                REQUIRE(script[k].before->tagName() == script[k].after->tagName());
+                REQUIRE((script[k].before->text() != script[k].after->text()
+                            || script[k].before->closingText() != script[k].after->closingText()));
+            }
+        if (html == edited)
+            REQUIRE(script.empty());
+        html = edited;
+    }
+}
+
+TEST_CASE("shared attributes")
+{
+    std::string page("<html><body>\n");
+    for (int i = 0; i < 300; ++i)
+        page += "<div class=\"item\" id=\"i" + std::to_string(i) + "\"><a href=\"/" + std::to_string(i)
+            + "\" TITLE='t' hidden>link</a></div>\n";
+    page += "</body></html>";
+    ParserDom parser;
+    const Tree expected = parser.parseTree(page);
+    for (Tree::iterator it = expected.begin(); it != expected.end(); ++it)
+        it->parseAttributes();
+
+    // Not parsed yet: empty, and copies stay unparsed
+    const Tree shared = parser.parseTree(page);
+    const Tree::iterator div = std::find_if(shared.begin(), shared.end(),
+            [](const Node &node) { return node.tagName() == "div"; });
+    REQUIRE(div->attributeKeys().empty());
+    REQUIRE(!div->hasAttribute("class"));
+    REQUIRE(Tree(shared).begin()->attributeKeys().empty());
+
+    // Every thread parses every node, in a different order
+    std::vector<std::thread> threads;
+    std::vector<size_t> found(8, 0);
+    for (size_t t = 0; t < found.size(); ++t)
+        threads.push_back(std::thread([&shared, &found, t]()
+        {
+            std::vector<Tree::iterator> nodes;
+            for (Tree::iterator it = shared.begin(); it != shared.end(); ++it)
+                nodes.push_back(it);
+            std::rotate(nodes.begin(), nodes.begin() + t * nodes.size() / 8, nodes.end());
+            if (t % 2)
+                std::reverse(nodes.begin(), nodes.end());
+            std::string value;
+            for (size_t i = 0; i < nodes.size(); ++i)
+            {
+                const Node &node = *nodes[i];
+                node.parseAttributes();
+                if (node.attribute("href", value) && value[0] == '/')
+                    ++found[t];
+                found[t] += node.attributeKeys().size() == node.attributeValues().size() ? 0 : 1000000;
+            }
+        }));
+    for (size_t t = 0; t < threads.size(); ++t)
+        threads[t].join();
+    for (size_t t = 0; t < found.size(); ++t)
+        REQUIRE(found[t] == 300);
+
+    for (Tree::iterator it = shared.begin(), other = expected.begin(); it != shared.end(); ++it, ++other)
+    {
+        REQUIRE(it->attributeKeys() == other->attributeKeys());
+        REQUIRE(it->attributeValues() == other->attributeValues());
+    }
+    REQUIRE(div->parseAttributes() == 2);
+    const Tree copy(shared);
+    std::string value;
+    REQUIRE(std::find_if(copy.begin(), copy.end(),
+            [](const Node &node) { return node.tagName() == "div"; })->attribute("id", value));
+    REQUIRE(value == "i0");
+}
@@ -0,0 +1,119 @@
+// htmlcxx2.
+// A simple non-validating parser written in C++.
+//
+// Tests of the instrumented build: ParserStats counted and the global
+// operator new replaced. Kept apart so that test.cpp runs on the defaults.
+
+#define CATCH_CONFIG_MAIN
+#define HTMLCXX2_STATS
+#include <htmlcxx2/htmlcxx2_html.hpp>
+#include <htmlcxx2/htmlcxx2_parallel.hpp>
+#define HTMLCXX2_COUNT_ALLOCATIONS
+#include <htmlcxx2/htmlcxx2_memory.hpp>
+#include "catch.hpp"
+
+using namespace htmlcxx2::HTML;
+
+TEST_CASE("parser stats")
+{
+    const std::string html("<html><body><p class=\"x\" id=y>a <b>b</p>"
+            "<script>x = \"<p>\";</script><!-- c --></div></body></html>");
+    ParserDom parser;
+    parser.parseTree(html);
+    const ParserStats &stats = parser.stats();
+    REQUIRE(stats.bytes == html.length());
+    REQUIRE(stats.tags == 5);
+    REQUIRE(stats.closingTags == 5);
+    REQUIRE(stats.texts == 3);
+    REQUIRE(stats.comments == 1);
+    REQUIRE(stats.literalBytes == 10);
+    REQUIRE(stats.attributes == 2);
+    REQUIRE(stats.maxDepth == 4);
+    // </p> walks over <b> and flattens it, </div> walks up to the root
+    REQUIRE(stats.closingSteps == 7);
+    REQUIRE(stats.flattens == 1);
+    REQUIRE(stats.unmatchedClosingTags == 1);
+
+    // Reset by each parse
+    parser.parseTree("<p>x</p>");
+    REQUIRE(parser.stats().bytes == 8);
+    REQUIRE(parser.stats().tags == 1);
+    REQUIRE(parser.stats().maxDepth == 1);
+    REQUIRE(parser.stats().flattens == 0);
+
+    // Tokens only without a tree
+    ParserSax sax;
+    sax.parse(html);
+    REQUIRE(sax.stats().tags == 5);
+    REQUIRE(sax.stats().bytes == html.length());
+    REQUIRE(sax.stats().closingSteps == 0);
+    REQUIRE(sax.stats().maxDepth == 0);
+
+    // Invalid UTF-8, counted the same by the parallel parser
+    std::string big;
+    for (int i = 0; i < 2000; ++i)
+        big += i % 7 ? "<li>caf\xc3\xa9 <a href=\"/\">link</a></li>\n" : "<li>caf\xe9 <a href=\"/\xff\">link</a></li>\n";
+    parser.setValidateUtf8(true);
+    parser.parseTree(big);
+    REQUIRE(parser.stats().invalidUtf8 == 2 * 286);
+    ParserDomParallel parallel(4, 4096);
+    parallel.setValidateUtf8(true);
+    parallel.parseTree(big);
+    REQUIRE(parallel.stats().invalidUtf8 == 2 * 286);
+}
+
+TEST_CASE("memory usage")
+{
+    const std::string html = "<html><body><div class=\"a long class name, past the inline buffer\" id=x>"
+        "<p>short</p><p>a text long enough to be allocated on the heap</p>"
+        "<!-- a comment --><br></div></body></html>";
+    REQUIRE(AllocationCounter::enabled());
+
+    ParserDom parser;
+    const MemoryUsage empty = parser.memoryUsage();
+    REQUIRE(empty.nodeAllocations == 2);
+    REQUIRE(empty.allocations() == 2);
+
+    AllocationCounter counter;
+    const Tree &tree = parser.parseTree(html);
+    const size_t live = counter.live();
+    REQUIRE(counter.allocations() > tree.size());
+    REQUIRE(counter.bytes() > 0);
+    MemoryUsage usage = parser.memoryUsage();
+    REQUIRE(usage.nodeAllocations == tree.size() + 2);
+    REQUIRE(usage.nodeBytes == usage.nodeAllocations * sizeof(kp::tree_node_<Node>));
+    REQUIRE(usage.stringAllocations >= 3);
+    REQUIRE(usage.attributeAllocations == 0);
+    REQUIRE(usage.indexAllocations == 0);
+    // Counted from the structures, the same as the allocator saw (the
+    // sentinels were allocated with the parser)
+    REQUIRE(live + 2 == usage.allocations());
+
+    counter.reset();
+    for (Tree::iterator it = tree.begin(); it != tree.end(); ++it)
+        it->parseAttributes();
+    const size_t attributesLive = counter.live();
+    usage = parser.memoryUsage();
+    // Two vectors and the long value of class
+    REQUIRE(usage.attributeAllocations == 3);
+    REQUIRE(attributesLive == usage.attributeAllocations);
+
+    parser.setTagIndex(true);
+    parser.parseTree(html);
+    usage = parser.memoryUsage();
+    REQUIRE(usage.indexAllocations > 0);
+    REQUIRE(usage.bytes() > usage.nodeBytes + usage.indexBytes);
+
+#ifdef __cpp_aligned_new
+    struct alignas(64) Line { char bytes[64]; };
+    std::vector<Line> lines;
+    counter.reset();
+    lines.resize(3);
+    const size_t allocations = counter.allocations(), bytes = counter.bytes();
+    std::vector<Line>().swap(lines);
+    const size_t linesLive = counter.live();
+    REQUIRE(allocations == 1);
+    REQUIRE(bytes == 3 * sizeof(Line));
+    REQUIRE(linesLive == 0);
+#endif
+}